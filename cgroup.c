@@ -0,0 +1,434 @@
+/* > cgroup.c
+ *
+ * Test and repair binaries in cgroups of their own. With "cgroup-directory"
+ * set, each binary gets a leaf cgroup (v2) under that directory, named after
+ * its path, with "cgroup-cpu-max" (percent of one CPU) written to its
+ * cpu.max and "cgroup-memory-max" (MiB) to its memory.max. A runaway check
+ * is then throttled, or OOM-killed within its leaf, rather than taking the
+ * CPU or memory of the system the watchdog is looking after.
+ *
+ * The directory has to be one we may write to that holds no processes,
+ * such as a cgroup of its own under the root, or a subtree delegated to the
+ * watchdog by its service manager. It is made if need be, and the cpu and
+ * memory controllers are enabled for its children.
+ *
+ * glibc has no way for posix_spawn() to start a child in a cgroup, and one
+ * moved there by the parent afterwards may have forked already, so with a
+ * leaf cgroup_spawn() runs the binary by way of /bin/sh, which moves itself
+ * into the leaf and then execs it. That costs an extra exec, but nothing the
+ * binary starts can be left outside. A child of run_func_as_child() moves
+ * itself before its exec.
+ *
+ * After each run the leaf's cpu.stat, memory.peak and memory.events are
+ * read back: they are logged when verbose, and served as counters by the
+ * metrics socket. Those are for the leaf as a whole since it was made, so
+ * memory.peak is the largest of any run.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <spawn.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <linux/limits.h>
+#include <linux/magic.h>
+
+#include "extern.h"
+#include "watch_err.h"
+
+#define CPU_PERIOD	100000	/* Microseconds, the kernel's default for cpu.max. */
+#define MAX_ARGS	16
+
+/* Run as: sh -c ENTER <leaf>/cgroup.procs <binary> <arguments>... */
+#define ENTER_SCRIPT	"echo 0 >\"$0\"; exec \"$@\""
+
+struct leaf {
+	struct cgroup_usage usage;	/* usage.name is 'path'. */
+	char *path;			/* Of the binary. */
+	char *dir;			/* Of the leaf, NULL if it could not be made. */
+	char *procs;			/* Its cgroup.procs. */
+	struct leaf *next;
+};
+
+extern char **environ;
+
+static struct leaf *leaf_head = NULL;
+static int available = FALSE;
+
+/* ================================================================= */
+
+static int put_value(const char *dir, const char *file, const char *val)
+{
+	char name[PATH_MAX];
+	int fd, err = ENOERR;
+
+	if (snprintf(name, sizeof(name), "%s/%s", dir, file) >= (int)sizeof(name))
+		return ENAMETOOLONG;
+
+	fd = open(name, O_WRONLY | O_CLOEXEC);
+	if (fd < 0)
+		return errno;
+
+	if (write(fd, val, strlen(val)) < 0)
+		err = errno;
+
+	close(fd);
+	return err;
+}
+
+/*
+ * Read the "key value" lines of 'file' in 'dir', for the keys in 'keys',
+ * into 'vals' of the same order. A file of one bare number, as memory.peak
+ * is, is read with a key of "". Keys not found are left alone.
+ */
+
+static int get_values(const char *dir, const char *file, const char *const *keys, int nkeys, unsigned long long *vals)
+{
+	char name[PATH_MAX], line[128];
+	FILE *fp;
+
+	if (snprintf(name, sizeof(name), "%s/%s", dir, file) >= (int)sizeof(name))
+		return ENAMETOOLONG;
+
+	fp = fopen(name, "re");
+	if (fp == NULL)
+		return errno;
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		char *val = strchr(line, ' ');
+		int ii;
+
+		if (val != NULL)
+			*val++ = 0;
+		else
+			val = line;
+
+		for (ii = 0; ii < nkeys; ii++) {
+			if (val == line ? keys[ii][0] == 0 : strcmp(line, keys[ii]) == 0) {
+				vals[ii] = strtoull(val, NULL, 10);
+				break;
+			}
+		}
+	}
+
+	fclose(fp);
+	return ENOERR;
+}
+
+/*
+ * Set the limits of the leaf. The files are not there if the controller is
+ * not enabled, which only matters if there is a limit to set.
+ */
+
+static void set_limits(struct leaf *lf)
+{
+	char val[64];
+	int err;
+
+	if (cgroup_cpu_max > 0)
+		snprintf(val, sizeof(val), "%ld %d", (long)cgroup_cpu_max * CPU_PERIOD / 100, CPU_PERIOD);
+	else
+		snprintf(val, sizeof(val), "max %d", CPU_PERIOD);
+
+	err = put_value(lf->dir, "cpu.max", val);
+	if (err != ENOERR && (err != ENOENT || cgroup_cpu_max > 0))
+		log_message(LOG_ERR, "cannot set cpu.max of %s (errno = %d = '%s')", lf->dir, err, strerror(err));
+
+	if (cgroup_memory_max > 0)
+		snprintf(val, sizeof(val), "%lld", (long long)cgroup_memory_max << 20);
+	else
+		strcpy(val, "max");
+
+	err = put_value(lf->dir, "memory.max", val);
+	if (err != ENOERR && (err != ENOENT || cgroup_memory_max > 0))
+		log_message(LOG_ERR, "cannot set memory.max of %s (errno = %d = '%s')", lf->dir, err, strerror(err));
+}
+
+static struct leaf *find_leaf(const char *path)
+{
+	struct leaf *lf;
+
+	for (lf = leaf_head; lf != NULL; lf = lf->next) {
+		if (strcmp(lf->path, path) == 0)
+			return lf;
+	}
+
+	return NULL;
+}
+
+/*
+ * Make the leaf for 'path', named as systemd would: "/usr/sbin/x" becomes
+ * "usr-sbin-x". One that cannot be made is remembered as such, so we do
+ * not try again at every run.
+ */
+
+static struct leaf *new_leaf(const char *path)
+{
+	struct leaf *lf = (struct leaf *)xcalloc(1, sizeof(struct leaf));
+	char dir[PATH_MAX];
+	char *ptr;
+	int len;
+
+	lf->path = xstrdup(path);
+	lf->usage.name = lf->path;
+	lf->usage.memory_peak = -1;
+	lf->next = leaf_head;
+	leaf_head = lf;
+
+	while (*path == '/')
+		path++;
+
+	len = snprintf(dir, sizeof(dir), "%s/%s", cgroup_dir, path);
+	if (len >= (int)sizeof(dir) || strlen(path) > NAME_MAX) {
+		log_message(LOG_ERR, "cgroup name for %s is too long", lf->path);
+		return lf;
+	}
+
+	for (ptr = dir + strlen(cgroup_dir) + 1; *ptr; ptr++) {
+		if (*ptr == '/')
+			*ptr = '-';
+	}
+
+	if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+		int err = errno;
+		log_message(LOG_ERR, "cannot create cgroup %s (errno = %d = '%s')", dir, err, strerror(err));
+		return lf;
+	}
+
+	lf->dir = xstrdup(dir);
+	lf->procs = (char *)xcalloc(1, strlen(dir) + sizeof("/cgroup.procs"));
+	sprintf(lf->procs, "%s/cgroup.procs", dir);
+	set_limits(lf);
+
+	if (verbose)
+		log_message(LOG_DEBUG, "cgroup for %s is %s", lf->path, lf->dir);
+
+	return lf;
+}
+
+static struct leaf *get_leaf(const char *path)
+{
+	struct leaf *lf;
+
+	if (!available || path == NULL)
+		return NULL;
+
+	lf = find_leaf(path);
+	if (lf == NULL)
+		lf = new_leaf(path);
+
+	return (lf->dir != NULL) ? lf : NULL;
+}
+
+/* ================================================================= */
+
+/*
+ * Make sure the leaf for the binary 'path' is there, before it is run by
+ * run_func_as_child() with exec_in_cgroup().
+ */
+
+void cgroup_prepare(const char *path)
+{
+	get_leaf(path);
+}
+
+/*
+ * posix_spawn() of 'path' with 'argv', whose first is 'path', in its leaf
+ * if there is one.
+ */
+
+int cgroup_spawn(pid_t *pid, const char *path, const posix_spawn_file_actions_t *fa, char *const argv[])
+{
+	struct leaf *lf = get_leaf(path);
+	char *args[MAX_ARGS + 4];
+	int ii;
+
+	if (lf == NULL)
+		return posix_spawn(pid, path, fa, NULL, argv, environ);
+
+	args[0] = "sh";
+	args[1] = "-c";
+	args[2] = ENTER_SCRIPT;
+	args[3] = lf->procs;
+	for (ii = 0; ii < MAX_ARGS && argv[ii] != NULL; ii++)
+		args[ii + 4] = argv[ii];
+	if (ii == MAX_ARGS)
+		return E2BIG;
+	args[ii + 4] = NULL;
+
+	return posix_spawn(pid, "/bin/sh", fa, NULL, args, environ);
+}
+
+/*
+ * For run_func_as_child() in place of exec_as_func(): run the program in
+ * its leaf.
+ */
+
+int exec_in_cgroup(int flags, void *ptr)
+{
+	char **arg = (char **)ptr;
+	struct leaf *lf;
+
+	/* In the child, so find it only, as get_leaf() could allocate. */
+	if (available && arg != NULL && arg[0] != NULL) {
+		lf = find_leaf(arg[0]);
+		if (lf != NULL && lf->dir != NULL) {
+			int err = put_value(lf->dir, "cgroup.procs", "0");
+			if (err != ENOERR)
+				log_message(LOG_ERR, "cannot move %s into %s (errno = %d = '%s')", arg[0], lf->dir, err, strerror(err));
+		}
+	}
+
+	return exec_as_func(flags, ptr);
+}
+
+/*
+ * Read back what the run of 'path' that has just ended has used.
+ */
+
+void cgroup_collect(const char *path)
+{
+	static const char *const cpu_keys[] = {"usage_usec", "user_usec", "system_usec", "throttled_usec"};
+	static const char *const peak_keys[] = {""};
+	static const char *const event_keys[] = {"oom_kill"};
+	unsigned long long cpu[ARRAY_SIZE(cpu_keys)], peak = 0, ooms = 0;
+	struct cgroup_usage *cu;
+	struct leaf *lf;
+
+	if (!available || path == NULL)
+		return;
+
+	lf = find_leaf(path);
+	if (lf == NULL || lf->dir == NULL)
+		return;
+
+	cu = &lf->usage;
+	cu->runs++;
+
+	cpu[0] = cu->cpu_usec;
+	cpu[1] = cu->user_usec;
+	cpu[2] = cu->system_usec;
+	cpu[3] = cu->throttled_usec;
+	get_values(lf->dir, "cpu.stat", cpu_keys, ARRAY_SIZE(cpu_keys), cpu);
+
+	if (verbose) {
+		unsigned long long used = cpu[0] - cu->cpu_usec;
+		log_message(LOG_DEBUG, "%s used %llu.%03llu ms of CPU", path, used / 1000, used % 1000);
+	}
+
+	cu->cpu_usec = cpu[0];
+	cu->user_usec = cpu[1];
+	cu->system_usec = cpu[2];
+	cu->throttled_usec = cpu[3];
+
+	/* Without the memory controller these are not there. */
+	if (get_values(lf->dir, "memory.peak", peak_keys, 1, &peak) == ENOERR)
+		cu->memory_peak = peak;
+
+	if (get_values(lf->dir, "memory.events", event_keys, 1, &ooms) == ENOERR) {
+		if (ooms > cu->oom_kills)
+			log_message(LOG_WARNING, "%s has been killed for going over its memory limit", path);
+		cu->oom_kills = ooms;
+	}
+}
+
+void cgroup_foreach(void (*func)(const struct cgroup_usage *cu, void *ptr), void *ptr)
+{
+	struct leaf *lf;
+
+	for (lf = leaf_head; lf != NULL; lf = lf->next) {
+		if (lf->dir != NULL)
+			func(&lf->usage, ptr);
+	}
+}
+
+/*
+ * Set up the "cgroup-directory", if any.
+ */
+
+int open_cgroups(void)
+{
+	struct statfs sfs;
+	int err;
+
+	if (cgroup_dir == NULL || available)
+		return ENOERR;
+
+	if (mkdir(cgroup_dir, 0755) < 0 && errno != EEXIST) {
+		err = errno;
+		log_message(LOG_ERR, "cannot create cgroup %s (errno = %d = '%s')", cgroup_dir, err, strerror(err));
+		return err;
+	}
+
+	if (statfs(cgroup_dir, &sfs) < 0) {
+		err = errno;
+		log_message(LOG_ERR, "cannot get status of %s (errno = %d = '%s')", cgroup_dir, err, strerror(err));
+		return err;
+	}
+
+	if (sfs.f_type != CGROUP2_SUPER_MAGIC) {
+		log_message(LOG_ERR, "%s is not in a cgroup version 2 file system", cgroup_dir);
+		return ENOTDIR;
+	}
+
+	/* Each on its own, so one missing does not stop the other. */
+	err = put_value(cgroup_dir, "cgroup.subtree_control", "+cpu");
+	if (err != ENOERR)
+		log_message(cgroup_cpu_max > 0 ? LOG_ERR : LOG_DEBUG, "cannot enable the cpu controller in %s (errno = %d = '%s')",
+			    cgroup_dir, err, strerror(err));
+
+	err = put_value(cgroup_dir, "cgroup.subtree_control", "+memory");
+	if (err != ENOERR)
+		log_message(cgroup_memory_max > 0 ? LOG_ERR : LOG_DEBUG, "cannot enable the memory controller in %s (errno = %d = '%s')",
+			    cgroup_dir, err, strerror(err));
+
+	available = TRUE;
+	return ENOERR;
+}
+
+/*
+ * After a reload with new limits, set them for the leaves there are.
+ */
+
+void reload_cgroups(void)
+{
+	struct leaf *lf;
+
+	for (lf = leaf_head; lf != NULL; lf = lf->next) {
+		if (lf->dir != NULL)
+			set_limits(lf);
+	}
+}
+
+/*
+ * Remove the leaves, those that still have a process in them stay.
+ */
+
+void close_cgroups(void)
+{
+	while (leaf_head != NULL) {
+		struct leaf *lf = leaf_head;
+
+		leaf_head = lf->next;
+		if (lf->dir != NULL && rmdir(lf->dir) < 0 && verbose) {
+			int err = errno;
+			log_message(LOG_DEBUG, "cannot remove cgroup %s (errno = %d = '%s')", lf->dir, err, strerror(err));
+		}
+
+		free(lf->procs);
+		free(lf->dir);
+		free(lf->path);
+		free(lf);
+	}
+
+	available = FALSE;
+}
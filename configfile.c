@@ -16,6 +16,7 @@
 #include <errno.h>
 #include <string.h>
 #include <dirent.h>
+#include <glob.h>
 #include <limits.h>
 #include <sys/stat.h>
 
@@ -24,16 +25,27 @@
 #include "read-conf.h"
 
 static void add_test_binaries(const char *path);
+static void add_check_modules(const char *path);
+static void add_hwmon_sensors(void);
 static void set_file_list_change(int change, int linecount);
-static void parse_arg_val(char *arg, char *val, int linecount);
+static void set_sensor_max(int value, int linecount);
+static void set_list_interval(int msec, int linecount);
+static void parse_arg_val(int idx, char *val, int linecount, const char *file, int depth);
 
 #define ADMIN			"admin"
+#define CGROUPCPU		"cgroup-cpu-max"
+#define CGROUPDIR		"cgroup-directory"
+#define CGROUPMEM		"cgroup-memory-max"
 #define CHANGE			"change"
 #define DEVICE			"watchdog-device"
 #define DEVICE_USE_SETTIMEOUT	"watchdog-refresh-use-settimeout"
 #define DEVICE_IGNORE_ERRORS	"watchdog-refresh-ignore-errors"
 #define DEVICE_TIMEOUT		"watchdog-timeout"
+#define DEVICE_THREAD		"watchdog-refresh-thread"
+#define DEVICE_INTERVAL		"watchdog-refresh-interval-ms"
+#define DEVICE_STALL		"watchdog-refresh-stall"
 #define	FILENAME		"file"
+#define INCLUDE			"include"
 #define INTERFACE		"interface"
 #define INTERVAL		"interval"
 #define LOGTICK			"logtick"
@@ -41,36 +53,64 @@ static void parse_arg_val(char *arg, char *val, int linecount);
 #define MAXLOAD5		"max-load-5"
 #define MAXLOAD15		"max-load-15"
 #define MAXTEMP			"max-temperature"
+#define MAXTEMPRISE		"max-temperature-rise"
 #define MINMEM			"min-memory"
 #define ALLOCMEM		"allocatable-memory"
 #define MAXSWAP			"max-swap"
 #define SERVERPIDFILE		"pidfile"
 #define PING			"ping"
 #define PINGCOUNT		"ping-count"
+#define PLUGINDIR		"plugin-directory"
+#define PLUGINTIMEOUT		"plugin-timeout-ms"
 #define PRIORITY		"priority"
 #define REALTIME		"realtime"
 #define REPAIRBIN		"repair-binary"
+#define REPAIRCONCURRENCY	"repair-concurrency"
+#define REPAIRBACKOFF		"repair-backoff"
+#define REPAIRBATCH		"repair-batch"
 #define REPAIRTIMEOUT		"repair-timeout"
 #define SOFTBOOT		"softboot-option"
 #define TEMP			"temperature-sensor"
+#define TEMPAUTO		"temperature-auto"
+#define SENSORMAX		"sensor-max-temperature"
 #define TEMPPOWEROFF   		"temp-power-off"
 #define TESTBIN			"test-binary"
+#define TESTPLUGIN		"test-plugin"
 #define TESTTIMEOUT		"test-timeout"
 #define HEARTBEAT		"heartbeat-file"
 #define HBSTAMPS		"heartbeat-stamps"
 #define LOGDIR			"log-dir"
 #define TESTDIR			"test-directory"
-#define WRITEFILE               "write-file"
+#define WRITEFILE		"write-file"
+#define WRITEFILE_DIRECT	"write-file-direct"
+#define WRITEFILE_TIMEOUT	"write-file-timeout-ms"
 #define SIGTERM_DELAY	"sigterm-delay"
 #define RETRYTIMEOUT	"retry-timeout"
 #define REPAIRMAX		"repair-maximum"
+#define CHECKTHREADS		"check-threads"
+#define METRICSSOCKET		"metrics-socket"
 #define VERBOSE			"verbose"
 #define LOG_KILLED_PIDS	"log-killed-pids"
 
+/* Check intervals in milliseconds, per entry and per type of check. */
+#define CHECKINTERVAL		"check-interval-ms"
+#define FILEINTERVAL		"file-interval-ms"
+#define PIDFILEINTERVAL		"pidfile-interval-ms"
+#define PINGINTERVAL		"ping-interval-ms"
+#define IFACEINTERVAL		"interface-interval-ms"
+#define TEMPINTERVAL		"temperature-interval-ms"
+#define TESTINTERVAL		"test-interval-ms"
+#define LOADINTERVAL		"load-interval-ms"
+#define MEMINTERVAL		"memory-interval-ms"
+#define ALLOCINTERVAL		"allocatable-interval-ms"
+#define FTABLEINTERVAL		"file-table-interval-ms"
+
 #ifndef TESTBIN_PATH
 #define TESTBIN_PATH	NULL
 #endif
-static char *test_dir = TESTBIN_PATH;
+char *test_dir = TESTBIN_PATH;
+char *module_dir = NULL;
+char *cgroup_dir = NULL;
 
 /* Global configuration variables */
 
@@ -85,10 +125,25 @@ int minpages = 0;
 int minalloc = 0;
 int maxswap = 0;
 int maxtemp = 90;
+int maxtemp_rise = 0;	/* Degrees C per minute, 0 = rate of rise not checked. */
+int temp_auto = FALSE;	/* Add the sensors found in /sys/class/hwmon. */
 int pingcount = 3;
 int temp_poweroff = TRUE;
 int sigterm_delay = 5;	/* Seconds from first SIGTERM to sending SIGKILL during shutdown. */
 int repair_max = 1; /* Number of repair attempts without success. */
+int check_threads = 0; /* Worker threads for running checks, 0 = run them one at a time. */
+int metrics_socket = FALSE; /* Serve metrics on a socket in 'logdir'. */
+
+int tint_file = 0;
+int tint_pidfile = 0;
+int tint_ping = 0;
+int tint_iface = 0;
+int tint_temp = 0;
+int tint_test = 0;
+int tint_load = 0;
+int tint_memory = 0;
+int tint_alloc = 0;
+int tint_ftable = 0;
 
 char *devname = NULL;
 char *admin = "root";
@@ -97,14 +152,25 @@ int test_timeout = TIMER_MARGIN;   /* test-binary time out value. */
 int repair_timeout = TIMER_MARGIN; /* repair-binary time out value. */
 int dev_timeout = TIMER_MARGIN;    /* Watchdog hardware time-out. */
 int retry_timeout = TIMER_MARGIN;  /* Retry on non-critical errors. */
+int repair_concurrency = 0;	/* Repairs run at once from the queue, 0 = no queue. */
+int repair_backoff = 10;	/* Seconds to hold off a repair after one failed. */
+int repair_batch = FALSE;	/* One run of the repair binary per cycle, see repair.c. */
 
 char *logdir = "/var/log/watchdog";
 char *write_file = NULL;
+int write_file_direct = FALSE;
+int write_file_timeout = 5000;	/* Milliseconds before a write-file probe counts as hung. */
+int module_timeout = 100;	/* Milliseconds a check module may take, 0 = call it directly. */
+int cgroup_cpu_max = 0;		/* Percent of one CPU for each binary, 0 = no limit. */
+int cgroup_memory_max = 0;	/* MiB for each binary, 0 = no limit. */
 char *heartbeat = NULL;
 int hbstamps = 300;
 
 int refresh_use_settimeout = ENUM_AUTO;
 int refresh_ignore_errors = FALSE;
+int refresh_thread = FALSE;
+int refresh_interval = 0;		/* Refresh thread period in ms, zero to use 'tint'. */
+int refresh_stall = TIMER_MARGIN;	/* Seconds without check progress before refresh stops. */
 int realtime = FALSE;
 
 /* Self-repairing binaries list */
@@ -129,6 +195,9 @@ int verbose = 0;
 /* Just for killall5.c */
 int log_killed_PIDs = 0;
 
+/* The list most recently added to, for the per-entry "check-interval-ms" option. */
+static struct list **last_list = NULL;
+
 /* Simple table for yes/no enumerated options. */
 static const read_list_t Yes_No_list[] = {
 READ_LIST_ADD("no", 0)
@@ -143,40 +212,269 @@ READ_LIST_ADD("auto", ENUM_AUTO)
 READ_LIST_END()
 };
 
-/* Use the macros below to simplify the parsing function. For now we don't use the
- * integer range checking (0=0 so not checked), and assume all strings can be blank and
- * enumerated choices are Yes/No, but in future we could add such settings to the #define'd
- * list of names above.
- *
- * NOTE: We assume these are used with local variables 'arg' 'val' and 'found' present!
+/*
+ * Table of all the keywords, kept sorted by name so each line needs a single
+ * bsearch() to find its entry. How the value is read depends on the type,
+ * all using the read_*_func() calls of read-conf.c, and 'func' if given is
+ * then called with the number read.
  */
 
-#define READ_INT(name, iv)		read_int_func(		 arg, val, name, &found, 0, 0, iv)
-#define READ_STRING(name, str)	read_string_func(	 arg, val, name, &found, Read_allow_blank, str)
-#define READ_YESNO(name, iv)	read_enumerated_func(arg, val, name, &found, Yes_No_list, iv)
-#define READ_YN_AUTO(name, iv)	read_enumerated_func(arg, val, name, &found, YN_Auto_list, iv)
-#define READ_LIST(name, list)	read_list_func(		 arg, val, name, &found, 0, list)
+typedef enum {
+	KW_INT,
+	KW_STRING,
+	KW_YESNO,
+	KW_YN_AUTO,
+	KW_LIST,
+	KW_INCLUDE,
+} keyword_type_e;
+
+struct keyword {
+	const char *name;
+	keyword_type_e type;
+	void *ptr;			/* int *, char ** or struct list ** as 'type' says. */
+	void (*func)(int value, int linecount);
+	int repeats;			/* May be given more than once. */
+	int version;			/* Of the entries a KW_LIST line adds. */
+};
+
+static void set_logtick(int value, int linecount)
+{
+	ticker = logtick;
+}
+
+static const struct keyword keywords[] = {
+	{ADMIN,			KW_STRING,	&admin},
+	{ALLOCINTERVAL,		KW_INT,		&tint_alloc},
+	{ALLOCMEM,		KW_INT,		&minalloc},
+	{CGROUPCPU,		KW_INT,		&cgroup_cpu_max},
+	{CGROUPDIR,		KW_STRING,	&cgroup_dir},
+	{CGROUPMEM,		KW_INT,		&cgroup_memory_max},
+	{CHANGE,		KW_INT,		NULL,		set_file_list_change, TRUE},
+	{CHECKINTERVAL,		KW_INT,		NULL,		set_list_interval, TRUE},
+	{CHECKTHREADS,		KW_INT,		&check_threads},
+	{FILENAME,		KW_LIST,	&file_list,	NULL, TRUE},
+	{FILEINTERVAL,		KW_INT,		&tint_file},
+	{FTABLEINTERVAL,	KW_INT,		&tint_ftable},
+	{HEARTBEAT,		KW_STRING,	&heartbeat},
+	{HBSTAMPS,		KW_INT,		&hbstamps},
+	{INCLUDE,		KW_INCLUDE,	NULL,		NULL, TRUE},
+	{INTERFACE,		KW_LIST,	&iface_list,	NULL, TRUE},
+	{IFACEINTERVAL,		KW_INT,		&tint_iface},
+	{INTERVAL,		KW_INT,		&tint},
+	{LOADINTERVAL,		KW_INT,		&tint_load},
+	{LOGDIR,		KW_STRING,	&logdir},
+	{LOG_KILLED_PIDS,	KW_YESNO,	&log_killed_PIDs},
+	{LOGTICK,		KW_INT,		&logtick,	set_logtick},
+	{MAXLOAD1,		KW_INT,		&maxload1},
+	{MAXLOAD15,		KW_INT,		&maxload15},
+	{MAXLOAD5,		KW_INT,		&maxload5},
+	{MAXSWAP,		KW_INT,		&maxswap},
+	{MAXTEMP,		KW_INT,		&maxtemp},
+	{MAXTEMPRISE,		KW_INT,		&maxtemp_rise},
+	{MEMINTERVAL,		KW_INT,		&tint_memory},
+	{METRICSSOCKET,		KW_YESNO,	&metrics_socket},
+	{MINMEM,		KW_INT,		&minpages},
+	{SERVERPIDFILE,		KW_LIST,	&pidfile_list,	NULL, TRUE},
+	{PIDFILEINTERVAL,	KW_INT,		&tint_pidfile},
+	{PING,			KW_LIST,	&target_list,	NULL, TRUE},
+	{PINGCOUNT,		KW_INT,		&pingcount},
+	{PINGINTERVAL,		KW_INT,		&tint_ping},
+	{PLUGINDIR,		KW_STRING,	&module_dir},
+	{PLUGINTIMEOUT,		KW_INT,		&module_timeout},
+	{PRIORITY,		KW_INT,		&schedprio},
+	{REALTIME,		KW_YESNO,	&realtime},
+	{REPAIRBACKOFF,		KW_INT,		&repair_backoff},
+	{REPAIRBATCH,		KW_YESNO,	&repair_batch},
+	{REPAIRBIN,		KW_STRING,	&repair_bin},
+	{REPAIRCONCURRENCY,	KW_INT,		&repair_concurrency},
+	{REPAIRMAX,		KW_INT,		&repair_max},
+	{REPAIRTIMEOUT,		KW_INT,		&repair_timeout},
+	{RETRYTIMEOUT,		KW_INT,		&retry_timeout},
+	{SENSORMAX,		KW_INT,		NULL,		set_sensor_max, TRUE},
+	{SIGTERM_DELAY,		KW_INT,		&sigterm_delay},
+	{SOFTBOOT,		KW_YESNO,	&softboot},
+	{TEMPPOWEROFF,		KW_YESNO,	&temp_poweroff},
+	{TEMPAUTO,		KW_YESNO,	&temp_auto},
+	{TEMPINTERVAL,		KW_INT,		&tint_temp},
+	{TEMP,			KW_LIST,	&temp_list,	NULL, TRUE},
+	{TESTBIN,		KW_LIST,	&tr_bin_list,	NULL, TRUE},
+	{TESTDIR,		KW_STRING,	&test_dir},
+	{TESTINTERVAL,		KW_INT,		&tint_test},
+	{TESTPLUGIN,		KW_LIST,	&tr_bin_list,	NULL, TRUE, 2},
+	{TESTTIMEOUT,		KW_INT,		&test_timeout},
+	{VERBOSE,		KW_INT,		&verbose},
+	{DEVICE,		KW_STRING,	&devname},
+	{DEVICE_IGNORE_ERRORS,	KW_YESNO,	&refresh_ignore_errors},
+	{DEVICE_INTERVAL,	KW_INT,		&refresh_interval},
+	{DEVICE_STALL,		KW_INT,		&refresh_stall},
+	{DEVICE_THREAD,		KW_YESNO,	&refresh_thread},
+	{DEVICE_USE_SETTIMEOUT,	KW_YN_AUTO,	&refresh_use_settimeout},
+	{DEVICE_TIMEOUT,	KW_INT,		&dev_timeout},
+	{WRITEFILE,		KW_STRING,	&write_file},
+	{WRITEFILE_DIRECT,	KW_YESNO,	&write_file_direct},
+	{WRITEFILE_TIMEOUT,	KW_INT,		&write_file_timeout},
+};
+
+#define NUM_KEYWORDS	ARRAY_SIZE(keywords)
+
+/* Line and file each keyword was last seen in while reading, for duplicates. */
+static int keyword_line[NUM_KEYWORDS];
+static const char *keyword_file[NUM_KEYWORDS];
+
+/* How deep "include" lines may nest, to stop a file including itself. */
+#define MAX_INCLUDE_DEPTH	8
 
 /*
- * Open the configuration file, read & parse it, and set the global configuration variables to those values.
+ * Files read by read_config(), the main one and any from "include" lines,
+ * each kept split into keyword and value so reading the configuration
+ * again for a reload only goes back to those changed since, as told by
+ * their inode, size and modification time.
+ */
+
+struct conf_line {
+	int kw;			/* Index in keywords[]. */
+	int line;		/* Line number in the file. */
+	size_t val;		/* Offset of the value in 'text'. */
+};
+
+struct conf_file {
+	char *path;
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+	struct conf_line *lines;
+	int num_lines;
+	int total_lines;	/* Counting blank lines and comments. */
+	int parsed;		/* The lines are those of the file as it was. */
+	char *text;
+	int seen;		/* Last read_config() to use it. */
+	int active;		/* Being read, so an include of it is a loop. */
+	struct conf_file *next;
+};
+
+static struct conf_file *conf_files = NULL;
+static int conf_generation = 0;
+
+/* Values of the keyword variables before the first read_config(). */
+union keyword_value {
+	int ival;
+	char *sval;
+};
+
+static union keyword_value keyword_default[NUM_KEYWORDS];
+static char *test_dir_default = NULL;
+static int have_defaults = FALSE;
+
+/* Statistics from the last read_config(). */
+int config_lines = 0;
+int config_files = 0;
+int config_cached = 0;	/* Files unchanged since the last read. */
+double config_msec = 0.0;
+
+static int cmp_keyword(const void *key, const void *elem)
+{
+	return strcmp((const char *)key, ((const struct keyword *)elem)->name);
+}
+
+/*
+ * The table must be in strcmp() order for bsearch(), check that once so an
+ * out of order addition shows up straight away and not as an ignored option.
  */
 
-void read_config(char *configfile)
+static void check_keywords(void)
 {
-	FILE *wc;
-	char *line = NULL, *arg=NULL, *val=NULL;
-	size_t n = 0;
-	int linecount = 0;
+	static int checked = FALSE;
+	size_t ii;
+
+	if (checked)
+		return;
+
+	for (ii = 1; ii < NUM_KEYWORDS; ii++) {
+		if (strcmp(keywords[ii - 1].name, keywords[ii].name) >= 0) {
+			fatal_error(EX_SOFTWARE, "config keyword table not sorted at \"%s\"", keywords[ii].name);
+		}
+	}
+
+	checked = TRUE;
+}
+
+/*
+ * Copy the values of the keyword variables to 'vals', or back from it.
+ */
+
+static void save_keywords(union keyword_value *vals)
+{
+	size_t ii;
+
+	for (ii = 0; ii < NUM_KEYWORDS; ii++) {
+		const struct keyword *kw = &keywords[ii];
+
+		if (kw->ptr == NULL || kw->type == KW_LIST)
+			continue;
+
+		if (kw->type == KW_STRING)
+			vals[ii].sval = *(char **)kw->ptr;
+		else
+			vals[ii].ival = *(int *)kw->ptr;
+	}
+}
+
+static void load_keywords(const union keyword_value *vals)
+{
+	size_t ii;
+
+	for (ii = 0; ii < NUM_KEYWORDS; ii++) {
+		const struct keyword *kw = &keywords[ii];
 
-	add_list(&memtimer, "<free-memory>", 0);
-	add_list(&alloctimer, "<alloc-memory>", 0);
-	add_list(&loadtimer, "<load-average>", 0);
+		if (kw->ptr == NULL || kw->type == KW_LIST)
+			continue;
 
-	if ((wc = fopen(configfile, "r")) == NULL) {
-		fatal_error(EX_SYSERR, "Can't open config file \"%s\" (%s)", configfile, strerror(errno));
+		if (kw->type == KW_STRING)
+			*(char **)kw->ptr = vals[ii].sval;
+		else
+			*(int *)kw->ptr = vals[ii].ival;
 	}
+}
+
+/*
+ * On the first read keep the built-in defaults (and any set from the command
+ * line), on reading the file again for a reload put them back so an option
+ * taken out of the file returns to its default. The strings replaced are not
+ * freed as they may still be in use, such as the name of a scheduled check.
+ */
+
+static void restore_defaults(void)
+{
+	if (have_defaults) {
+		load_keywords(keyword_default);
+		test_dir = test_dir_default;
+		ticker = logtick;
+	} else {
+		save_keywords(keyword_default);
+		test_dir_default = test_dir;
+	}
+
+	have_defaults = TRUE;
+}
+
+/*
+ * Split a configuration file into its "keyword = value" lines, looking up each
+ * keyword as it is read so an unknown one is reported once and not on every
+ * reload. The values are kept one after the other in 'text'.
+ */
+
+static int parse_conf_file(struct conf_file *cf, FILE *fp)
+{
+	char *line = NULL, *arg = NULL, *val = NULL;
+	size_t n = 0, text_size = 0, text_len = 0;
+	int lines_size = 0;
+	int linecount = 0;
+
+	while (getline(&line, &n, fp) != -1) {
+		const struct keyword *kw;
+		size_t len;
 
-	while (getline(&line, &n, wc) != -1) {
 		linecount++;
 
 		/* find first non-white space character and check for blank/commented lines. */
@@ -188,7 +486,7 @@ void read_config(char *configfile)
 		/* find the '=' for the "arg = val" parsing. */
 		val = strchr(arg, '=');
 		if (val == NULL) {
-			log_message(LOG_WARNING, "Warning: no '=' assignment at line %d of config file", linecount);
+			log_message(LOG_WARNING, "Warning: no '=' assignment at line %d of %s", linecount, cf->path);
 			continue;
 		}
 
@@ -199,30 +497,301 @@ void read_config(char *configfile)
 		/* remove trailing white-space characters for easier parsing. */
 		trim_white(val);
 		trim_white(arg);
-		
-		if (strcmp(arg, WRITEFILE) == 0) {
-                // Assign the file path to write_file
-                write_file = strdup(val);
-                syslog(LOG_INFO, "write-file is set to %s", write_file);  // Log the write file path
-                }
-
-		/* do the 'arg'=something search to set variable='val'. */
-		parse_arg_val(arg, val, linecount);
+
+		kw = bsearch(arg, keywords, NUM_KEYWORDS, sizeof(keywords[0]), cmp_keyword);
+		if (kw == NULL) {
+			log_message(LOG_WARNING, "Ignoring invalid option at line %d of %s: %s=%s", linecount, cf->path, arg, val);
+			continue;
+		}
+
+		len = strlen(val) + 1;
+		if (text_len + len > text_size) {
+			char *tmp;
+
+			text_size = (text_size > 0) ? 2 * text_size : 1024;
+			while (text_len + len > text_size)
+				text_size *= 2;
+			tmp = realloc(cf->text, text_size);
+			if (tmp == NULL) {
+				fatal_error(EX_SYSERR, "out of memory reading %s", cf->path);
+			}
+			cf->text = tmp;
+		}
+
+		if (cf->num_lines >= lines_size) {
+			struct conf_line *tmp;
+
+			lines_size = (lines_size > 0) ? 2 * lines_size : 64;
+			tmp = realloc(cf->lines, lines_size * sizeof(*tmp));
+			if (tmp == NULL) {
+				fatal_error(EX_SYSERR, "out of memory reading %s", cf->path);
+			}
+			cf->lines = tmp;
+		}
+
+		memcpy(cf->text + text_len, val, len);
+		cf->lines[cf->num_lines].kw = kw - keywords;
+		cf->lines[cf->num_lines].line = linecount;
+		cf->lines[cf->num_lines].val = text_len;
+		cf->num_lines++;
+		text_len += len;
 	}
 
 	if (line)
 		free(line);
 
-	if (fclose(wc) != 0) {
-		fatal_error(EX_SYSERR, "Error closing file \"%s\" (%s)", configfile, strerror(errno));
+	cf->total_lines = linecount;
+
+	return ferror(fp) ? EIO : ENOERR;
+}
+
+static void release_conf_file(struct conf_file *cf)
+{
+	free(cf->lines);
+	free(cf->text);
+	cf->lines = NULL;
+	cf->text = NULL;
+	cf->num_lines = 0;
+	cf->total_lines = 0;
+	cf->parsed = FALSE;
+}
+
+static int same_file(const struct conf_file *cf, const struct stat *st)
+{
+	return (cf->dev == st->st_dev && cf->ino == st->st_ino && cf->size == st->st_size
+		&& cf->mtime.tv_sec == st->st_mtim.tv_sec && cf->mtime.tv_nsec == st->st_mtim.tv_nsec);
+}
+
+/*
+ * Get the parsed contents of the file 'path', from the cache if the file is
+ * the same as when it was last read. Returns NULL with 'errno' set if the
+ * file cannot be read.
+ */
+
+static struct conf_file *get_conf_file(const char *path)
+{
+	struct conf_file *cf;
+	struct stat st;
+	FILE *fp;
+	int err;
+
+	for (cf = conf_files; cf != NULL; cf = cf->next) {
+		if (strcmp(cf->path, path) == 0)
+			break;
 	}
 
-	add_test_binaries(test_dir);
+	if (cf != NULL && cf->parsed && stat(path, &st) == 0 && same_file(cf, &st)) {
+		config_cached++;
+		return cf;
+	}
+
+	if ((fp = fopen(path, "r")) == NULL)
+		return NULL;
+
+	/* What is read is what was opened, should it change meanwhile. */
+	if (fstat(fileno(fp), &st) < 0) {
+		err = errno;
+		fclose(fp);
+		errno = err;
+		return NULL;
+	}
+
+	if (cf == NULL) {
+		cf = (struct conf_file *)xcalloc(1, sizeof(struct conf_file));
+		cf->path = xstrdup(path);
+		cf->next = conf_files;
+		conf_files = cf;
+	} else {
+		release_conf_file(cf);
+	}
 
-	if (tint <= 0) {
-		fatal_error(EX_SYSERR, "Parameters %s = %d in file \"%s\" must be > 0", INTERVAL, tint, configfile);
+	err = parse_conf_file(cf, fp);
+
+	if (fclose(fp) != 0 && err == ENOERR)
+		err = errno;
+
+	if (err != ENOERR) {
+		release_conf_file(cf);
+		errno = err;
+		return NULL;
+	}
+
+	cf->dev = st.st_dev;
+	cf->ino = st.st_ino;
+	cf->size = st.st_size;
+	cf->mtime = st.st_mtim;
+	cf->parsed = TRUE;
+
+	return cf;
+}
+
+/*
+ * Use the settings of a file in order, as though read from it just now.
+ */
+
+static void apply_conf_file(struct conf_file *cf, int depth)
+{
+	int ii;
+
+	cf->seen = conf_generation;
+	cf->active = TRUE;
+	config_lines += cf->total_lines;
+	config_files++;
+
+	for (ii = 0; ii < cf->num_lines; ii++) {
+		const struct conf_line *cl = &cf->lines[ii];
+
+		parse_arg_val(cl->kw, cf->text + cl->val, cl->line, cf->path, depth);
+	}
+
+	cf->active = FALSE;
+}
+
+/*
+ * Read the files matching the pattern of an "include" line, in sorted order.
+ * A relative pattern is taken from the directory of the including file, as
+ * by the time of a reload the daemon has changed to the root directory.
+ */
+
+static void include_files(const char *pattern, const char *from, int depth)
+{
+	char path[PATH_MAX];
+	glob_t gl;
+	size_t ii;
+	int ret;
+
+	if (depth > MAX_INCLUDE_DEPTH) {
+		log_message(LOG_WARNING, "Warning: includes nested too deep in %s, ignoring %s", from, pattern);
+		return;
+	}
+
+	if (pattern[0] != '/') {
+		const char *slash = strrchr(from, '/');
+		int len = (slash != NULL) ? (int)(slash - from) : 1;
+
+		snprintf(path, sizeof(path), "%.*s/%s", len, (slash != NULL) ? from : ".", pattern);
+		pattern = path;
+	}
+
+	ret = glob(pattern, 0, NULL, &gl);
+	if (ret == GLOB_NOMATCH) {
+		if (verbose)
+			log_message(LOG_DEBUG, "no files match include %s", pattern);
+		return;
+	} else if (ret != 0) {
+		log_message(LOG_ERR, "cannot expand include %s (glob error %d)", pattern, ret);
+		return;
 	}
 
+	for (ii = 0; ii < gl.gl_pathc; ii++) {
+		struct conf_file *cf = NULL;
+
+		/* The same file by another path is still the same file. */
+		if (realpath(gl.gl_pathv[ii], path) != NULL)
+			cf = get_conf_file(path);
+
+		if (cf == NULL) {
+			int err = errno;
+			log_message(LOG_ERR, "cannot read %s (errno = %d = '%s')", gl.gl_pathv[ii], err, strerror(err));
+			continue;
+		}
+
+		if (cf->active) {
+			log_message(LOG_WARNING, "Warning: %s includes itself, ignoring it from %s", cf->path, from);
+			continue;
+		}
+
+		apply_conf_file(cf, depth);
+	}
+
+	globfree(&gl);
+}
+
+/*
+ * Open the configuration file, read & parse it, and set the global configuration variables to those values.
+ * The lists of checks are added to, so on reading again they must have been emptied (see reload.c).
+ *
+ * A file that cannot be read or has a bad interval is fatal on the first read. On reading it again
+ * for a reload the problem is logged, the variables are put back as they were and an error returned,
+ * leaving the caller to put back the lists.
+ */
+
+int read_config(char *configfile)
+{
+	union keyword_value running[NUM_KEYWORDS];
+	char *running_test_dir = test_dir;
+	int running_ticker = ticker;
+	int reload = have_defaults;
+	struct conf_file *cf, **prev;
+	struct timespec t0, t1;
+	char path[PATH_MAX];
+	int err;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	check_keywords();
+	if (reload)
+		save_keywords(running);
+	memset(keyword_line, 0, sizeof(keyword_line));
+	restore_defaults();
+	last_list = NULL;
+	config_lines = config_files = config_cached = 0;
+	conf_generation++;
+
+	/* These are kept over a reload, with their repair state. */
+	if (memtimer == NULL)
+		add_list(&memtimer, "<free-memory>", 0);
+	if (alloctimer == NULL)
+		add_list(&alloctimer, "<alloc-memory>", 0);
+	if (loadtimer == NULL)
+		add_list(&loadtimer, "<load-average>", 0);
+
+	if (realpath(configfile, path) == NULL || (cf = get_conf_file(path)) == NULL) {
+		err = errno;
+		if (!reload)
+			fatal_error(EX_SYSERR, "Can't read config file \"%s\" (%s)", configfile, strerror(err));
+
+		log_message(LOG_ERR, "cannot read config file \"%s\" (errno = %d = '%s'), keeping the running configuration",
+			configfile, err, strerror(err));
+	} else {
+		apply_conf_file(cf, 0);
+		err = ENOERR;
+
+		if (tint <= 0) {
+			if (!reload)
+				fatal_error(EX_SYSERR, "Parameters %s = %d in file \"%s\" must be > 0", INTERVAL, tint, configfile);
+
+			log_message(LOG_ERR, "parameter %s = %d in file \"%s\" must be > 0, keeping the running configuration",
+				INTERVAL, tint, configfile);
+			err = EINVAL;
+		}
+	}
+
+	if (err != ENOERR) {
+		load_keywords(running);
+		test_dir = running_test_dir;
+		ticker = running_ticker;
+		return err;
+	}
+
+	/* Forget files no longer included. */
+	for (prev = &conf_files; (cf = *prev) != NULL; ) {
+		if (cf->seen != conf_generation) {
+			*prev = cf->next;
+			release_conf_file(cf);
+			free(cf->path);
+			free(cf);
+		} else {
+			prev = &cf->next;
+		}
+	}
+
+	add_test_binaries(test_dir);
+	add_check_modules(module_dir);
+
+	if (temp_auto)
+		add_hwmon_sensors();
+
 	/* compute 5 & 15 minute averages if not given. */
 	if (maxload1 && !maxload5)
 		maxload5 = maxload1 * 3 / 4;
@@ -230,81 +799,58 @@ void read_config(char *configfile)
 	if (maxload1 && !maxload15)
 		maxload15 = maxload1 / 2;
 
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	config_msec = 1.0e3 * (t1.tv_sec - t0.tv_sec) + 1.0e-6 * (t1.tv_nsec - t0.tv_nsec);
+	return ENOERR;
 }
 
 /*
- * Perform the task of looking for 'arg' to be a known term and then setting
- * the related parameter to be 'val'. If no match is found then report the
- * discrepancy.
+ * Set the parameter of keyword number 'idx' from 'val', as found at line
+ * 'linecount' of 'file'. Report an option given twice, in the same file
+ * or not, unless it is one that may be.
  */
 
-static void parse_arg_val(char *arg, char *val, int linecount)
+static void parse_arg_val(int idx, char *val, int linecount, const char *file, int depth)
 {
+	const struct keyword *kw = &keywords[idx];
+	char *arg = (char *)kw->name;
 	int itmp = 0;
 	int found = 0;
 
-	/*
-	 * Search for a match.
-	 *
-	 * Note #1: The read_*_func() calls deal with a zero-length 'val' as needed.
-	 *
-	 * Note #2: The READ_INT() and similar macros assume the variables 'arg',
-	 *			'val' and 'found' are present - hence the apparent minimal
-	 *			reference to them in the code below!
-	 *
-	 * Note #3: There should only be one match - but we report any code errors
-	 *			that result in 2 or more 'arg' matches in the functions below.
-	 */
-
-	if (READ_INT(CHANGE, &itmp) == 0) {
-		set_file_list_change(itmp, linecount);
+	if (keyword_line[idx] != 0 && !kw->repeats) {
+		log_message(LOG_WARNING, "Warning: duplicate '%s' at line %d of %s (previous at line %d of %s, using the last)",
+			arg, linecount, file, keyword_line[idx], keyword_file[idx]);
 	}
-
-	if (READ_INT(LOGTICK, &logtick) == 0) {
-		ticker = logtick;
-	}
-
-	READ_LIST(FILENAME, &file_list);
-	READ_LIST(SERVERPIDFILE, &pidfile_list);
-	READ_INT(PINGCOUNT, &pingcount);
-	READ_LIST(PING, &target_list);
-	READ_LIST(INTERFACE, &iface_list);
-	READ_YESNO(REALTIME, &realtime);
-	READ_INT(PRIORITY, &schedprio);
-	READ_STRING(REPAIRBIN, &repair_bin);
-	READ_INT(REPAIRTIMEOUT, &repair_timeout);
-	READ_LIST(TESTBIN, &tr_bin_list);
-	READ_INT(TESTTIMEOUT, &test_timeout);
-	READ_STRING(HEARTBEAT, &heartbeat);
-	READ_INT(HBSTAMPS, &hbstamps);
-	READ_STRING(ADMIN, &admin);
-	READ_INT(INTERVAL, &tint);
-	READ_STRING(DEVICE, &devname);
-	READ_YN_AUTO(DEVICE_USE_SETTIMEOUT, &refresh_use_settimeout);
-	READ_YESNO(DEVICE_IGNORE_ERRORS, &refresh_ignore_errors);
-	READ_INT(DEVICE_TIMEOUT, &dev_timeout);
-	READ_LIST(TEMP, &temp_list);
-	READ_INT(MAXTEMP, &maxtemp);
-	READ_INT(MAXLOAD1, &maxload1);
-	READ_INT(MAXLOAD5, &maxload5);
-	READ_INT(MAXLOAD15, &maxload15);
-	READ_INT(MINMEM, &minpages);
-	READ_INT(ALLOCMEM, &minalloc);
-	READ_INT(MAXSWAP, &maxswap);
-	READ_STRING(LOGDIR, &logdir);
-	READ_STRING(TESTDIR, &test_dir);
-	READ_YESNO(SOFTBOOT, &softboot);
-	READ_YESNO(TEMPPOWEROFF, &temp_poweroff);
-	READ_INT(SIGTERM_DELAY, &sigterm_delay);
-	READ_INT(RETRYTIMEOUT, &retry_timeout);
-	READ_INT(REPAIRMAX, &repair_max);
-	READ_INT(VERBOSE, &verbose);
-	READ_YESNO(LOG_KILLED_PIDS, &log_killed_PIDs);
-
-	if (found == 0) {
-		log_message(LOG_WARNING, "Ignoring invalid option at line %d of config file: %s=%s", linecount, arg, val);
-	} else if (found > 1) {
-		log_message(LOG_ERR, "Multiple matches at line %d of config file: %s=%s", linecount, arg, val);
+	keyword_line[idx] = linecount;
+	keyword_file[idx] = file;
+
+	switch (kw->type) {
+	case KW_INT:
+		read_int_func(arg, val, kw->name, &found, 0, 0, (kw->ptr != NULL) ? (int *)kw->ptr : &itmp);
+		if (kw->func != NULL)
+			kw->func((kw->ptr != NULL) ? *(int *)kw->ptr : itmp, linecount);
+		break;
+
+	case KW_STRING:
+		read_string_func(arg, val, kw->name, &found, Read_allow_blank, (char **)kw->ptr);
+		break;
+
+	case KW_YESNO:
+		read_enumerated_func(arg, val, kw->name, &found, Yes_No_list, (int *)kw->ptr);
+		break;
+
+	case KW_YN_AUTO:
+		read_enumerated_func(arg, val, kw->name, &found, YN_Auto_list, (int *)kw->ptr);
+		break;
+
+	case KW_LIST:
+		read_list_func(arg, val, kw->name, &found, kw->version, (struct list **)kw->ptr);
+		last_list = (struct list **)kw->ptr;
+		break;
+
+	case KW_INCLUDE:
+		include_files(val, file, depth + 1);
+		break;
 	}
 }
 
@@ -315,18 +861,13 @@ static void parse_arg_val(char *arg, char *val, int linecount)
 
 static void set_file_list_change(int change, int linecount)
 {
-	struct list *ptr;
+	struct list *ptr = list_tail(&file_list);
 
-	if (!file_list) {
+	if (ptr == NULL) {
 		/* no file entered yet, report this anomaly */
 		log_message(LOG_WARNING,
 			"Warning: file change interval, but no file (yet) at line %d of config file", linecount);
 	} else {
-		/* we have a file list */
-		for (ptr = file_list; ptr->next != NULL; ptr = ptr->next) {
-			/* loop to find end of list. */
-		}
-
 		if (ptr->parameter.file.mtime != 0) {
 			log_message(LOG_WARNING,
 				"Warning: duplicate change interval at line %d of config file (ignoring previous)", linecount);
@@ -336,6 +877,48 @@ static void set_file_list_change(int change, int linecount)
 	}
 }
 
+/*
+ * Set the limit of the most recent temperature sensor, in place of the
+ * global "max-temperature".
+ */
+
+static void set_sensor_max(int value, int linecount)
+{
+	struct list *ptr = list_tail(&temp_list);
+
+	if (ptr == NULL) {
+		log_message(LOG_WARNING,
+			"Warning: sensor temperature limit, but no sensor (yet) at line %d of config file", linecount);
+	} else {
+		if (ptr->parameter.temp.max != 0) {
+			log_message(LOG_WARNING,
+				"Warning: duplicate sensor temperature limit at line %d of config file (ignoring previous)", linecount);
+		}
+
+		ptr->parameter.temp.max = value;
+	}
+}
+
+/*
+ * Set the check interval of the most recently added list entry, of whatever
+ * type, so a line such as "check-interval-ms = 500" follows its "pidfile = ..."
+ */
+
+static void set_list_interval(int msec, int linecount)
+{
+	struct list *ptr = list_tail(last_list);
+
+	if (ptr == NULL) {
+		log_message(LOG_WARNING,
+			"Warning: check interval, but no check (yet) at line %d of config file", linecount);
+	} else if (msec <= 0) {
+		log_message(LOG_WARNING,
+			"Warning: check interval must be > 0 at line %d of config file (ignoring)", linecount);
+	} else {
+		ptr->interval = msec;
+	}
+}
+
 /*
  * Look at the directory specified by 'path' and add any executable
  * files in there to the test list.
@@ -377,32 +960,137 @@ static void add_test_binaries(const char *path)
 		ret = snprintf(fname, sizeof(fname), "%s/%s", path, dentry.d_name);
 		if (ret >= sizeof(fname))
 			continue;
-		ret = stat(fname, &sb);
-		if (ret < 0)
-			continue;
-		if (!S_ISREG(sb.st_mode))
+		if (!test_binary_usable(fname, dentry.d_name))
 			continue;
 
-		/* Skip any hidden files - a bit suspicious. */
-		if(dentry.d_name[0] == '.') {
-			log_message(LOG_WARNING, "skipping hidden file %s", fname);
-			continue;
-		}
+		if (verbose)
+			log_message(LOG_DEBUG, "adding %s to list of auto-repair binaries", fname);
 
-		if (!(sb.st_mode & S_IXUSR))
+		add_list(&tr_bin_list, fname, 1);
+	} while (1);
+
+	closedir(d);
+}
+
+/*
+ * A check module is loaded into the daemon, so it and its directory must
+ * belong to root and be writable by no one else.
+ */
+
+static int module_safe(const char *name, const struct stat *sb)
+{
+	if (sb->st_uid != 0 || (sb->st_mode & (S_IWGRP | S_IWOTH))) {
+		log_message(LOG_ERR, "%s is not owned by root or is writable by group or others, ignoring it", name);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/*
+ * Add the shared objects (named *.so) of the directory 'path' as check
+ * modules, that is version 3 of the test binaries.
+ */
+
+static void add_check_modules(const char *path)
+{
+	struct dirent *de;
+	struct stat sb;
+	char fname[PATH_MAX];
+	DIR *d;
+
+	if (!path)
+		return;
+
+	if (stat(path, &sb) < 0 || !S_ISDIR(sb.st_mode) || !module_safe(path, &sb))
+		return;
+
+	d = opendir(path);
+	if (!d)
+		return;
+
+	while ((de = readdir(d)) != NULL) {
+		size_t len = strlen(de->d_name);
+
+		if (de->d_name[0] == '.' || len < 4 || strcmp(de->d_name + len - 3, ".so") != 0)
 			continue;
-		if (!(sb.st_mode & S_IRUSR))
+		if (snprintf(fname, sizeof(fname), "%s/%s", path, de->d_name) >= (int)sizeof(fname))
+			continue;
+		if (stat(fname, &sb) < 0 || !S_ISREG(sb.st_mode) || !module_safe(fname, &sb))
 			continue;
 
 		if (verbose)
-			log_message(LOG_DEBUG, "adding %s to list of auto-repair binaries", fname);
+			log_message(LOG_DEBUG, "adding %s to list of check modules", fname);
 
-		add_list(&tr_bin_list, fname, 1);
-	} while (1);
+		add_list(&tr_bin_list, fname, 3);
+	}
 
 	closedir(d);
 }
 
+/*
+ * Add every temperature input of the hwmon devices to the sensor list,
+ * unless already given by a "temperature-sensor" line.
+ */
+
+static void add_hwmon_sensors(void)
+{
+	glob_t gl;
+	size_t ii;
+
+	if (glob("/sys/class/hwmon/hwmon*/temp*_input", 0, NULL, &gl) != 0)
+		return;
+
+	for (ii = 0; ii < gl.gl_pathc; ii++) {
+		const char *fname = gl.gl_pathv[ii];
+		struct list *act;
+
+		for (act = temp_list; act != NULL; act = act->next) {
+			if (strcmp(act->name, fname) == 0)
+				break;
+		}
+
+		if (act != NULL)
+			continue;
+
+		if (verbose)
+			log_message(LOG_DEBUG, "adding %s to list of temperature sensors", fname);
+
+		add_list(&temp_list, fname, 1);
+	}
+
+	globfree(&gl);
+}
+
+/*
+ * Should the file 'fname' (called 'name' in the test directory) be run as a
+ * test/repair binary? It must be a regular file we can read and execute,
+ * and not hidden. Also used by testdir.c as files come and go.
+ */
+
+int test_binary_usable(const char *fname, const char *name)
+{
+	struct stat sb;
+
+	if (stat(fname, &sb) < 0)
+		return FALSE;
+	if (!S_ISREG(sb.st_mode))
+		return FALSE;
+
+	/* Skip any hidden files - a bit suspicious. */
+	if (name[0] == '.') {
+		log_message(LOG_WARNING, "skipping hidden file %s", fname);
+		return FALSE;
+	}
+
+	if (!(sb.st_mode & S_IXUSR))
+		return FALSE;
+	if (!(sb.st_mode & S_IRUSR))
+		return FALSE;
+
+	return TRUE;
+}
+
 /*
  * Free all of the lists allocated by read_config()
  */
@@ -417,4 +1105,5 @@ void free_all_lists(void)
 	free_list(&temp_list);
 	free_list(&loadtimer);
 	free_list(&memtimer);
+	free_list(&alloctimer);
 }
@@ -0,0 +1,325 @@
+/* > diskprobe.c
+ *
+ * Disk liveness probe for the "write-file" option. The file is kept open and
+ * each probe is a pwrite() of one block followed by fdatasync(), optionally
+ * with O_DIRECT so the page cache is bypassed as well.
+ *
+ * The I/O is done by a helper thread so a write that hangs (dead SAN path,
+ * stuck NFS mount) does not block the main loop. The check only posts a
+ * request and collects the previous result, and reports a probe still
+ * running after 'write-file-timeout-ms' as an error through wd_action()
+ * like any other check. Latencies of completed probes are kept for the
+ * percentile report.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#define _GNU_SOURCE	/* For O_DIRECT */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <linux/limits.h>
+
+#include "extern.h"
+#include "watch_err.h"
+#include "gettime.h"
+
+#define PROBE_BLOCK	4096	/* Size and alignment used for O_DIRECT. */
+#define NUM_LATENCY	256	/* Number of recent latencies kept for percentiles. */
+
+static pthread_t probe_thread;
+static pthread_mutex_t probe_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t probe_cv = PTHREAD_COND_INITIALIZER;
+
+/* All of these are protected by 'probe_lock'. */
+static int probe_started = FALSE;
+static int probe_stop = FALSE;
+static int probe_request = FALSE;	/* Request posted, not yet taken. */
+static int probe_reopen = FALSE;	/* Settings changed, open the file again. */
+static int probe_busy = FALSE;		/* Request posted or in progress. */
+static int probe_done = FALSE;		/* Result waiting to be collected. */
+static int probe_err = ENOERR;
+static struct timespec probe_start;
+static int probe_late = FALSE;		/* Already reported as over the deadline. */
+static char probe_path[PATH_MAX];	/* Settings of the request, as the globals */
+static int probe_direct = FALSE;	/* may be changed by a reload meanwhile. */
+static long latency[NUM_LATENCY];	/* Microseconds. */
+static unsigned long num_latency = 0;
+
+static int probe_fd = -1;		/* Only used by the helper thread. */
+static char fd_path[PATH_MAX];		/* What 'probe_fd' was opened as. */
+static int fd_direct = FALSE;
+static unsigned char *probe_buf = NULL;
+
+/* ================================================================= */
+
+/*
+ * Open (if need be) and write the probe file 'path', the file stays open for
+ * the next time unless there was an error or the settings change.
+ */
+
+static int do_probe(const char *path, int direct)
+{
+	size_t len = direct ? PROBE_BLOCK : 1;
+	ssize_t rv;
+	int err;
+
+	if (probe_fd != -1 && (direct != fd_direct || strcmp(path, fd_path) != 0)) {
+		close(probe_fd);
+		probe_fd = -1;
+	}
+
+	if (probe_fd == -1) {
+		int flags = O_CREAT | O_WRONLY | O_CLOEXEC;
+
+		if (direct)
+			flags |= O_DIRECT;
+
+		probe_fd = open(path, flags, 00600);
+		if (probe_fd == -1) {
+			err = errno;
+			log_message(LOG_ERR, "cannot open %s (errno = %d = '%s')", path, err, strerror(err));
+			return err;
+		}
+		snprintf(fd_path, sizeof(fd_path), "%s", path);
+		fd_direct = direct;
+	}
+
+	rv = pwrite(probe_fd, probe_buf, len, 0);
+	if (rv != (ssize_t)len) {
+		err = (rv < 0) ? errno : EIO;
+		log_message(LOG_ERR, "write to %s gave errno = %d = '%s'", path, err, strerror(err));
+	} else if (fdatasync(probe_fd) < 0) {
+		err = errno;
+		log_message(LOG_ERR, "fdatasync of %s gave errno = %d = '%s'", path, err, strerror(err));
+	} else {
+		return ENOERR;
+	}
+
+	/* Re-open next time, in case the file system was remounted, etc. */
+	close(probe_fd);
+	probe_fd = -1;
+
+	return err;
+}
+
+static void *probe_main(void *unused)
+{
+	pthread_mutex_lock(&probe_lock);
+
+	while (1) {
+		struct timespec tnow, tdiff;
+		char path[PATH_MAX];
+		int direct, err;
+
+		while (!probe_stop && !probe_request && !probe_reopen)
+			pthread_cond_wait(&probe_cv, &probe_lock);
+
+		if (probe_stop)
+			break;
+
+		if (probe_reopen) {
+			probe_reopen = FALSE;
+			if (probe_fd != -1)
+				close(probe_fd);
+			probe_fd = -1;
+			continue;
+		}
+
+		probe_request = FALSE;
+		memcpy(path, probe_path, sizeof(path));
+		direct = probe_direct;
+		pthread_mutex_unlock(&probe_lock);
+
+		err = do_probe(path, direct);
+
+		clock_gettime(CLOCK_MONOTONIC, &tnow);
+
+		pthread_mutex_lock(&probe_lock);
+		timespecsub(&tnow, &probe_start, &tdiff);
+		latency[num_latency++ % NUM_LATENCY] = tdiff.tv_sec * 1000000L + tdiff.tv_nsec / 1000;
+		if (probe_late) {
+			log_message(LOG_WARNING, "write to %s completed after %ld ms", path,
+				tdiff.tv_sec * 1000L + tdiff.tv_nsec / 1000000L);
+		}
+		probe_err = err;
+		probe_busy = FALSE;
+		probe_done = TRUE;
+	}
+
+	if (probe_fd != -1)
+		close(probe_fd);
+	probe_fd = -1;
+
+	pthread_mutex_unlock(&probe_lock);
+	return NULL;
+}
+
+/* ================================================================= */
+
+/*
+ * Start the helper thread if a write-file is configured.
+ */
+
+int open_diskprobe(void)
+{
+	pthread_attr_t attr;
+	int err;
+
+	if (write_file == NULL || probe_started)
+		return 0;
+
+	if (posix_memalign((void **)&probe_buf, PROBE_BLOCK, PROBE_BLOCK) != 0) {
+		fatal_error(EX_SYSERR, "cannot allocate write-file buffer");
+	}
+	memset(probe_buf, 'w', PROBE_BLOCK);
+
+	probe_stop = FALSE;
+
+	/* Detached, as we cannot wait for a thread that is stuck in the kernel. */
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	err = pthread_create(&probe_thread, &attr, probe_main, NULL);
+	pthread_attr_destroy(&attr);
+
+	if (err) {
+		log_message(LOG_ERR, "cannot start write-file thread (errno = %d = '%s')", err, strerror(err));
+		return -1;
+	}
+
+	probe_started = TRUE;
+	return 0;
+}
+
+/*
+ * After a configuration reload: have the helper thread close the file so the
+ * next probe opens it with the new settings, or start the thread if this is
+ * the first write-file. The thread is kept if the write-file has gone, it is
+ * just not asked to probe any more.
+ */
+
+int reload_diskprobe(void)
+{
+	if (!probe_started)
+		return open_diskprobe();
+
+	pthread_mutex_lock(&probe_lock);
+	probe_reopen = TRUE;
+	pthread_cond_signal(&probe_cv);
+	pthread_mutex_unlock(&probe_lock);
+
+	return 0;
+}
+
+/*
+ * The check: report the last probe's result and start the next one, or if
+ * the last one is still running see if it has gone past its deadline.
+ */
+
+int check_diskprobe(struct list *unused)
+{
+	int err = ENOERR;
+
+	if (!probe_started || write_file == NULL)
+		return (ENOERR);
+
+	pthread_mutex_lock(&probe_lock);
+
+	if (probe_busy) {
+		struct timespec tnow, tdiff;
+		long msec;
+
+		clock_gettime(CLOCK_MONOTONIC, &tnow);
+		timespecsub(&tnow, &probe_start, &tdiff);
+		msec = tdiff.tv_sec * 1000L + tdiff.tv_nsec / 1000000L;
+
+		if (msec > write_file_timeout) {
+			if (!probe_late)
+				log_message(LOG_ERR, "write to %s not complete after %ld ms", probe_path, msec);
+			probe_late = TRUE;
+			err = ETIMEDOUT;
+		}
+	} else {
+		if (probe_done) {
+			err = probe_err;
+			probe_done = FALSE;
+		}
+
+		probe_late = FALSE;
+		probe_busy = TRUE;
+		probe_request = TRUE;
+		snprintf(probe_path, sizeof(probe_path), "%s", write_file);
+		probe_direct = write_file_direct;
+		clock_gettime(CLOCK_MONOTONIC, &probe_start);
+		pthread_cond_signal(&probe_cv);
+	}
+
+	pthread_mutex_unlock(&probe_lock);
+
+	return err;
+}
+
+static int cmp_long(const void *a, const void *b)
+{
+	long la = *(const long *)a, lb = *(const long *)b;
+
+	return (la > lb) - (la < lb);
+}
+
+/*
+ * Log percentiles of the recent probe latencies.
+ */
+
+void diskprobe_log_stats(void)
+{
+	long sorted[NUM_LATENCY];
+	int n;
+
+	if (!probe_started || write_file == NULL)
+		return;
+
+	pthread_mutex_lock(&probe_lock);
+	n = (num_latency < NUM_LATENCY) ? (int)num_latency : NUM_LATENCY;
+	memcpy(sorted, latency, n * sizeof(long));
+	pthread_mutex_unlock(&probe_lock);
+
+	if (n == 0)
+		return;
+
+	qsort(sorted, n, sizeof(long), cmp_long);
+
+	log_message(LOG_INFO, "write-file %s: last %d probes p50/p90/p99/max = %.3f/%.3f/%.3f/%.3f ms",
+		write_file, n,
+		1.0e-3 * sorted[n / 2],
+		1.0e-3 * sorted[(n * 90) / 100],
+		1.0e-3 * sorted[(n * 99) / 100],
+		1.0e-3 * sorted[n - 1]);
+}
+
+/*
+ * Ask the helper thread to stop, it closes the file. If it is stuck in the
+ * kernel we just leave it, process exit will take care of it.
+ */
+
+int close_diskprobe(void)
+{
+	if (!probe_started)
+		return 0;
+
+	pthread_mutex_lock(&probe_lock);
+	probe_stop = TRUE;
+	if (probe_busy && probe_late)
+		log_message(LOG_WARNING, "write to %s still hung on close", probe_path);
+	pthread_cond_signal(&probe_cv);
+	pthread_mutex_unlock(&probe_lock);
+
+	probe_started = FALSE;
+	return 0;
+}
@@ -3,11 +3,13 @@
 
 #include <stdio.h>
 #include <signal.h>
+#include <spawn.h>
 #include <time.h>
 #include <netinet/in.h>
 
 #include "logmessage.h"
 #include "xmalloc.h"
+#include "hist.h"
 
 /*
  * Define a macro to get the size of statically allocated arrays.
@@ -21,37 +23,101 @@ struct pingmode {
 	struct sockaddr to;
 	int sock_fp;
 	unsigned char *packet;
+	int index;		/* Target number in the pinger.c engine. */
 };
 
 struct filemode {
 	int mtime;
 	time_t stat_mtime;
 	time_t stat_changed;
+	int watched;		/* Followed by file_stat.c with inotify. */
+	int stale;		/* Watched, but needs looking at again (forked). */
+	int err;		/* errno of its last look when watched. */
+	int pending;		/* To be watched once the forked check has vetted its path. */
+	int path_ok;		/* That check found no symbolic link on the path. */
+};
+
+struct pidmode {
+	pid_t pid;		/* Last read from the pidfile, when watched. */
+	int err;		/* Result for the check, when watched. */
+	int watched;		/* Pidfile followed by pidfile.c with inotify. */
+	int pidfd;		/* Exit of the process followed with a pidfd, -1 if not. */
+	int lost;		/* Its directory has gone, watched again once it is back. */
 };
 
 struct ifmode {
-	unsigned long bytes;
+	unsigned long long bytes;	/* Received, as of the last check. */
+	unsigned long long packets;
+	unsigned long long dropped;
+	unsigned long long new_bytes;	/* As of the last read of the counters. */
+	unsigned long long new_packets;
+	unsigned long long new_dropped;
+	unsigned int dump;		/* Number of the netlink dump that gave them. */
 };
 
 struct tempmode {
 	int	in_use;
 	unsigned char have1, have2, have3;
+	struct snap_file *snap;	/* Sensor file, kept open by temp.c. */
+	int	max;		/* Limit from "sensor-max-temperature", 0 = none. */
+	int	crit;		/* Critical level given by the hwmon driver, 0 = none. */
+	float	last;		/* Last reading, for the rate of rise. */
+	double	last_time;	/* When that was, 0 = no reading yet. */
+	float	slope;		/* Rate of rise in degrees C per minute, averaged. */
 };
 
 union wdog_options {
 	struct pingmode net;
 	struct filemode file;
+	struct pidmode pid;
 	struct ifmode iface;
 	struct tempmode temp;
 };
 
-struct list {
-	char *name;
-	int version;
+/*
+ * The part of an entry that changes as it is checked and repaired. It is
+ * kept in an array for each list, apart from the configuration.
+ */
+struct list_state {
 	time_t last_time;
+	time_t repair_after;	/* No repair from the queue before this time. */
 	int repair_count;
-	union wdog_options parameter;
+	int repairing;		/* A repair is queued or running, see repair.c. */
+	int repair_error;	/* The error it is for. */
+};
+
+/*
+ * Entries and their state are allocated from a per-list arena (see
+ * add_list()), so adding one is O(1) and a walk over the state of a
+ * list does not touch the name or the settings of its entries.
+ */
+struct list {
 	struct list *next;
+	struct list_state *state;
+	int interval;		/* Check interval in ms, zero to use the default for the list type. */
+	int version;
+	char *name;
+	union wdog_options parameter;
+};
+
+struct sched_item {
+	const char *name;
+	const char *type;	/* Kind of check, for the per-type timing. */
+	int (*func)(struct list *act);
+	struct list *act;	/* Passed to func() and to wd_action(), may be NULL. */
+	long interval;		/* Milliseconds between runs. */
+	struct timespec due;	/* Next deadline on the CLOCK_MONOTONIC time-line. */
+	int order;		/* Registration order, used to run a batch deterministically. */
+	int heap_idx;
+	int parallel;		/* Safe to run on a worker thread alongside other checks. */
+	unsigned long runs;
+	unsigned long missed;	/* Deadlines skipped because the check was too late for them. */
+	long long late_sum;	/* Total and worst time (ns) between deadline and dispatch. */
+	long long late_max;
+	int last_result;	/* Error code from the last run. */
+	time_t last_run;	/* Wall-clock time of the last run, zero if never. */
+	struct hist hist;	/* Run times of this check. */
+	struct hist *type_hist;	/* Run times of all checks of this type. */
 };
 
 /* === Constants === */
@@ -87,10 +153,26 @@ extern int minpages;
 extern int minalloc;
 extern int maxswap;
 extern int maxtemp;
+extern int maxtemp_rise;
+extern int temp_auto;
 extern int pingcount;
 extern int temp_poweroff;
 extern int sigterm_delay;
 extern int repair_max;
+extern int check_threads;
+extern int metrics_socket;
+
+/* Per-type check intervals in milliseconds, zero means use 'tint'. */
+extern int tint_file;
+extern int tint_pidfile;
+extern int tint_ping;
+extern int tint_iface;
+extern int tint_temp;
+extern int tint_test;
+extern int tint_load;
+extern int tint_memory;
+extern int tint_alloc;
+extern int tint_ftable;
 
 extern char *devname;
 extern char *admin;
@@ -99,14 +181,27 @@ extern int	test_timeout;		/* test-binary time out value. */
 extern int	repair_timeout;		/* repair-binary time out value. */
 extern int	dev_timeout;		/* Watchdog hardware time-out. */
 extern int	retry_timeout;		/* Retry on non-critical errors. */
+extern int	repair_concurrency;	/* Repairs run at once from the queue, 0 = no queue. */
+extern int	repair_backoff;		/* Seconds to hold off a repair after one failed. */
+extern int	repair_batch;		/* One run of the repair binary per cycle. */
 
 extern char *logdir;
 extern char *write_file;
+extern int write_file_direct;
+extern int write_file_timeout;
+extern char *module_dir;
+extern int module_timeout;
+extern char *cgroup_dir;
+extern int cgroup_cpu_max;
+extern int cgroup_memory_max;
 extern char *heartbeat;
 extern int hbstamps;
 
 extern int refresh_use_settimeout;
 extern int refresh_ignore_errors;
+extern int refresh_thread;
+extern int refresh_interval;
+extern int refresh_stall;
 extern int realtime;
 
 extern struct list *tr_bin_list;
@@ -121,6 +216,7 @@ extern struct list *alloctimer;
 extern struct list *loadtimer;
 
 extern char *repair_bin;
+extern char *test_dir;
 
 /* = Not (yet) from config file. = */
 
@@ -144,6 +240,9 @@ extern pid_t daemon_pid;
 /** file_stat.c **/
 int check_file_stat(struct list *);
 int check_file_stat_safe(struct list *file);
+int open_filewatch(struct list *flist);
+void reload_filewatch(void);
+int close_filewatch(void);
 
 /** file_table.c **/
 int check_file_table(void);
@@ -152,6 +251,10 @@ int check_file_table(void);
 int open_watchdog(char *name, int timeout);
 int set_watchdog_timeout(int timeout);
 int keep_alive(void);
+int start_refresh_thread(void);
+void publish_health(int err);
+void keep_alive_hist(struct hist *h);
+int keep_alive_last(struct timespec *ts);
 int get_watchdog_fd(void);
 int close_watchdog(void);
 void safe_sleep(int sec);
@@ -166,6 +269,15 @@ int check_net(char *target, int sock_fp, struct sockaddr to, unsigned char *pack
 int open_netcheck(struct list *tlist);
 int close_netcheck(struct list *tlist);
 
+/** pinger.c **/
+int open_pinger(struct list *tlist);
+int reload_pinger(struct list *tlist);
+void ping_input(int fd, void *ptr);
+int ping_slot(void);
+int ping_result(struct list *act);
+void ping_log_stats(void);
+int close_pinger(void);
+
 /** temp.c **/
 int open_tempcheck(struct list *tlist);
 int check_temp(struct list *act);
@@ -175,11 +287,62 @@ int close_tempcheck(void);
 int check_bin(char *, int, int);
 void free_process(void);
 
+/** plugin.c **/
+int check_plugin(struct list *act);
+int repair_plugin(struct list *act, int result);
+int start_repair_plugin(struct list *act, int result);
+void open_plugins(void (*answered)(struct list *act));
+void reload_plugins(void);
+void close_plugins(void);
+
+/** module.c **/
+int check_module(struct list *act);
+int repair_module(struct list *act, int result);
+int start_repair_module(struct list *act, int result);
+void reload_modules(void);
+void close_modules(void);
+
+/** repair.c **/
+int queue_repair(struct list *act, const char *type, char *rbinary, int *result, int version);
+void repair_finished(struct list *act, int result);
+int batch_repair(struct list *act, const char *type, int result);
+void flush_repairs(char *rbinary);
+int open_repairs(void (*gaveup)(struct list *act, int error, int result));
+void reload_repairs(void);
+void close_repairs(void);
+
+/** cgroup.c **/
+struct cgroup_usage {
+	const char *name;		/* Of the binary. */
+	unsigned long runs;
+	unsigned long long cpu_usec;	/* From cpu.stat, all runs together. */
+	unsigned long long user_usec;
+	unsigned long long system_usec;
+	unsigned long long throttled_usec;
+	long long memory_peak;		/* Bytes, -1 if not known. */
+	unsigned long long oom_kills;
+};
+void cgroup_prepare(const char *path);
+int cgroup_spawn(pid_t *pid, const char *path, const posix_spawn_file_actions_t *fa, char *const argv[]);
+int exec_in_cgroup(int flags, void *ptr);
+void cgroup_collect(const char *path);
+void cgroup_foreach(void (*func)(const struct cgroup_usage *cu, void *ptr), void *ptr);
+int open_cgroups(void);
+void reload_cgroups(void);
+void close_cgroups(void);
+
 /** pidfile.c **/
 int check_pidfile(struct list *);
+int open_pidwatch(struct list *plist, void (*exited)(struct list *act));
+void reload_pidwatch(void);
+int close_pidwatch(void);
 
 /** iface.c **/
 int check_iface(struct list *);
+int update_iface_stats(void);
+int open_iface(struct list *ilist);
+void reload_iface(void);
+int close_iface(void);
 
 /** memory.c **/
 int open_memcheck(void);
@@ -206,8 +369,79 @@ int write_pid_file(const char *fname);
 int remove_pid_file(void);
 int wd_daemon(int nochdir, int noclose);
 
+/** procsnap.c **/
+struct snap_file;
+void snap_next_cycle(void);
+struct snap_file *snap_open(const char *name);
+void snap_close(struct snap_file *sf);
+int snap_read(struct snap_file *sf, const char **text);
+int snap_scan(const struct snap_file *sf, const char *const *keys, int nkeys, long *vals);
+
+/** sched.c **/
+int open_sched(void);
+struct sched_item *sched_add(const char *name, const char *type, int (*func)(struct list *), struct list *act, long interval);
+void sched_del(struct sched_item *item);
+void sched_set_interval(struct sched_item *item, long interval);
+void sched_run_now(struct sched_item *item);
+int sched_add_fd(int fd, void (*func)(int fd, void *ptr), void *ptr);
+int sched_add_fd_out(int fd, void (*func)(int fd, void *ptr), void *ptr);
+int sched_del_fd(int fd);
+int sched_wait(struct sched_item **due, int max);
+void sched_log_stats(void);
+void sched_log_timing(void);
+void sched_foreach(void (*func)(struct sched_item *item, void *ptr), void *ptr);
+void sched_get_totals(unsigned long *runs, unsigned long *missed, long long *late_max);
+int close_sched(void);
+
+/** pool.c **/
+int open_pool(int nthreads);
+void pool_run(struct sched_item **items, int *results, int n);
+void pool_log_stats(void);
+int close_pool(void);
+
+/** timing.c **/
+struct hist *timing_type(const char *name);
+void timing_cycle(long long nsec);
+void hist_log(const char *what, const struct hist *h);
+void timing_log_stats(void);
+void timing_init(void);
+void timing_check_dump(void);
+
+/** metrics.c **/
+int open_metrics(void);
+void metrics_count_error(int err);
+int close_metrics(void);
+
+/** diskprobe.c **/
+int open_diskprobe(void);
+int reload_diskprobe(void);
+int check_diskprobe(struct list *);
+void diskprobe_log_stats(void);
+int close_diskprobe(void);
+
+/** testdir.c **/
+int open_testdir(const char *path, void (*added)(struct list *act), void (*removed)(struct list *act));
+int close_testdir(void);
+
+/** reload.c **/
+void reload_init(void);
+int reload_pending(void);
+int reload_begin(const char *configfile);
+void reload_abort(void);
+void reload_match(void);
+struct list *reload_entry(struct list **head, struct list *old);
+struct list *reload_any_entry(struct list *old);
+int reload_is_new(struct list **head, struct list *act);
+int reload_changed(struct list **head);
+void reload_end(void);
+
 /** configfile.c **/
-void read_config(char *configfile);
+extern int config_lines;
+extern int config_files;
+extern int config_cached;
+extern double config_msec;
+int read_config(char *configfile);
+int test_binary_usable(const char *fname, const char *name);
 void free_all_lists(void);
 
 /** killall5.c **/
@@ -231,6 +465,7 @@ int run_func_as_child(int timeout, int (*funcptr)(int, void *), int code, void *
 #define FLAG_REOPEN_STD_REPAIR	0x04
 void set_reopen_dir(const char *dname);
 int reopen_std_files(int flags);
+int reopen_std_actions(posix_spawn_file_actions_t *fa, int flags);
 
 /** send-email.c **/
 int send_email(int errorcode, void *ptr);
@@ -0,0 +1,673 @@
+/* > file_stat.c
+ *
+ * The "file" checks: that a file can be stat()'d and, with "change", that it
+ * has been modified recently enough.
+ *
+ * Files on local file systems are followed with inotify, a watch on each
+ * directory holding such a file. Writes and removals update the file's
+ * status as they arrive, so the check itself needs no system call at all
+ * and the time of the last change is known to within the event latency.
+ * Events that need a look at the file (created, moved in, touched, lost
+ * events) only mark it, and the next check looks with the same forked
+ * stat() as an unwatched file, so the main loop never calls stat() itself.
+ * The forked check is kept for network, FUSE and automounted file systems,
+ * which may hang and do not report changes made by other hosts, and for
+ * any file that cannot be watched.
+ *
+ * A file is only watched once a forked check has found its directory by
+ * its own name, without a symbolic link on the way, and the file itself
+ * not to be a link. Otherwise the events would be those of another name
+ * and the file system judged by the wrong path. When the directory goes
+ * the file is checked forked again until it is back and can be watched.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <limits.h>
+#include <mntent.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#include "extern.h"
+#include "watch_err.h"
+#include "gettime.h"
+
+#define FILE_EVENTS	(IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_DELETE \
+			| IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+
+/* File systems that need the forked stat(), an entry ending in '.' matches any subtype. */
+static const char *const remote_fs[] = {
+	"nfs", "nfs4", "cifs", "smb3", "smbfs", "ncpfs", "9p", "afs", "ceph",
+	"glusterfs", "lustre", "gpfs", "gfs2", "ocfs2", "fuse", "fuse.", "fuseblk",
+	"autofs",
+};
+
+/* One for each watched file, found by directory watch and name within it. */
+struct file_watch {
+	struct list *act;
+	int wd;
+	const char *base;	/* Points into act->name. */
+	struct file_watch *next;
+};
+
+struct mount_point {
+	char *dir;
+	size_t len;
+	int remote;
+};
+
+static int inotify_fd = -1;
+static struct file_watch *watch_head = NULL;
+static struct file_watch **table = NULL;
+static size_t num_slots = 0;
+static size_t num_watches = 0;
+
+static void arm_watch(struct list *act);
+
+/* ================================================================= */
+
+static int file_verdict(struct list *file, time_t mtime)
+{
+	if (file->parameter.file.mtime != 0) {
+		time_t now = gettime();
+		if (mtime != file->parameter.file.stat_mtime) {
+			file->parameter.file.stat_mtime = mtime;
+			file->parameter.file.stat_changed = now;
+		}
+		int twait = (int)(now - file->parameter.file.stat_changed);
+
+		if (twait > file->parameter.file.mtime) {
+			/* file wasn't changed often enough */
+			log_message(LOG_ERR, "file %s was not changed in %d seconds (more than %d)", file->name, twait, file->parameter.file.mtime);
+			return (ENOCHANGE);
+		}
+		/* do verbose logging */
+		if (verbose && logtick && ticker == 1) {
+			char text[25];
+			/* Remove the trailing '\n' of the ctime() formatted string. */
+			strncpy(text, ctime(&mtime), sizeof(text)-1);
+			text[sizeof(text)-1] = 0;
+			log_message(LOG_DEBUG, "file %s was last changed at %s (%ds ago)", file->name, text, twait);
+		}
+	} else {
+		/* do verbose logging */
+		if (verbose && logtick && ticker == 1) {
+			log_message(LOG_DEBUG, "file %s status OK", file->name);
+		}
+	}
+	return (ENOERR);
+}
+
+int check_file_stat(struct list *file)
+{
+	struct stat buf;
+
+	if (file == NULL) {
+		return (ENOERR);
+	}
+
+	/* in filemode stat file */
+	if (stat(file->name, &buf) == -1) {
+		int err = errno;
+		log_message(LOG_ERR, "cannot stat %s (errno = %d = '%s')", file->name, err, strerror(err));
+		return (err);
+	}
+
+	return file_verdict(file, buf.st_mtime);
+}
+
+/*
+ * Split the directory off the absolute path 'name', NULL if it has none.
+ */
+
+static const char *split_dir(const char *name, char *dir, size_t size)
+{
+	const char *slash = strrchr(name, '/');
+
+	if (name[0] != '/' || slash[1] == '\0')
+		return NULL;
+
+	snprintf(dir, size, "%.*s", (slash == name) ? 1 : (int)(slash - name), name);
+	return slash + 1;
+}
+
+/*
+ * In the forked check of a file to be watched, or watched: see that its
+ * directory is found by that name and the file is not a symbolic link. If
+ * so the parent may watch it, if not it is left to the forked check. A
+ * directory not there (yet) is looked at again by the next check.
+ */
+
+static void vet_path(struct list *file)
+{
+	char dir[PATH_MAX], real[PATH_MAX];
+	struct stat buf;
+
+	file->parameter.file.path_ok = FALSE;
+
+	if (split_dir(file->name, dir, sizeof(dir)) == NULL || realpath(dir, real) == NULL)
+		return;
+
+	if (strcmp(real, dir) != 0 || (lstat(file->name, &buf) == 0 && S_ISLNK(buf.st_mode))) {
+		log_message(LOG_INFO, "%s is reached through a symbolic link, checking it by polling", file->name);
+		file->parameter.file.pending = FALSE;
+		file->parameter.file.watched = FALSE;
+		return;
+	}
+
+	file->parameter.file.path_ok = TRUE;
+}
+
+/*
+ * Present check_file_stat() in manner for run_func_as_child() to call.
+ * In this case 'code' is not used.
+ */
+
+static int run_func(int code, void *ptr)
+{
+	struct list *file = (struct list *)ptr;
+
+	if (file->parameter.file.pending || file->parameter.file.watched)
+		vet_path(file);
+
+	return check_file_stat(file);
+}
+
+/*
+ * An alternative to check_file_stat() that forks the process to run
+ * it as a child, so a time-out on NFS access, etc, won't trigger a hardware
+ * reset, so the main daemon has a chance to reboot cleanly. A file followed
+ * with inotify is on a local file system and its status is already known,
+ * unless an event has marked it stale. The child's file_verdict() updates
+ * the entry, which is in shared memory (see add_list()), and vets the path
+ * of a file to be watched, which is then watched from here.
+ */
+
+int check_file_stat_safe(struct list *file)
+{
+	const int CHECK_TIMEOUT = 5;
+	int ret;
+
+	if (file == NULL) {
+		return (ENOERR);
+	}
+
+	if (file->parameter.file.watched) {
+		int err = file->parameter.file.err;
+
+		if (!file->parameter.file.stale) {
+			if (err != ENOERR) {
+				log_message(LOG_ERR, "cannot stat %s (errno = %d = '%s')", file->name, err, strerror(err));
+				return (err);
+			}
+			return file_verdict(file, file->parameter.file.stat_mtime);
+		}
+
+		/* Cleared first, so an event during the look marks it again. */
+		file->parameter.file.stale = FALSE;
+	}
+
+	ret = run_func_as_child(CHECK_TIMEOUT, run_func, 0, file);
+
+	if (ret == ETOOLONG) {
+		log_message(LOG_ERR, "timeout getting file status for %s", file->name);
+	}
+
+	if (file->parameter.file.watched) {
+		if (ret == ETOOLONG)
+			file->parameter.file.stale = TRUE;
+		else
+			file->parameter.file.err = (ret == ENOCHANGE) ? ENOERR : ret;
+	} else if (file->parameter.file.pending && file->parameter.file.path_ok) {
+		arm_watch(file);
+	}
+
+	return (ret);
+}
+
+/* ================================================================= */
+
+/*
+ * Read the mount table, so the file system of a file can be told without
+ * going near it (a stat() or statfs() could hang on a dead server).
+ */
+
+static struct mount_point *read_mounts(int *num)
+{
+	struct mount_point *mp = NULL;
+	struct mntent *ent;
+	int size = 0;
+	FILE *fp;
+
+	*num = 0;
+
+	fp = setmntent("/proc/self/mounts", "r");
+	if (fp == NULL)
+		return NULL;
+
+	while ((ent = getmntent(fp)) != NULL) {
+		int ii, remote = FALSE;
+
+		for (ii = 0; ii < (int)ARRAY_SIZE(remote_fs); ii++) {
+			size_t len = strlen(remote_fs[ii]);
+
+			if (remote_fs[ii][len - 1] == '.' ? strncmp(ent->mnt_type, remote_fs[ii], len) == 0
+			    : strcmp(ent->mnt_type, remote_fs[ii]) == 0) {
+				remote = TRUE;
+				break;
+			}
+		}
+
+		if (*num >= size) {
+			size = (size > 0) ? 2 * size : 32;
+			mp = realloc(mp, size * sizeof(*mp));
+			if (mp == NULL) {
+				fatal_error(EX_SYSERR, "out of memory reading mount table");
+			}
+		}
+
+		mp[*num].dir = xstrdup(ent->mnt_dir);
+		mp[*num].len = strlen(ent->mnt_dir);
+		mp[*num].remote = remote;
+		(*num)++;
+	}
+
+	endmntent(fp);
+	return mp;
+}
+
+static void free_mounts(struct mount_point *mp, int num)
+{
+	int ii;
+
+	for (ii = 0; ii < num; ii++)
+		free(mp[ii].dir);
+	free(mp);
+}
+
+/*
+ * Is 'path' on a file system that needs the forked check? Taken from the
+ * longest mount point that is a prefix of the path, the last mounted if
+ * there are several. Unknown counts as remote.
+ */
+
+static int on_remote_fs(const char *path, const struct mount_point *mp, int num)
+{
+	size_t best = 0;
+	int ii, remote = TRUE;
+
+	for (ii = 0; ii < num; ii++) {
+		size_t len = mp[ii].len;
+
+		if (strncmp(path, mp[ii].dir, len) != 0)
+			continue;
+		if (len > 1 && path[len] != '/' && path[len] != '\0')
+			continue;
+		if (len >= best) {
+			best = len;
+			remote = mp[ii].remote;
+		}
+	}
+
+	return remote;
+}
+
+static size_t hash_watch(int wd, const char *base)
+{
+	size_t h = 2166136261u ^ (size_t)wd;
+
+	while (*base) {
+		h ^= (unsigned char)*base++;
+		h *= 16777619u;
+	}
+
+	return h & (num_slots - 1);
+}
+
+/*
+ * Build the table of watches again, after some have been added or dropped.
+ */
+
+static void rehash(void)
+{
+	struct file_watch *w;
+	size_t total = 0;
+
+	for (w = watch_head; w != NULL; w = w->next)
+		total++;
+
+	free(table);
+	for (num_slots = 16; num_slots < 2 * total; num_slots *= 2)
+		;
+	table = (struct file_watch **)xcalloc(num_slots, sizeof(struct file_watch *));
+	num_watches = total;
+
+	for (w = watch_head; w != NULL; w = w->next) {
+		size_t ii;
+
+		for (ii = hash_watch(w->wd, w->base); table[ii] != NULL; ii = (ii + 1) & (num_slots - 1))
+			;
+		table[ii] = w;
+	}
+}
+
+/*
+ * Add the watch 'w' to the list and the table, which is made bigger when
+ * half full.
+ */
+
+static void insert_watch(struct file_watch *w)
+{
+	size_t ii;
+
+	w->next = watch_head;
+	watch_head = w;
+
+	if (table == NULL || 2 * (num_watches + 1) > num_slots) {
+		rehash();
+		return;
+	}
+
+	for (ii = hash_watch(w->wd, w->base); table[ii] != NULL; ii = (ii + 1) & (num_slots - 1))
+		;
+	table[ii] = w;
+	num_watches++;
+}
+
+/*
+ * The directory of the watch 'wd' has gone, check its files forked until
+ * it is back and they can be watched again.
+ */
+
+static void drop_watches(int wd, uint32_t mask)
+{
+	struct file_watch *w, *next, **last = &watch_head;
+	int dropped = FALSE;
+
+	for (w = watch_head; w != NULL; w = next) {
+		next = w->next;
+		if (w->wd == wd) {
+			w->act->parameter.file.watched = FALSE;
+			w->act->parameter.file.pending = TRUE;
+			*last = next;
+			free(w);
+			dropped = TRUE;
+		} else {
+			last = &w->next;
+		}
+	}
+
+	if (!dropped)
+		return;
+
+	/* A moved directory is still watched under its new name. */
+	if (mask & IN_MOVE_SELF)
+		inotify_rm_watch(inotify_fd, wd);
+
+	rehash();
+}
+
+/*
+ * Have a watched file looked at again by its next check, for when it may
+ * have been replaced or touched. That is a forked stat(), as the file system
+ * may be slow even when local.
+ */
+
+static void refresh_file(struct list *act)
+{
+	act->parameter.file.stale = TRUE;
+}
+
+static void file_event(struct list *act, uint32_t mask)
+{
+	if (mask & (IN_DELETE | IN_MOVED_FROM)) {
+		act->parameter.file.err = ENOENT;
+		act->parameter.file.stale = FALSE;
+	} else if (mask & (IN_MODIFY | IN_CLOSE_WRITE)) {
+		/* Written to, so modified now and no need to look. */
+		act->parameter.file.err = ENOERR;
+		act->parameter.file.stale = FALSE;
+		act->parameter.file.stat_changed = gettime();
+		act->parameter.file.stat_mtime = time(NULL);
+	} else {
+		/* Created, moved in, or touched. */
+		refresh_file(act);
+	}
+}
+
+/*
+ * Called by the scheduler when there are events to read.
+ */
+
+static void filewatch_input(int fd, void *unused)
+{
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	struct file_watch *w;
+
+	while (1) {
+		ssize_t len = read(fd, buf, sizeof(buf));
+		char *ptr;
+
+		if (len < 0) {
+			int err = errno;
+			if (err != EAGAIN && err != EINTR) {
+				log_message(LOG_ERR, "read of file events gave errno = %d = '%s'", err, strerror(err));
+			}
+			break;
+		}
+
+		for (ptr = buf; ptr < buf + len; ) {
+			const struct inotify_event *ev = (const struct inotify_event *)ptr;
+
+			ptr += sizeof(struct inotify_event) + ev->len;
+
+			if (ev->mask & IN_Q_OVERFLOW) {
+				log_message(LOG_WARNING, "file events lost, looking at all watched files");
+				for (w = watch_head; w != NULL; w = w->next)
+					refresh_file(w->act);
+			} else if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+				drop_watches(ev->wd, ev->mask);
+			} else if (ev->len > 0) {
+				size_t ii;
+
+				for (ii = hash_watch(ev->wd, ev->name); table[ii] != NULL; ii = (ii + 1) & (num_slots - 1)) {
+					w = table[ii];
+					if (w->wd == ev->wd && strcmp(w->base, ev->name) == 0)
+						file_event(w->act, ev->mask);
+				}
+			}
+		}
+	}
+}
+
+/* ================================================================= */
+
+/*
+ * Have the file 'act' watched if it is on a local file system, by the
+ * mount table 'mp', once its next check has vetted the path.
+ */
+
+static void add_watch(struct list *act, const struct mount_point *mp, int num_mp)
+{
+	char dir[PATH_MAX];
+
+	act->parameter.file.watched = FALSE;
+	act->parameter.file.path_ok = FALSE;
+
+	/* Only absolute paths, the daemon changes directory. */
+	act->parameter.file.pending = (split_dir(act->name, dir, sizeof(dir)) != NULL
+				       && !on_remote_fs(act->name, mp, num_mp));
+}
+
+/*
+ * Watch the directory of 'act', whose path has just been vetted by its
+ * forked check. The look was made before the watch, so it needs another.
+ */
+
+static void arm_watch(struct list *act)
+{
+	char dir[PATH_MAX];
+	const char *base = split_dir(act->name, dir, sizeof(dir));
+	struct file_watch *w;
+	int wd;
+
+	act->parameter.file.pending = FALSE;
+
+	if (inotify_fd == -1 || base == NULL)
+		return;
+
+	wd = inotify_add_watch(inotify_fd, dir, FILE_EVENTS | IN_ONLYDIR);
+	if (wd < 0) {
+		if (verbose) {
+			int err = errno;
+			log_message(LOG_DEBUG, "cannot watch %s (errno = %d = '%s'), checking %s by polling",
+				dir, err, strerror(err), act->name);
+		}
+		return;
+	}
+
+	w = (struct file_watch *)xcalloc(1, sizeof(struct file_watch));
+	w->act = act;
+	w->wd = wd;
+	w->base = base;
+	insert_watch(w);
+
+	act->parameter.file.watched = TRUE;
+	refresh_file(act);
+
+	if (verbose)
+		log_message(LOG_DEBUG, "following %s with inotify", act->name);
+}
+
+/* ================================================================= */
+
+/*
+ * Follow the files of 'flist' that are on local file systems, call after
+ * open_sched().
+ */
+
+int open_filewatch(struct list *flist)
+{
+	struct mount_point *mp;
+	struct list *act;
+	int num_mp, total = 0, watched = 0;
+
+	close_filewatch();
+
+	for (act = flist; act != NULL; act = act->next) {
+		act->parameter.file.watched = FALSE;
+		total++;
+	}
+
+	if (total == 0)
+		return ENOERR;
+
+	inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (inotify_fd < 0) {
+		int err = errno;
+		log_message(LOG_ERR, "cannot create inotify instance (errno = %d = '%s')", err, strerror(err));
+		return err;
+	}
+
+	if (sched_add_fd(inotify_fd, filewatch_input, NULL) != ENOERR) {
+		close(inotify_fd);
+		inotify_fd = -1;
+		return ENOERR;
+	}
+
+	mp = read_mounts(&num_mp);
+
+	for (act = flist; act != NULL; act = act->next) {
+		add_watch(act, mp, num_mp);
+		if (act->parameter.file.pending)
+			watched++;
+	}
+
+	free_mounts(mp, num_mp);
+	rehash();
+
+	if (verbose)
+		log_message(LOG_DEBUG, "following %d of %d file(s) with inotify once checked", watched, total);
+
+	return ENOERR;
+}
+
+/*
+ * After reload_match(), move the watches over to the new entries of
+ * 'file_list', whose state has been carried over from the old ones, so
+ * the mount table is only read for files added.
+ */
+
+void reload_filewatch(void)
+{
+	struct file_watch *w, *next, **last = &watch_head;
+	struct mount_point *mp = NULL;
+	struct list *act;
+	int num_mp = 0, have_mp = FALSE;
+
+	if (inotify_fd == -1) {
+		open_filewatch(file_list);
+		return;
+	}
+
+	for (w = watch_head; w != NULL; w = next) {
+		struct list *nact = reload_entry(&file_list, w->act);
+
+		next = w->next;
+		if (nact == NULL) {
+			/* The directory watch is left, it may be shared and costs nothing. */
+			*last = next;
+			free(w);
+		} else {
+			w->act = nact;
+			w->base = strrchr(nact->name, '/') + 1;
+			last = &w->next;
+		}
+	}
+
+	for (act = file_list; act != NULL; act = act->next) {
+		if (!reload_is_new(&file_list, act))
+			continue;
+
+		if (!have_mp) {
+			mp = read_mounts(&num_mp);
+			have_mp = TRUE;
+		}
+		add_watch(act, mp, num_mp);
+	}
+
+	free_mounts(mp, num_mp);
+	rehash();
+}
+
+int close_filewatch(void)
+{
+	struct file_watch *w;
+
+	while ((w = watch_head) != NULL) {
+		w->act->parameter.file.watched = FALSE;
+		watch_head = w->next;
+		free(w);
+	}
+
+	free(table);
+	table = NULL;
+	num_slots = 0;
+	num_watches = 0;
+
+	if (inotify_fd != -1) {
+		sched_del_fd(inotify_fd);
+		close(inotify_fd);
+		inotify_fd = -1;
+	}
+
+	return 0;
+}
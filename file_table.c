@@ -0,0 +1,93 @@
+/* > file_table.c
+ *
+ * Check the system's file table has not overflowed. The counts are taken
+ * from /proc/sys/fs/file-nr, read as a snapshot, rather than by opening
+ * and closing a file to see if that fails with ENFILE. If file-nr cannot
+ * be read we fall back to the open() test. A full table by file-nr is only
+ * a warning, as root may still open files past the limit; the open() test
+ * then decides, and only a real ENFILE asks for a reboot.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "extern.h"
+#include "watch_err.h"
+
+static struct snap_file *ftable_snap = NULL;
+static int ftable_tried = FALSE;
+static const char ftable_name[] = "/proc/sys/fs/file-nr";
+
+static int open_test(void)
+{
+	int fd;
+	const char fname[] = "/proc/uptime"; /* Any file will do, so long as it ALWAYS exists. */
+	int err = ENOERR;
+
+	/* open a file */
+	fd = open(fname, O_RDONLY);
+	if (fd == -1) {
+		err = errno;
+		log_message(LOG_ERR, "cannot open %s (errno = %d = '%s')", fname, err, strerror(err));
+
+		if (err == ENFILE) {
+			/* we need a reboot if ENFILE is returned (file table overflow) */
+			log_message(LOG_ERR, "file table overflow detected!");
+			return (EREBOOT);
+		}
+	} else {
+		if (close(fd) < 0) {
+			err = errno;
+			log_message(LOG_ERR, "close %s gave errno = %d = '%s'", fname, err, strerror(err));
+		}
+	}
+
+	return (err);
+}
+
+int check_file_table(void)
+{
+	unsigned long nr_open, nr_max;
+	const char *buf;
+	char *ptr;
+	int err;
+
+	if (!ftable_tried) {
+		ftable_snap = snap_open(ftable_name);
+		ftable_tried = TRUE;
+	}
+
+	if (ftable_snap == NULL)
+		return open_test();
+
+	if ((err = snap_read(ftable_snap, &buf)) != ENOERR)
+		return (err);
+
+	/* allocated, free (always 0 now), maximum */
+	nr_open = strtoul(buf, &ptr, 10);
+	strtoul(ptr, &ptr, 10);
+	nr_max = strtoul(ptr, NULL, 10);
+
+	if (nr_max == 0) {
+		log_message(LOG_ERR, "%s does not contain any data (read = %s)", ftable_name, buf);
+		return open_test();
+	}
+
+	if (verbose && logtick && ticker == 1)
+		log_message(LOG_DEBUG, "file table has %lu of %lu entries in use", nr_open, nr_max);
+
+	if (nr_open >= nr_max) {
+		log_message(LOG_WARNING, "file table has %lu of %lu entries in use", nr_open, nr_max);
+		return open_test();
+	}
+
+	return (ENOERR);
+}
@@ -0,0 +1,41 @@
+#ifndef _HIST_H_
+#define _HIST_H_
+
+/*
+ * Fixed-bucket timing histogram, cheap enough to update on every check and
+ * needing no memory allocation. Bucket 0 counts times under 1us, bucket N
+ * counts times from 2^(N-1) up to 2^N microseconds, and the last bucket
+ * takes everything longer.
+ */
+
+#define HIST_BUCKETS	28	/* Last bucket starts at 2^26 us, about 67 seconds. */
+
+struct hist {
+	unsigned long count;
+	long long sum;		/* Nanoseconds. */
+	long long max;
+	unsigned long bucket[HIST_BUCKETS];
+};
+
+static inline void hist_add(struct hist *h, long long nsec)
+{
+	unsigned long long usec = (nsec > 0) ? nsec / 1000 : 0;
+	int b = (usec > 0) ? 64 - __builtin_clzll(usec) : 0;
+
+	if (b >= HIST_BUCKETS)
+		b = HIST_BUCKETS - 1;
+
+	h->bucket[b]++;
+	h->count++;
+	h->sum += nsec;
+	if (nsec > h->max)
+		h->max = nsec;
+}
+
+/* Upper bound of bucket 'b' in microseconds. */
+static inline long long hist_bound(int b)
+{
+	return 1LL << b;
+}
+
+#endif /*_HIST_H_*/
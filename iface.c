@@ -0,0 +1,368 @@
+/* > iface.c
+ *
+ * The "interface" checks: that each device has received something since
+ * its last check.
+ *
+ * The counters of every interface come from one RTM_GETLINK dump over
+ * rtnetlink, made by update_iface_stats() once for each batch of checks
+ * holding an interface check, rather than from a read and parse of all
+ * of /proc/net/dev for each one. Interfaces are found by exact name in a
+ * hash table, so "eth1" no longer matches the line of "eth10", and an
+ * interface that is re-created under a new index is still followed. If
+ * netlink cannot be used the checks read /proc/net/dev as before.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/if_link.h>
+
+#include "extern.h"
+#include "watch_err.h"
+
+#define NETDEV_LINE_LEN	128
+#define NL_BUFSIZE	32768
+
+static int nl_fd = -1;
+static unsigned int nl_seq = 0;
+static unsigned int dump_count = 0;	/* Number of the last good dump, zero if none. */
+static int dump_ok = FALSE;		/* The last dump worked, so the checks can use it. */
+
+/* The configured interfaces by name, open addressing with linear probing. */
+static struct list **table = NULL;
+static size_t num_slots = 0;
+
+/* ================================================================= */
+
+static size_t hash_name(const char *name)
+{
+	size_t h = 2166136261u;
+
+	while (*name) {
+		h ^= (unsigned char)*name++;
+		h *= 16777619u;
+	}
+
+	return h & (num_slots - 1);
+}
+
+/*
+ * Give every configured interface called 'name' the counters just read.
+ */
+
+static void set_stats(const char *name, const struct rtnl_link_stats64 *st)
+{
+	size_t ii;
+
+	for (ii = hash_name(name); table[ii] != NULL; ii = (ii + 1) & (num_slots - 1)) {
+		struct ifmode *im = &table[ii]->parameter.iface;
+
+		if (strcmp(table[ii]->name, name) == 0) {
+			im->new_bytes = st->rx_bytes;
+			im->new_packets = st->rx_packets;
+			im->new_dropped = st->rx_dropped;
+			im->dump = dump_count;
+		}
+	}
+}
+
+static void parse_link(const struct nlmsghdr *nh)
+{
+	const struct ifinfomsg *ifm = NLMSG_DATA(nh);
+	const struct rtattr *rta = IFLA_RTA(ifm);
+	int len = IFLA_PAYLOAD(nh);
+	const char *name = NULL;
+	struct rtnl_link_stats64 st;
+	int have_stats = FALSE;
+
+	for (; RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		if (rta->rta_type == IFLA_IFNAME) {
+			name = RTA_DATA(rta);
+		} else if (rta->rta_type == IFLA_STATS64 && RTA_PAYLOAD(rta) >= sizeof(st)) {
+			/* Copied out, the attribute is only 4-byte aligned. */
+			memcpy(&st, RTA_DATA(rta), sizeof(st));
+			have_stats = TRUE;
+		}
+	}
+
+	if (name != NULL && have_stats)
+		set_stats(name, &st);
+}
+
+/*
+ * Read the counters of all interfaces with one dump, call before running a
+ * batch of checks that has an interface check in it.
+ */
+
+int update_iface_stats(void)
+{
+	static char buf[NL_BUFSIZE] __attribute__ ((aligned(NLMSG_ALIGNTO)));
+	struct {
+		struct nlmsghdr nh;
+		struct ifinfomsg ifm;
+	} req;
+	int done = FALSE;
+
+	dump_ok = FALSE;
+
+	if (nl_fd == -1 || table == NULL)
+		return ENOERR;
+
+	memset(&req, 0, sizeof(req));
+	req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifinfomsg));
+	req.nh.nlmsg_type = RTM_GETLINK;
+	req.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	req.nh.nlmsg_seq = ++nl_seq;
+	req.ifm.ifi_family = AF_UNSPEC;
+
+	if (send(nl_fd, &req, req.nh.nlmsg_len, 0) < 0) {
+		int err = errno;
+		log_message(LOG_ERR, "cannot request interface statistics (errno = %d = '%s')", err, strerror(err));
+		return err;
+	}
+
+	if (++dump_count == 0)
+		dump_count = 1;
+
+	while (!done) {
+		ssize_t len = recv(nl_fd, buf, sizeof(buf), 0);
+		const struct nlmsghdr *nh;
+
+		if (len < 0) {
+			int err = errno;
+			if (err == EINTR)
+				continue;
+			log_message(LOG_ERR, "cannot read interface statistics (errno = %d = '%s')", err, strerror(err));
+			return err;
+		}
+
+		for (nh = (const struct nlmsghdr *)buf; NLMSG_OK(nh, len); nh = NLMSG_NEXT(nh, len)) {
+			if (nh->nlmsg_seq != nl_seq)
+				continue;
+			if (nh->nlmsg_type == NLMSG_DONE) {
+				done = TRUE;
+				break;
+			}
+			if (nh->nlmsg_type == NLMSG_ERROR) {
+				const struct nlmsgerr *ne = NLMSG_DATA(nh);
+				int err = -ne->error;
+				log_message(LOG_ERR, "interface statistics dump gave errno = %d = '%s'", err, strerror(err));
+				return err;
+			}
+			if (nh->nlmsg_type == RTM_NEWLINK)
+				parse_link(nh);
+		}
+	}
+
+	dump_ok = TRUE;
+	return ENOERR;
+}
+
+/* ================================================================= */
+
+/*
+ * The old way, for when netlink is not there: find the line of the device
+ * in /proc/net/dev.
+ */
+
+static int read_proc_net_dev(struct list *dev, int *found)
+{
+	const char fname[] = "/proc/net/dev";
+	FILE *file = fopen(fname, "r");
+	size_t nlen = strlen(dev->name);
+
+	*found = FALSE;
+
+	if (file == NULL) {
+		int err = errno;
+		log_message(LOG_ERR, "cannot open %s (errno = %d = '%s')", fname, err, strerror(err));
+		return (err);
+	}
+
+	/* read the file line by line */
+	while (!feof(file)) {
+		char line[NETDEV_LINE_LEN];
+		memset(line, 0, sizeof(line)); /* Just in case. */
+
+		if (fgets(line, NETDEV_LINE_LEN, file) == NULL) {
+			if (!ferror(file)) {
+				break;
+			} else {
+				int err = errno;
+				log_message(LOG_ERR, "cannot read %s (errno = %d = '%s')", fname, err, strerror(err));
+				fclose(file);
+				return (err);
+			}
+		} else {
+			int i = 0;
+
+			for (; line[i] == ' ' || line[i] == '\t'; i++) ;
+			if (strncmp(line + i, dev->name, nlen) == 0 && line[i + nlen] == ':') {
+				unsigned long long field[4];
+				char *ptr = line + i + nlen + 1;
+				int jj;
+
+				/* bytes, packets, errs, drop */
+				for (jj = 0; jj < 4; jj++)
+					field[jj] = strtoull(ptr, &ptr, 10);
+
+				dev->parameter.iface.new_bytes = field[0];
+				dev->parameter.iface.new_packets = field[1];
+				dev->parameter.iface.new_dropped = field[3];
+				*found = TRUE;
+			}
+		}
+	}
+
+	if (fclose(file) != 0) {
+		int err = errno;
+		log_message(LOG_ERR, "cannot close %s (errno = %d = '%s')", fname, err, strerror(err));
+		return (err);
+	}
+
+	return (ENOERR);
+}
+
+int check_iface(struct list *dev)
+{
+	struct ifmode *im = &dev->parameter.iface;
+	int found;
+
+	if (dump_ok) {
+		found = (im->dump == dump_count);
+	} else {
+		int err = read_proc_net_dev(dev, &found);
+		if (err != ENOERR)
+			return (err);
+	}
+
+	if (!found) {
+		/* do verbose logging */
+		if (verbose && logtick && ticker == 1)
+			log_message(LOG_DEBUG, "device %s not found", dev->name);
+		return (ENOERR);
+	}
+
+	/* do verbose logging */
+	if (verbose && logtick && ticker == 1)
+		log_message(LOG_DEBUG, "device %s received %llu bytes in %llu packets, %llu dropped (+%llu)",
+			dev->name, im->new_bytes, im->new_packets, im->new_dropped, im->new_dropped - im->dropped);
+
+	im->packets = im->new_packets;
+	im->dropped = im->new_dropped;
+
+	if (im->bytes == im->new_bytes) {
+		log_message(LOG_ERR, "device %s did not receive anything since last check", dev->name);
+		return (ENETUNREACH);
+	}
+
+	im->bytes = im->new_bytes;
+
+	return (ENOERR);
+}
+
+/* ================================================================= */
+
+/*
+ * Get ready to read the counters of the interfaces of 'ilist', call after
+ * open_sched().
+ */
+
+int open_iface(struct list *ilist)
+{
+	struct sockaddr_nl sa;
+	struct list *act;
+	size_t total = 0;
+
+	free(table);
+	table = NULL;
+	num_slots = 0;
+	dump_ok = FALSE;
+
+	for (act = ilist; act != NULL; act = act->next)
+		total++;
+
+	if (total == 0) {
+		close_iface();
+		return ENOERR;
+	}
+
+	for (num_slots = 16; num_slots < 2 * total; num_slots *= 2)
+		;
+	table = (struct list **)xcalloc(num_slots, sizeof(struct list *));
+
+	for (act = ilist; act != NULL; act = act->next) {
+		size_t ii;
+
+		for (ii = hash_name(act->name); table[ii] != NULL; ii = (ii + 1) & (num_slots - 1))
+			;
+		table[ii] = act;
+	}
+
+	if (nl_fd != -1)
+		return ENOERR;
+
+	nl_fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (nl_fd < 0) {
+		int err = errno;
+		log_message(LOG_ERR, "cannot open netlink socket (errno = %d = '%s'), reading /proc/net/dev", err, strerror(err));
+		return err;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.nl_family = AF_NETLINK;
+	if (bind(nl_fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+		int err = errno;
+		log_message(LOG_ERR, "cannot bind netlink socket (errno = %d = '%s'), reading /proc/net/dev", err, strerror(err));
+		close(nl_fd);
+		nl_fd = -1;
+		return err;
+	}
+
+	return ENOERR;
+}
+
+/*
+ * After reload_match(), point the table at the new entries of 'iface_list'.
+ * Unless interfaces have been added or removed each takes the slot of the
+ * old entry of the same name, so nothing is hashed again.
+ */
+
+void reload_iface(void)
+{
+	size_t ii;
+
+	if (table == NULL || reload_changed(&iface_list)) {
+		open_iface(iface_list);
+		return;
+	}
+
+	for (ii = 0; ii < num_slots; ii++) {
+		if (table[ii] != NULL)
+			table[ii] = reload_entry(&iface_list, table[ii]);
+	}
+}
+
+int close_iface(void)
+{
+	if (nl_fd != -1) {
+		close(nl_fd);
+		nl_fd = -1;
+	}
+
+	free(table);
+	table = NULL;
+	num_slots = 0;
+	dump_ok = FALSE;
+
+	return 0;
+}
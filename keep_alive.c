@@ -19,6 +19,9 @@
 #include <unistd.h>
 #include <time.h>
 #include <string.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>			/* for ioctl() */
@@ -33,6 +36,24 @@ static int timeout_used = TIMER_MARGIN;
 static int Refresh_using_ioctl = FALSE;
 static struct timespec tlast = {0, 0};
 
+/*
+ * State shared with the refresh thread. Once it is running the thread is the
+ * only one writing to the device, the check engine just publishes its health
+ * verdict and a progress time-stamp that the thread looks at before each refresh.
+ */
+static pthread_t feeder;
+static int feeder_started = FALSE;
+static pthread_mutex_t dev_lock = PTHREAD_MUTEX_INITIALIZER;	/* Serialise use of watchdog_fd. */
+static pthread_mutex_t feeder_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t feeder_wake;
+static atomic_int feeder_running = FALSE;
+static atomic_int health_word = ENOERR;		/* Verdict of the check engine. */
+static atomic_long engine_progress = 0;		/* Last monotonic second the engine was seen working. */
+static atomic_int feeder_err = ENOERR;		/* Last refresh error, reported by keep_alive(). */
+
+static struct timespec last_refresh = {0, 0};	/* For 'refresh_hist', both protected by 'dev_lock'. */
+static struct hist refresh_hist;
+
 /*
  * Open the watchdog timer (if name non-NULL) and set the time-out value (if non-zero).
  */
@@ -189,6 +210,31 @@ int set_watchdog_timeout(int timeout)
 	return rv;
 }
 
+/*
+ * Copy of the histogram of intervals between successful device refreshes.
+ */
+
+void keep_alive_hist(struct hist *h)
+{
+	pthread_mutex_lock(&dev_lock);
+	*h = refresh_hist;
+	pthread_mutex_unlock(&dev_lock);
+}
+
+/*
+ * Monotonic time of the last successful device refresh, returns FALSE if
+ * there has not been one yet.
+ */
+
+int keep_alive_last(struct timespec *ts)
+{
+	pthread_mutex_lock(&dev_lock);
+	*ts = last_refresh;
+	pthread_mutex_unlock(&dev_lock);
+
+	return (ts->tv_sec != 0 || ts->tv_nsec != 0);
+}
+
 /*
  * Test to see if "a - b > td" for a time-out indication.
  *
@@ -216,26 +262,21 @@ static int timespecpast(const struct timespec *a, const struct timespec *b, cons
 	return ret;
 }
 
-/* write to the watchdog device */
-int keep_alive(void)
+/*
+ * Do the actual refresh of the device, and the heart-beat file with it.
+ */
+
+static int refresh_device(void)
 {
 	int err = ENOERR;
-	struct timespec tnow;
-	const struct timespec tminimum = {0, NSEC/5}; /* Set to 0.2 seconds minimum 'ping' time. */
 
-	if (watchdog_fd == -1)
-		return (ENOERR);
-
-	/* Check if we have passed minimum period. */
-	clock_gettime(CLOCK_MONOTONIC, &tnow);
+	pthread_mutex_lock(&dev_lock);
 
-	if (timespecpast(&tnow, &tlast, &tminimum) == 0) {
+	if (watchdog_fd == -1) {
+		pthread_mutex_unlock(&dev_lock);
 		return (ENOERR);
 	}
 
-	/* Once we are going to feed the dog, save this time for next check. */
-	tlast = tnow;
-
 	if (Refresh_using_ioctl) {
 		int timeout = timeout_used;
 		if (ioctl(watchdog_fd, WDIOC_SETTIMEOUT, &timeout) < 0) {
@@ -250,6 +291,19 @@ int keep_alive(void)
 		}
 	}
 
+	if (err == ENOERR) {
+		struct timespec tnow, tdiff;
+
+		clock_gettime(CLOCK_MONOTONIC, &tnow);
+		if (last_refresh.tv_sec != 0 || last_refresh.tv_nsec != 0) {
+			timespecsub(&tnow, &last_refresh, &tdiff);
+			hist_add(&refresh_hist, (long long)tdiff.tv_sec * NSEC + tdiff.tv_nsec);
+		}
+		last_refresh = tnow;
+	}
+
+	pthread_mutex_unlock(&dev_lock);
+
 	/*
 	 * If we set this option then we simply ignore any errors reported by writing to
 	 * the watchdog device. Typically for broken IPMI implementations such as:
@@ -267,6 +321,190 @@ int keep_alive(void)
 	return (err);
 }
 
+/*
+ * Write to the watchdog device. When the refresh thread is running this only
+ * records that the check engine is still making progress and passes back any
+ * error the thread had writing to the device.
+ */
+
+int keep_alive(void)
+{
+	struct timespec tnow;
+	const struct timespec tminimum = {0, NSEC/5}; /* Set to 0.2 seconds minimum 'ping' time. */
+
+	if (watchdog_fd == -1)
+		return (ENOERR);
+
+	/* Check if we have passed minimum period. */
+	clock_gettime(CLOCK_MONOTONIC, &tnow);
+
+	if (atomic_load(&feeder_running)) {
+		atomic_store(&engine_progress, (long)tnow.tv_sec);
+		return atomic_exchange(&feeder_err, ENOERR);
+	}
+
+	if (timespecpast(&tnow, &tlast, &tminimum) == 0) {
+		return (ENOERR);
+	}
+
+	/* Once we are going to feed the dog, save this time for next check. */
+	tlast = tnow;
+
+	return refresh_device();
+}
+
+/*
+ * Body of the refresh thread: feed the device on a fixed grid of absolute
+ * deadlines for as long as the check engine reports good health and keeps
+ * making progress. A stalled engine is not fed, so a hung daemon still
+ * results in a hardware reset.
+ */
+
+static void *feeder_main(void *unused)
+{
+	struct timespec next;
+	long period = (refresh_interval > 0) ? refresh_interval : 1000L * tint;
+	const struct timespec tperiod = {period / 1000, (period % 1000) * 1000000L};
+	int stalled = FALSE;
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	while (atomic_load(&feeder_running)) {
+		struct timespec tnow;
+		long idle;
+
+		if (atomic_load(&health_word) != ENOERR) {
+			/* Engine has decided to act, leave the device to it. */
+			break;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &tnow);
+		idle = (long)tnow.tv_sec - atomic_load(&engine_progress);
+
+		if (refresh_stall > 0 && idle > refresh_stall) {
+			if (!stalled) {
+				log_message(LOG_ALERT, "checks made no progress for %ld seconds, no longer refreshing watchdog", idle);
+				stalled = TRUE;
+			}
+		} else {
+			int err;
+
+			if (stalled) {
+				log_message(LOG_WARNING, "checks running again, refreshing watchdog");
+				stalled = FALSE;
+			}
+
+			err = refresh_device();
+			if (err != ENOERR)
+				atomic_store(&feeder_err, err);
+		}
+
+		/* Next slot on the grid, skipping any we were too late for. */
+		timespecadd(&next, &tperiod, &next);
+		while (timespeccmp(&next, &tnow, <=))
+			timespecadd(&next, &tperiod, &next);
+
+		pthread_mutex_lock(&feeder_lock);
+		while (atomic_load(&feeder_running) &&
+		       pthread_cond_timedwait(&feeder_wake, &feeder_lock, &next) != ETIMEDOUT) {
+			/* Woken early, either to stop or spuriously. */
+		}
+		pthread_mutex_unlock(&feeder_lock);
+	}
+
+	return NULL;
+}
+
+/*
+ * Start the refresh thread at SCHED_FIFO priority one above the daemon's
+ * own real-time priority, falling back to normal scheduling if we lack
+ * the privilege.
+ */
+
+int start_refresh_thread(void)
+{
+	pthread_attr_t attr;
+	pthread_condattr_t cattr;
+	struct sched_param sp;
+	struct timespec tnow;
+	int err;
+
+	if (watchdog_fd == -1 || feeder_started)
+		return (ENOERR);
+
+	pthread_condattr_init(&cattr);
+	pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+	pthread_cond_init(&feeder_wake, &cattr);
+	pthread_condattr_destroy(&cattr);
+
+	clock_gettime(CLOCK_MONOTONIC, &tnow);
+	atomic_store(&engine_progress, (long)tnow.tv_sec);
+	atomic_store(&health_word, ENOERR);
+	atomic_store(&feeder_running, TRUE);
+
+	memset(&sp, 0, sizeof(sp));
+	sp.sched_priority = schedprio + 1;
+	if (sp.sched_priority > sched_get_priority_max(SCHED_FIFO))
+		sp.sched_priority = sched_get_priority_max(SCHED_FIFO);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+	pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+	pthread_attr_setschedparam(&attr, &sp);
+
+	err = pthread_create(&feeder, &attr, feeder_main, NULL);
+	pthread_attr_destroy(&attr);
+
+	if (err == EPERM) {
+		log_message(LOG_WARNING, "cannot use SCHED_FIFO for refresh thread, using normal priority");
+		err = pthread_create(&feeder, NULL, feeder_main, NULL);
+	}
+
+	if (err) {
+		log_message(LOG_ERR, "cannot start refresh thread (errno = %d = '%s')", err, strerror(err));
+		atomic_store(&feeder_running, FALSE);
+		return err;
+	}
+
+	feeder_started = TRUE;
+	log_message(LOG_INFO, "refresh thread started (priority %d)", sp.sched_priority);
+	return (ENOERR);
+}
+
+/*
+ * Stop the refresh thread (if running) and wait for it to exit.
+ */
+
+static void stop_refresh_thread(void)
+{
+	if (!feeder_started)
+		return;
+
+	pthread_mutex_lock(&feeder_lock);
+	atomic_store(&feeder_running, FALSE);
+	pthread_cond_signal(&feeder_wake);
+	pthread_mutex_unlock(&feeder_lock);
+
+	pthread_join(feeder, NULL);
+	feeder_started = FALSE;
+}
+
+/*
+ * Called by the check engine with the error it is about to act on. Anything
+ * other than ENOERR stops the refresh thread feeding the device, from then on
+ * keep_alive() refreshes it directly for as long as the engine still calls it.
+ */
+
+void publish_health(int err)
+{
+	atomic_store(&health_word, err);
+
+	if (err != ENOERR && feeder_started) {
+		log_message(LOG_NOTICE, "refresh thread stopped on error %d", err);
+		stop_refresh_thread();
+	}
+}
+
 /*
  * Provide read-only access to the watchdog file handle.
  */
@@ -286,6 +524,8 @@ int close_watchdog(void)
 {
 	int rv = 0;
 
+	stop_refresh_thread();
+
 	if (watchdog_fd != -1) {
 		if (write(watchdog_fd, "V", 1) < 0) {
 			int err = errno;
@@ -0,0 +1,98 @@
+/* > load.c
+ *
+ * Code for checking the system load averages.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "extern.h"
+#include "watch_err.h"
+
+static struct snap_file *load_snap = NULL;
+static const char load_name[] = "/proc/loadavg";
+
+/* ============================================================================ */
+
+int open_loadcheck(void)
+{
+	int rv = -1;
+
+	close_loadcheck();
+
+	if (maxload1 || maxload5 || maxload15) {
+		/* open the load average file */
+		load_snap = snap_open(load_name);
+		if (load_snap != NULL) {
+			rv = 0;
+		}
+	}
+
+	return rv;
+}
+
+/* ============================================================================ */
+
+int check_load(void)
+{
+	int avg1, avg5, avg15;
+	const char *buf, *ptr;
+	int err;
+
+	/* is the load average file open? */
+	if (load_snap == NULL)
+		return (ENOERR);
+
+	/* read the line (there is only one) */
+	if ((err = snap_read(load_snap, &buf)) != ENOERR)
+		return (err);
+	/* we only care about integer values */
+	avg1 = atoi(buf);
+
+	/* if we have incorrect data we might not be able to find */
+	/* the blanks we're looking for */
+	ptr = strchr(buf, ' ');
+	if (ptr != NULL) {
+		avg5 = atoi(ptr);
+		ptr = strchr(ptr + 1, ' ');
+	}
+
+	if (ptr != NULL) {
+		avg15 = atoi(ptr);
+	} else {
+		log_message(LOG_ERR, "%s does not contain any data (read = %s)", load_name, buf);
+		return (ENOLOAD);
+	}
+
+	if (verbose && logtick && ticker == 1)
+		log_message(LOG_DEBUG, "current load is %d %d %d", avg1, avg5, avg15);
+
+	if ((maxload1  > 0 && avg1  > maxload1) ||
+		(maxload5  > 0 && avg5  > maxload5) ||
+		(maxload15 > 0 && avg15 > maxload15)) {
+
+		log_message(LOG_ERR, "loadavg %d %d %d is higher than the given threshold %d %d %d!",
+							avg1, avg5, avg15,
+							maxload1, maxload5, maxload15);
+
+		return (EMAXLOAD);
+	}
+
+	return (ENOERR);
+}
+
+/* ============================================================================ */
+
+int close_loadcheck(void)
+{
+	snap_close(load_snap);
+	load_snap = NULL;
+	return 0;
+}
@@ -0,0 +1,163 @@
+/* > memory.c
+ *
+ * Code for periodically checking the 'free' memory in the system. Added in the
+ * functions open_memcheck() and close_memcheck() based on stuff from old watchdog.c
+ * and shutdown.c to make it more self-contained.
+ *
+ * TO DO:
+ * Should we have separate configuration for checking swap use?
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <linux/param.h>
+#endif
+
+#include "extern.h"
+#include "watch_err.h"
+
+/* The fields of /proc/meminfo used, sorted for snap_scan(). */
+enum { USED_BUFFER, USED_CACHE, FREEMEM, FREESWAP, TOTALSWAP, NUM_FIELDS };
+
+static const char *const mem_fields[NUM_FIELDS] = {
+	"Buffers",
+	"Cached",
+	"MemFree",
+	"SwapFree",
+	"SwapTotal",
+};
+
+static struct snap_file *mem_snap = NULL;
+static const char mem_name[] = "/proc/meminfo";
+
+static long kb_per_page(int pages)
+{
+	return pages * (long)(EXEC_PAGESIZE / 1024);
+}
+
+/*
+ * Open the memory information file if such as test is configured.
+ */
+
+int open_memcheck(void)
+{
+	int rv = -1;
+
+	close_memcheck();
+
+	if (minpages > 0 || maxswap > 0) {
+		/* open the memory info file */
+		mem_snap = snap_open(mem_name);
+		if (mem_snap != NULL) {
+			rv = 0;
+		}
+	}
+
+	return rv;
+}
+
+/*
+ * Read and check the contents of the memory information file.
+ */
+
+int check_memory(void)
+{
+	long val[NUM_FIELDS];
+	long free, freemem, freeswap, used_buffer, used_cache, totalswap, used;
+	int err;
+	int ret = ENOERR;
+
+	/* is the memory file open? */
+	if (mem_snap == NULL)
+		return (ENOERR);
+
+	/* read the file */
+	if ((err = snap_read(mem_snap, NULL)) != ENOERR)
+		return (err);
+
+	/* we only care about integer values, a field not found counts as 0 */
+	memset(val, 0, sizeof(val));
+	if (snap_scan(mem_snap, mem_fields, NUM_FIELDS, val) < NUM_FIELDS && verbose > 1) {
+		/*
+		 * Report error in parsing, but this could be due to older
+		 * kernel so don't make it an error or too verbose.
+		 */
+		log_message(LOG_DEBUG, "Failed to parse %s for all of its fields", mem_name);
+	}
+
+	freemem  = val[FREEMEM];
+	freeswap = val[FREESWAP];
+	totalswap = val[TOTALSWAP];
+	used_buffer = val[USED_BUFFER];
+	used_cache  = val[USED_CACHE];
+
+	/*
+	 * Compute "free memnory" from what is reported as free, the buffers and
+	 * cache use. When pressed, the kernel will free up buffers & cache for
+	 * other use, but as a result if this measure of "free" gets below a few
+	 * tens of MB then the machine is going to be pretty sick.
+	 */
+	free = freemem + used_buffer + used_cache;
+	used = totalswap - freeswap;
+
+	if (verbose && logtick && ticker == 1) {
+		log_message(LOG_DEBUG, "currently there are %ld kB usable memory and %ld of %ld swap used", free, used, freeswap);
+	}
+
+	if (minpages && (free < kb_per_page(minpages))) {
+		log_message(LOG_ERR, "memory available %ld kB is less than %d pages", free, minpages);
+		ret = ENOMEM;
+	}
+
+	if (maxswap && (used > kb_per_page(maxswap))) {
+		log_message(LOG_ERR, "swap used %ld kB is more than %d pages", used, maxswap);
+		ret = ENOMEM;
+	}
+
+	return ret;
+}
+
+/*
+ * Close the special memory data file (if open).
+ */
+
+int close_memcheck(void)
+{
+	snap_close(mem_snap);
+	mem_snap = NULL;
+	return 0;
+}
+
+int check_allocatable(void)
+{
+	char *mem;
+	size_t len = EXEC_PAGESIZE * (size_t)minalloc;
+
+	if (minalloc <= 0)
+		return 0;
+
+	/*
+	 * Map and fault in the pages
+	 */
+	mem = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, 0, 0);
+	if (mem == MAP_FAILED) {
+		int err = errno;
+		log_message(LOG_ALERT, "cannot allocate %lu bytes (errno = %d = '%s')",
+			    (unsigned long)len, err, strerror(err));
+		return err;
+	}
+
+	munmap(mem, len);
+	return 0;
+}
@@ -0,0 +1,558 @@
+/* > metrics.c
+ *
+ * Live state of the daemon in Prometheus text format, on a Unix domain
+ * socket in the log directory. A client connects and reads until end of
+ * file, for example with "socat - UNIX-CONNECT:/var/log/watchdog/metrics.sock".
+ *
+ * The socket is in the scheduler's epoll set, so a scrape is answered from
+ * the main loop between batches of checks and never blocks: the reply is
+ * built in memory and sent without waiting, and whatever a client cannot
+ * take at once is kept and sent as its socket becomes writable.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#define _GNU_SOURCE	/* For accept4() and open_memstream() */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "extern.h"
+#include "watch_err.h"
+#include "gettime.h"
+
+#define METRICS_NAME	"metrics.sock"
+#define MAX_SNDBUF	(4 * 1024 * 1024)
+#define MAX_CLIENTS	16	/* Unfinished replies kept, the oldest is dropped. */
+
+/* A client that has not yet taken all of its reply. */
+struct metrics_client {
+	int fd;
+	char *buf;
+	size_t len;
+	size_t off;
+	struct metrics_client *next;
+};
+
+static int listen_fd = -1;
+static char sock_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+
+static struct metrics_client *clients = NULL;
+static int num_clients = 0;
+
+/* Number of times each error code has been acted on, by (unsigned 8-bit) code. */
+static unsigned long error_counts[256];
+
+/* ================================================================= */
+
+/*
+ * Print 'str' as a label value, escaped as the text format requires.
+ */
+
+static void put_label(FILE *fp, const char *str)
+{
+	for (; str != NULL && *str; str++) {
+		switch (*str) {
+		case '\\':
+			fputs("\\\\", fp);
+			break;
+		case '"':
+			fputs("\\\"", fp);
+			break;
+		case '\n':
+			fputs("\\n", fp);
+			break;
+		default:
+			fputc(*str, fp);
+			break;
+		}
+	}
+}
+
+static void put_item_labels(FILE *fp, const char *type, const char *name)
+{
+	fputs("{type=\"", fp);
+	put_label(fp, type);
+	fputs("\",name=\"", fp);
+	put_label(fp, name);
+	fputs("\"}", fp);
+}
+
+static void put_header(FILE *fp, const char *metric, const char *type, const char *help)
+{
+	fprintf(fp, "# HELP %s %s\n# TYPE %s %s\n", metric, help, metric, type);
+}
+
+/* One metric for all of the scheduled checks. */
+
+struct item_metric {
+	FILE *fp;
+	const char *metric;
+	int which;
+};
+
+enum {
+	ITEM_RESULT,
+	ITEM_LAST_RUN,
+	ITEM_RUNS,
+	ITEM_MISSED,
+	ITEM_LATE_MAX,
+	ITEM_DURATION_SUM,
+	ITEM_DURATION_MAX,
+	ITEM_REPAIR_COUNT,
+	ITEM_FAILING_FOR,
+};
+
+/* Seconds an entry has been failing, 'last_time' is on the gettime() clock. */
+
+static long failing_for(const struct list *act)
+{
+	return (act->state->last_time != 0) ? (long)(gettime() - act->state->last_time) : 0;
+}
+
+static void put_item(struct sched_item *item, void *ptr)
+{
+	struct item_metric *im = (struct item_metric *)ptr;
+	FILE *fp = im->fp;
+
+	if ((im->which == ITEM_REPAIR_COUNT || im->which == ITEM_FAILING_FOR) && item->act == NULL)
+		return;
+
+	fputs(im->metric, fp);
+	put_item_labels(fp, item->type, item->name);
+
+	switch (im->which) {
+	case ITEM_RESULT:
+		fprintf(fp, " %d\n", item->last_result);
+		break;
+	case ITEM_LAST_RUN:
+		fprintf(fp, " %ld\n", (long)item->last_run);
+		break;
+	case ITEM_RUNS:
+		fprintf(fp, " %lu\n", item->runs);
+		break;
+	case ITEM_MISSED:
+		fprintf(fp, " %lu\n", item->missed);
+		break;
+	case ITEM_LATE_MAX:
+		fprintf(fp, " %.6f\n", 1.0e-9 * item->late_max);
+		break;
+	case ITEM_DURATION_SUM:
+		fprintf(fp, " %.6f\n", 1.0e-9 * item->hist.sum);
+		break;
+	case ITEM_DURATION_MAX:
+		fprintf(fp, " %.6f\n", 1.0e-9 * item->hist.max);
+		break;
+	case ITEM_REPAIR_COUNT:
+		fprintf(fp, " %d\n", item->act->state->repair_count);
+		break;
+	case ITEM_FAILING_FOR:
+		fprintf(fp, " %ld\n", failing_for(item->act));
+		break;
+	}
+}
+
+static void put_items(FILE *fp, const char *metric, const char *type, const char *help, int which)
+{
+	struct item_metric im;
+
+	im.fp = fp;
+	im.metric = metric;
+	im.which = which;
+
+	put_header(fp, metric, type, help);
+	sched_foreach(put_item, &im);
+}
+
+/*
+ * Ping targets are all run from one scheduled item, so list their repair
+ * state on their own.
+ */
+
+static void put_targets(FILE *fp)
+{
+	struct list *act;
+
+	if (target_list == NULL)
+		return;
+
+	put_header(fp, "watchdog_ping_repair_count", "gauge", "Repair attempts for the ping target.");
+	for (act = target_list; act != NULL; act = act->next) {
+		fputs("watchdog_ping_repair_count", fp);
+		put_item_labels(fp, "ping", act->name);
+		fprintf(fp, " %d\n", act->state->repair_count);
+	}
+
+	put_header(fp, "watchdog_ping_failing_seconds", "gauge",
+		"How long the ping target has been failing, zero if it is not.");
+	for (act = target_list; act != NULL; act = act->next) {
+		fputs("watchdog_ping_failing_seconds", fp);
+		put_item_labels(fp, "ping", act->name);
+		fprintf(fp, " %ld\n", failing_for(act));
+	}
+}
+
+/* One metric for all of the binaries run in cgroups. */
+
+struct cgroup_metric {
+	FILE *fp;
+	const char *metric;
+	int which;
+};
+
+enum {
+	CGROUP_RUNS,
+	CGROUP_CPU,
+	CGROUP_USER,
+	CGROUP_SYSTEM,
+	CGROUP_THROTTLED,
+	CGROUP_MEMORY_PEAK,
+	CGROUP_OOM_KILLS,
+};
+
+static void put_cgroup(const struct cgroup_usage *cu, void *ptr)
+{
+	struct cgroup_metric *cm = (struct cgroup_metric *)ptr;
+	FILE *fp = cm->fp;
+
+	/* Both from the memory controller. */
+	if ((cm->which == CGROUP_MEMORY_PEAK || cm->which == CGROUP_OOM_KILLS) && cu->memory_peak < 0)
+		return;
+
+	fprintf(fp, "%s{binary=\"", cm->metric);
+	put_label(fp, cu->name);
+	fputs("\"}", fp);
+
+	switch (cm->which) {
+	case CGROUP_RUNS:
+		fprintf(fp, " %lu\n", cu->runs);
+		break;
+	case CGROUP_CPU:
+		fprintf(fp, " %.6f\n", 1.0e-6 * cu->cpu_usec);
+		break;
+	case CGROUP_USER:
+		fprintf(fp, " %.6f\n", 1.0e-6 * cu->user_usec);
+		break;
+	case CGROUP_SYSTEM:
+		fprintf(fp, " %.6f\n", 1.0e-6 * cu->system_usec);
+		break;
+	case CGROUP_THROTTLED:
+		fprintf(fp, " %.6f\n", 1.0e-6 * cu->throttled_usec);
+		break;
+	case CGROUP_MEMORY_PEAK:
+		fprintf(fp, " %lld\n", cu->memory_peak);
+		break;
+	case CGROUP_OOM_KILLS:
+		fprintf(fp, " %llu\n", cu->oom_kills);
+		break;
+	}
+}
+
+static void put_cgroups(FILE *fp, const char *metric, const char *type, const char *help, int which)
+{
+	struct cgroup_metric cm;
+
+	cm.fp = fp;
+	cm.metric = metric;
+	cm.which = which;
+
+	put_header(fp, metric, type, help);
+	cgroup_foreach(put_cgroup, &cm);
+}
+
+static void put_all(FILE *fp)
+{
+	struct timespec tnow, tlast;
+	struct hist ka;
+	unsigned long runs, missed;
+	long long late_max;
+	int ii, refreshed;
+
+	put_items(fp, "watchdog_check_result", "gauge", "Error code from the last run of the check, 0 is good.", ITEM_RESULT);
+	put_items(fp, "watchdog_check_last_run_timestamp_seconds", "gauge", "Time of the last run of the check.", ITEM_LAST_RUN);
+	put_items(fp, "watchdog_check_runs_total", "counter", "Number of times the check has been run.", ITEM_RUNS);
+	put_items(fp, "watchdog_check_missed_deadlines_total", "counter", "Runs of the check skipped as it was too late.", ITEM_MISSED);
+	put_items(fp, "watchdog_check_lateness_max_seconds", "gauge", "Worst delay from deadline to running the check.", ITEM_LATE_MAX);
+	put_items(fp, "watchdog_check_duration_seconds_sum", "counter", "Total time spent running the check.", ITEM_DURATION_SUM);
+	put_items(fp, "watchdog_check_duration_max_seconds", "gauge", "Longest run of the check.", ITEM_DURATION_MAX);
+	put_items(fp, "watchdog_check_repair_count", "gauge", "Repair attempts since the check last passed.", ITEM_REPAIR_COUNT);
+	put_items(fp, "watchdog_check_failing_seconds", "gauge",
+		"How long the check has been failing, zero if it is not.", ITEM_FAILING_FOR);
+	put_targets(fp);
+
+	if (cgroup_dir != NULL) {
+		put_cgroups(fp, "watchdog_binary_runs_total", "counter", "Runs of the binary in its cgroup.", CGROUP_RUNS);
+		put_cgroups(fp, "watchdog_binary_cpu_seconds_total", "counter", "CPU time used by the binary.", CGROUP_CPU);
+		put_cgroups(fp, "watchdog_binary_cpu_user_seconds_total", "counter", "User CPU time used by the binary.", CGROUP_USER);
+		put_cgroups(fp, "watchdog_binary_cpu_system_seconds_total", "counter", "System CPU time used by the binary.", CGROUP_SYSTEM);
+		put_cgroups(fp, "watchdog_binary_cpu_throttled_seconds_total", "counter",
+			"Time the binary was held back by cgroup-cpu-max.", CGROUP_THROTTLED);
+		put_cgroups(fp, "watchdog_binary_memory_peak_bytes", "gauge", "Most memory used by any run of the binary.", CGROUP_MEMORY_PEAK);
+		put_cgroups(fp, "watchdog_binary_oom_kills_total", "counter",
+			"Runs of the binary killed for going over cgroup-memory-max.", CGROUP_OOM_KILLS);
+	}
+
+	sched_get_totals(&runs, &missed, &late_max);
+	put_header(fp, "watchdog_sched_runs_total", "counter", "Number of checks run.");
+	fprintf(fp, "watchdog_sched_runs_total %lu\n", runs);
+	put_header(fp, "watchdog_sched_missed_deadlines_total", "counter", "Check runs skipped as they were too late.");
+	fprintf(fp, "watchdog_sched_missed_deadlines_total %lu\n", missed);
+	put_header(fp, "watchdog_sched_lateness_max_seconds", "gauge", "Worst delay from deadline to running a check.");
+	fprintf(fp, "watchdog_sched_lateness_max_seconds %.6f\n", 1.0e-9 * late_max);
+
+	/* The histogram holds the intervals, so one less than the refreshes. */
+	keep_alive_hist(&ka);
+	refreshed = keep_alive_last(&tlast);
+	put_header(fp, "watchdog_keepalive_refreshes_total", "counter", "Successful refreshes of the watchdog device.");
+	fprintf(fp, "watchdog_keepalive_refreshes_total %lu\n", refreshed ? ka.count + 1 : 0);
+	put_header(fp, "watchdog_keepalive_interval_max_seconds", "gauge", "Longest time between device refreshes.");
+	fprintf(fp, "watchdog_keepalive_interval_max_seconds %.6f\n", 1.0e-9 * ka.max);
+
+	if (refreshed) {
+		struct timespec tdiff;
+
+		clock_gettime(CLOCK_MONOTONIC, &tnow);
+		timespecsub(&tnow, &tlast, &tdiff);
+		put_header(fp, "watchdog_keepalive_age_seconds", "gauge", "Time since the last device refresh.");
+		fprintf(fp, "watchdog_keepalive_age_seconds %ld.%06ld\n", (long)tdiff.tv_sec, tdiff.tv_nsec / 1000);
+	}
+
+	put_header(fp, "watchdog_errors_total", "counter", "Check results acted on, by error code.");
+	for (ii = 1; ii < 256; ii++) {
+		if (error_counts[ii] == 0)
+			continue;
+		fprintf(fp, "watchdog_errors_total{code=\"%d\",error=\"", ii);
+		put_label(fp, wd_strerror(ii));
+		fprintf(fp, "\"} %lu\n", error_counts[ii]);
+	}
+}
+
+/*
+ * Send as much of the rest of the reply as the socket takes, returns TRUE
+ * once the client is finished with (all sent, or an error).
+ */
+
+static int send_rest(int fd, const char *buf, size_t len, size_t *off)
+{
+	while (*off < len) {
+		ssize_t rv = send(fd, buf + *off, len - *off, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+		if (rv < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return FALSE;
+			if (verbose) {
+				int err = errno;
+				log_message(LOG_DEBUG, "metrics reply cut short after %lu of %lu bytes (errno = %d = '%s')",
+					    (unsigned long)*off, (unsigned long)len, err, strerror(err));
+			}
+			return TRUE;
+		}
+		*off += rv;
+	}
+
+	return TRUE;
+}
+
+static void drop_client(struct metrics_client *cl)
+{
+	struct metrics_client **pp;
+
+	for (pp = &clients; *pp != NULL; pp = &(*pp)->next) {
+		if (*pp == cl) {
+			*pp = cl->next;
+			num_clients--;
+			break;
+		}
+	}
+
+	sched_del_fd(cl->fd);
+	close(cl->fd);
+	free(cl->buf);
+	free(cl);
+}
+
+/*
+ * Called from the epoll loop when a client with an unfinished reply can
+ * take more of it.
+ */
+
+static void metrics_output(int fd, void *ptr)
+{
+	struct metrics_client *cl = (struct metrics_client *)ptr;
+
+	if (send_rest(fd, cl->buf, cl->len, &cl->off))
+		drop_client(cl);
+}
+
+/*
+ * Keep the rest of a reply for 'cfd' to send as the socket drains, the
+ * descriptor is closed here if that is not possible.
+ */
+
+static void keep_client(int cfd, const char *buf, size_t len, size_t off)
+{
+	struct metrics_client *cl, **pp;
+
+	if (num_clients >= MAX_CLIENTS) {
+		/* New clients go on the end, so the head is the oldest. */
+		if (verbose)
+			log_message(LOG_DEBUG, "too many metrics clients, dropping the oldest");
+		drop_client(clients);
+	}
+
+	cl = (struct metrics_client *)xcalloc(1, sizeof(struct metrics_client));
+	cl->fd = cfd;
+	cl->len = len - off;
+	cl->buf = (char *)malloc(cl->len);
+	if (cl->buf == NULL || sched_add_fd_out(cfd, metrics_output, cl) != ENOERR) {
+		free(cl->buf);
+		free(cl);
+		close(cfd);
+		return;
+	}
+	memcpy(cl->buf, buf + off, cl->len);
+
+	for (pp = &clients; *pp != NULL; pp = &(*pp)->next)
+		;
+	*pp = cl;
+	num_clients++;
+}
+
+/*
+ * Called from the epoll loop when a client is waiting: answer every
+ * pending connection, and close it unless the reply has to be finished
+ * later.
+ */
+
+static void metrics_input(int fd, void *unused)
+{
+	char *buf = NULL;
+	size_t len = 0;
+	FILE *fp;
+
+	while (1) {
+		int cfd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		size_t off = 0;
+
+		if (cfd < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+				int err = errno;
+				log_message(LOG_ERR, "metrics accept gave errno = %d = '%s'", err, strerror(err));
+			}
+			break;
+		}
+
+		if (buf == NULL) {
+			fp = open_memstream(&buf, &len);
+			if (fp == NULL) {
+				close(cfd);
+				break;
+			}
+			put_all(fp);
+			fclose(fp);
+		}
+
+		if (len > 0) {
+			int sndbuf = (len < MAX_SNDBUF) ? (int)len : MAX_SNDBUF;
+
+			setsockopt(cfd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+			if (!send_rest(cfd, buf, len, &off)) {
+				keep_client(cfd, buf, len, off);
+				continue;
+			}
+		}
+
+		close(cfd);
+	}
+
+	free(buf);
+}
+
+/* ================================================================= */
+
+/*
+ * Count an error code being acted on by wd_action().
+ */
+
+void metrics_count_error(int err)
+{
+	error_counts[err & 0xFF]++;
+}
+
+/*
+ * Create the socket and add it to the scheduler, call after open_sched().
+ */
+
+int open_metrics(void)
+{
+	struct sockaddr_un addr;
+	int err;
+
+	if (!metrics_socket || listen_fd != -1)
+		return 0;
+
+	if (snprintf(sock_path, sizeof(sock_path), "%s/%s", logdir, METRICS_NAME) >= (int)sizeof(sock_path)) {
+		log_message(LOG_ERR, "metrics socket path in %s is too long", logdir);
+		return ENAMETOOLONG;
+	}
+
+	listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (listen_fd < 0) {
+		err = errno;
+		log_message(LOG_ERR, "cannot create metrics socket (errno = %d = '%s')", err, strerror(err));
+		return err;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, sock_path);
+
+	/* Left over from a daemon that did not exit cleanly. */
+	unlink(sock_path);
+
+	if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+	    || chmod(sock_path, 0660) < 0
+	    || listen(listen_fd, 16) < 0) {
+		err = errno;
+		log_message(LOG_ERR, "cannot listen on %s (errno = %d = '%s')", sock_path, err, strerror(err));
+		close_metrics();
+		return err;
+	}
+
+	err = sched_add_fd(listen_fd, metrics_input, NULL);
+	if (err != ENOERR) {
+		close_metrics();
+		return err;
+	}
+
+	if (verbose)
+		log_message(LOG_DEBUG, "serving metrics on %s", sock_path);
+
+	return ENOERR;
+}
+
+int close_metrics(void)
+{
+	while (clients != NULL)
+		drop_client(clients);
+
+	if (listen_fd == -1)
+		return 0;
+
+	sched_del_fd(listen_fd);
+	close(listen_fd);
+	listen_fd = -1;
+	unlink(sock_path);
+
+	return 0;
+}
@@ -0,0 +1,581 @@
+/* > module.c
+ *
+ * Check modules: shared objects from the "plugin-directory", loaded with
+ * dlopen() and called through the interface of wdplugin.h. Their results
+ * go through wd_action() as those of a test binary would, so the retry and
+ * repair handling is the same, but a check is a function call rather than
+ * a process.
+ *
+ * As with the write-file probe, each module is called by a helper thread
+ * of its own and the check waits for it for up to "plugin-timeout-ms". A
+ * call that takes longer is reported as ETIMEDOUT and the module is not
+ * called again until it returns, so a module that hangs does not stop the
+ * watchdog device being refreshed. With a time-out of zero the calls are
+ * made directly, which costs nothing but trusts the module not to hang.
+ *
+ * A repair from the repair queue (see repair.c) is not waited for: the
+ * thread signals an eventfd when it is done and a timerfd holds its
+ * "repair-timeout", both in the scheduler's epoll set, and the outcome is
+ * handed to repair_finished(). Until then the check gives EDONTKNOW. A
+ * module called directly is repaired directly too.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#include "extern.h"
+#include "watch_err.h"
+#include "gettime.h"
+#include "wdplugin.h"
+
+#define MOD_INIT	0
+#define MOD_CHECK	1
+#define MOD_REPAIR	2
+
+struct module {
+	char *name;
+	struct list *act;	/* Entry it is the check of. */
+	void *handle;
+	const struct wdplugin *ops;
+	struct wdplugin_ctx ctx;
+	int threaded;		/* Called by 'thread', else directly. */
+	int ready;		/* init() has succeeded, so teardown() is due. */
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cv;
+	int done_fd;		/* eventfd, signalled when a queued repair is done. */
+	int timer_fd;		/* Deadline of a queued repair. */
+
+	/* These are protected by 'lock'. */
+	int pending;		/* Call posted, not yet finished. */
+	int request;		/* MOD_* of the call. */
+	int arg;
+	int result;
+	int late;		/* Already reported as over its time. */
+	int stop;		/* Thread to tear down the module and end. */
+	int stopped;
+	int queued;		/* The call is a repair from the queue, not waited for. */
+
+	struct module *next;
+};
+
+static struct module *module_head = NULL;
+
+/* ================================================================= */
+
+static struct module *find_module(const char *name)
+{
+	struct module *mod;
+
+	for (mod = module_head; mod != NULL; mod = mod->next) {
+		if (strcmp(mod->name, name) == 0)
+			return mod;
+	}
+
+	return NULL;
+}
+
+static int call_module(struct module *mod, int request, int arg)
+{
+	int err;
+
+	switch (request) {
+	case MOD_INIT:
+		err = (mod->ops->init != NULL) ? mod->ops->init(&mod->ctx) : ENOERR;
+		mod->ready = (err == ENOERR);
+		return err;
+	case MOD_CHECK:
+		return mod->ops->check(&mod->ctx);
+	case MOD_REPAIR:
+		/* As with no repair binary, the error stands. */
+		return (mod->ops->repair != NULL) ? mod->ops->repair(&mod->ctx, arg) : arg;
+	}
+
+	return EINVAL;
+}
+
+static void *module_main(void *ptr)
+{
+	struct module *mod = (struct module *)ptr;
+
+	pthread_mutex_lock(&mod->lock);
+
+	while (1) {
+		int result;
+
+		while (!mod->pending && !mod->stop)
+			pthread_cond_wait(&mod->cv, &mod->lock);
+
+		if (!mod->pending)
+			break;
+
+		pthread_mutex_unlock(&mod->lock);
+
+		result = call_module(mod, mod->request, mod->arg);
+
+		pthread_mutex_lock(&mod->lock);
+		if (mod->late)
+			log_message(LOG_WARNING, "check module %s has returned %d after its time limit", mod->name, result);
+		mod->result = result;
+		mod->pending = FALSE;
+		pthread_cond_broadcast(&mod->cv);
+
+		if (mod->queued) {
+			uint64_t one = 1;
+
+			if (write(mod->done_fd, &one, sizeof(one)) < 0)
+				log_message(LOG_ERR, "cannot signal the end of the repair by check module %s", mod->name);
+		}
+	}
+
+	if (mod->ready && mod->ops->teardown != NULL)
+		mod->ops->teardown(&mod->ctx);
+
+	mod->stopped = TRUE;
+	pthread_cond_broadcast(&mod->cv);
+	pthread_mutex_unlock(&mod->lock);
+
+	return NULL;
+}
+
+static void deadline_after(struct timespec *ts, long msec)
+{
+	clock_gettime(CLOCK_MONOTONIC, ts);
+	ts->tv_sec += msec / 1000;
+	ts->tv_nsec += (msec % 1000) * 1000000L;
+	if (ts->tv_nsec >= NSEC) {
+		ts->tv_sec++;
+		ts->tv_nsec -= NSEC;
+	}
+}
+
+/*
+ * Have the module do 'request', allowing it 'msec' milliseconds.
+ */
+
+static int run_module(struct module *mod, int request, int arg, long msec)
+{
+	struct timespec deadline;
+	int result;
+
+	if (!mod->threaded)
+		return call_module(mod, request, arg);
+
+	pthread_mutex_lock(&mod->lock);
+
+	if (mod->pending) {
+		/* Already reported, but it is still an error. */
+		pthread_mutex_unlock(&mod->lock);
+		return ETIMEDOUT;
+	}
+
+	mod->request = request;
+	mod->arg = arg;
+	mod->late = FALSE;
+	mod->pending = TRUE;
+	pthread_cond_broadcast(&mod->cv);
+
+	deadline_after(&deadline, msec);
+	while (mod->pending) {
+		if (pthread_cond_timedwait(&mod->cv, &mod->lock, &deadline) == ETIMEDOUT)
+			break;
+	}
+
+	if (mod->pending) {
+		log_message(LOG_ERR, "check module %s not complete after %ld ms", mod->name, msec);
+		mod->late = TRUE;
+		result = ETIMEDOUT;
+	} else {
+		result = mod->result;
+	}
+
+	pthread_mutex_unlock(&mod->lock);
+
+	return result;
+}
+
+/*
+ * Tear down the module and forget it. One whose thread is stuck in a call
+ * has to be left loaded.
+ */
+
+static void unload_module(struct module *mod)
+{
+	struct module **mp;
+	int stopped = TRUE;
+
+	for (mp = &module_head; *mp != NULL; mp = &(*mp)->next) {
+		if (*mp == mod) {
+			*mp = mod->next;
+			break;
+		}
+	}
+
+	if (mod->threaded) {
+		struct timespec deadline;
+
+		pthread_mutex_lock(&mod->lock);
+		/* A repair outcome is of no interest now, and 'done_fd' goes. */
+		mod->queued = FALSE;
+		mod->stop = TRUE;
+		pthread_cond_broadcast(&mod->cv);
+
+		deadline_after(&deadline, module_timeout);
+		while (!mod->stopped) {
+			if (pthread_cond_timedwait(&mod->cv, &mod->lock, &deadline) == ETIMEDOUT)
+				break;
+		}
+		stopped = mod->stopped;
+		pthread_mutex_unlock(&mod->lock);
+	} else if (mod->ready && mod->ops->teardown != NULL) {
+		mod->ops->teardown(&mod->ctx);
+	}
+
+	if (mod->done_fd != -1) {
+		sched_del_fd(mod->done_fd);
+		close(mod->done_fd);
+		mod->done_fd = -1;
+	}
+	if (mod->timer_fd != -1) {
+		sched_del_fd(mod->timer_fd);
+		close(mod->timer_fd);
+		mod->timer_fd = -1;
+	}
+
+	if (!stopped) {
+		log_message(LOG_WARNING, "check module %s is still busy, leaving it loaded", mod->name);
+		return;
+	}
+
+	dlclose(mod->handle);
+	pthread_cond_destroy(&mod->cv);
+	pthread_mutex_destroy(&mod->lock);
+	free(mod->name);
+	free(mod);
+}
+
+/*
+ * Hand the outcome of a queued repair by 'mod' to the repair queue, once
+ * only: whichever of the thread and the time-out comes first.
+ */
+
+static void queued_repair_done(struct module *mod, int late)
+{
+	struct itimerspec its;
+	int report = FALSE, result = ETIMEDOUT;
+
+	pthread_mutex_lock(&mod->lock);
+	if (mod->queued && mod->pending == late) {
+		mod->queued = FALSE;
+		if (late)
+			mod->late = TRUE;
+		else
+			result = mod->result;
+		report = TRUE;
+	}
+	pthread_mutex_unlock(&mod->lock);
+
+	if (!report)
+		return;
+
+	memset(&its, 0, sizeof(its));
+	timerfd_settime(mod->timer_fd, 0, &its, NULL);
+
+	if (late)
+		log_message(LOG_ERR, "check module %s repair not complete after %d seconds", mod->name, repair_timeout);
+	else if (result != ENOERR)
+		log_message(LOG_ERR, "check module %s repair returned %d = '%s'", mod->name, result, wd_strerror(result));
+
+	if (mod->act != NULL)
+		repair_finished(mod->act, result);
+}
+
+/*
+ * Called by the scheduler when the thread has finished a queued repair.
+ */
+
+static void module_done(int fd, void *ptr)
+{
+	uint64_t count;
+
+	if (read(fd, &count, sizeof(count)) < 0)
+		return;
+
+	queued_repair_done((struct module *)ptr, FALSE);
+}
+
+/*
+ * Called by the scheduler when a queued repair is over its time.
+ */
+
+static void module_late(int fd, void *ptr)
+{
+	uint64_t expired;
+
+	if (read(fd, &expired, sizeof(expired)) < 0)
+		return;
+
+	queued_repair_done((struct module *)ptr, TRUE);
+}
+
+/*
+ * The descriptors for queued repairs, for a module with a thread.
+ */
+
+static int open_done_fds(struct module *mod)
+{
+	mod->done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	mod->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+	if (mod->done_fd < 0 || mod->timer_fd < 0) {
+		int err = errno;
+		log_message(LOG_ERR, "cannot create descriptors for check module %s (errno = %d = '%s')", mod->name, err, strerror(err));
+		return err;
+	}
+
+	if (sched_add_fd(mod->done_fd, module_done, mod) != ENOERR) {
+		close(mod->done_fd);
+		mod->done_fd = -1;
+		return EINVAL;
+	}
+
+	if (sched_add_fd(mod->timer_fd, module_late, mod) != ENOERR) {
+		close(mod->timer_fd);
+		mod->timer_fd = -1;
+		return EINVAL;
+	}
+
+	return ENOERR;
+}
+
+/*
+ * Load the module of 'act' and initialise it.
+ */
+
+static int load_module(struct list *act, struct module **pmod)
+{
+	const struct wdplugin *ops;
+	struct module *mod;
+	pthread_condattr_t ca;
+	void *handle;
+	int err;
+
+	handle = dlopen(act->name, RTLD_NOW | RTLD_LOCAL);
+	if (handle == NULL) {
+		log_message(LOG_ERR, "cannot load check module %s (%s)", act->name, dlerror());
+		return ENOEXEC;
+	}
+
+	ops = (const struct wdplugin *)dlsym(handle, WDPLUGIN_SYMBOL);
+	if (ops == NULL || ops->check == NULL || ops->abi < 1 || ops->abi > WDPLUGIN_ABI) {
+		log_message(LOG_ERR, "%s is not a check module for interface version %d", act->name, WDPLUGIN_ABI);
+		dlclose(handle);
+		return ENOEXEC;
+	}
+
+	mod = (struct module *)xcalloc(1, sizeof(struct module));
+	mod->name = xstrdup(act->name);
+	mod->act = act;
+	mod->handle = handle;
+	mod->ops = ops;
+	mod->ctx.abi = WDPLUGIN_ABI;
+	mod->ctx.path = mod->name;
+	mod->ctx.timeout_ms = module_timeout;
+	mod->done_fd = -1;
+	mod->timer_fd = -1;
+
+	pthread_mutex_init(&mod->lock, NULL);
+	pthread_condattr_init(&ca);
+	pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+	pthread_cond_init(&mod->cv, &ca);
+	pthread_condattr_destroy(&ca);
+
+	mod->next = module_head;
+	module_head = mod;
+
+	if (module_timeout > 0) {
+		pthread_attr_t attr;
+
+		err = open_done_fds(mod);
+		if (err != ENOERR) {
+			unload_module(mod);
+			return err;
+		}
+
+		/* Detached, as we cannot wait for a module that never returns. */
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		err = pthread_create(&mod->thread, &attr, module_main, mod);
+		pthread_attr_destroy(&attr);
+
+		if (err) {
+			log_message(LOG_ERR, "cannot start thread for check module %s (errno = %d = '%s')", mod->name, err, strerror(err));
+			unload_module(mod);
+			return err;
+		}
+		mod->threaded = TRUE;
+	}
+
+	err = run_module(mod, MOD_INIT, 0, module_timeout);
+	if (err != ENOERR) {
+		log_message(LOG_ERR, "check module %s failed to start, returned %d = '%s'", mod->name, err, wd_strerror(err));
+		unload_module(mod);
+		return err;
+	}
+
+	if (verbose)
+		log_message(LOG_DEBUG, "loaded check module %s", mod->name);
+
+	*pmod = mod;
+	return ENOERR;
+}
+
+/* ================================================================= */
+
+/*
+ * The check of a module, loaded the first time. One that fails to load or
+ * initialise is tried again at its next check.
+ */
+
+int check_module(struct list *act)
+{
+	struct module *mod = find_module(act->name);
+	int err;
+
+	if (mod == NULL) {
+		err = load_module(act, &mod);
+		if (err != ENOERR)
+			return err;
+	}
+
+	mod->act = act;
+
+	if (mod->threaded) {
+		int queued;
+
+		pthread_mutex_lock(&mod->lock);
+		queued = mod->queued;
+		pthread_mutex_unlock(&mod->lock);
+
+		/* Its outcome will tell. */
+		if (queued)
+			return EDONTKNOW;
+	}
+
+	return run_module(mod, MOD_CHECK, 0, module_timeout);
+}
+
+/*
+ * Ask the module of 'act' to repair 'result', allowing it "repair-timeout"
+ * as for a repair binary.
+ */
+
+int repair_module(struct list *act, int result)
+{
+	struct module *mod = find_module(act->name);
+	int err;
+
+	if (mod == NULL) {
+		err = load_module(act, &mod);
+		if (err != ENOERR)
+			return err;
+	}
+
+	err = run_module(mod, MOD_REPAIR, result, 1000L * repair_timeout);
+	if (err != ENOERR)
+		log_message(LOG_ERR, "check module %s repair returned %d = '%s'", mod->name, err, wd_strerror(err));
+
+	return err;
+}
+
+/*
+ * For the repair queue: post a repair of 'result' to the thread of the
+ * module of 'act' without waiting, its outcome is passed to
+ * repair_finished(). A module without a thread is repaired there and then.
+ * Gives an error if the repair could not be started.
+ */
+
+int start_repair_module(struct list *act, int result)
+{
+	struct module *mod = find_module(act->name);
+	struct itimerspec its;
+	int err;
+
+	if (mod == NULL) {
+		err = load_module(act, &mod);
+		if (err != ENOERR)
+			return err;
+	}
+
+	mod->act = act;
+
+	if (!mod->threaded) {
+		repair_finished(act, repair_module(act, result));
+		return ENOERR;
+	}
+
+	pthread_mutex_lock(&mod->lock);
+	if (mod->pending) {
+		/* Still in a call that has run over its time. */
+		pthread_mutex_unlock(&mod->lock);
+		return ETIMEDOUT;
+	}
+	mod->request = MOD_REPAIR;
+	mod->arg = result;
+	mod->late = FALSE;
+	mod->queued = TRUE;
+	mod->pending = TRUE;
+	pthread_cond_broadcast(&mod->cv);
+	pthread_mutex_unlock(&mod->lock);
+
+	if (repair_timeout > 0) {
+		memset(&its, 0, sizeof(its));
+		its.it_value.tv_sec = repair_timeout;
+		timerfd_settime(mod->timer_fd, 0, &its, NULL);
+	}
+
+	return ENOERR;
+}
+
+/*
+ * After a reload, move the modules over to their new entries and unload
+ * those no longer there. Call before reload_end().
+ */
+
+void reload_modules(void)
+{
+	struct module *mod, *next;
+
+	for (mod = module_head; mod != NULL; mod = next) {
+		struct list *act = reload_entry(&tr_bin_list, mod->act);
+
+		next = mod->next;
+		if (act != NULL && act->version == 3) {
+			mod->act = act;
+			continue;
+		}
+
+		if (verbose)
+			log_message(LOG_DEBUG, "unloading check module %s", mod->name);
+		unload_module(mod);
+	}
+}
+
+void close_modules(void)
+{
+	while (module_head != NULL)
+		unload_module(module_head);
+}
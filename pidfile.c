@@ -0,0 +1,546 @@
+/* > pidfile.c
+ *
+ * The "pidfile" checks: that the process whose number is in the file is
+ * still running.
+ *
+ * Each pidfile's directory is watched with inotify, so the file is only read
+ * again when it has been written or replaced, and each process is held with
+ * a pidfd in the scheduler's epoll set, so its exit is known the moment it
+ * happens rather than at the next kill(pid, 0). The check then reports the
+ * state kept by the events and the watchdog is told to run it at once. A
+ * pidfile that cannot be watched is read every time as before, and without
+ * pidfd support (before Linux 5.3) the process is found with kill(pid, 0).
+ * One whose directory goes is read every time until the directory is back,
+ * when the check watches it again.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wait.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+
+#include "extern.h"
+#include "watch_err.h"
+#include "read-conf.h"
+
+#ifndef __NR_pidfd_open
+#define __NR_pidfd_open	434
+#endif
+
+#define PIDFILE_EVENTS	(IN_CLOSE_WRITE | IN_MODIFY | IN_CREATE | IN_MOVED_TO | IN_DELETE \
+			| IN_MOVED_FROM | IN_DELETE_SELF | IN_MOVE_SELF)
+
+/* One for each watched pidfile, found by directory watch and name. */
+struct pid_watch {
+	struct list *act;
+	int wd;
+	struct pid_watch *next;
+};
+
+static int inotify_fd = -1;
+static struct pid_watch *watch_head = NULL;
+static struct pid_watch **table = NULL;
+static size_t num_slots = 0;
+static void (*exit_func)(struct list *act) = NULL;
+
+static void watch_again(struct list *act);
+
+/* ================================================================= */
+
+/*
+ * Get the process number from the pidfile 'name', logging any error.
+ */
+
+static int read_pidfile(const char *name, pid_t *pid)
+{
+	int fd = open(name, O_RDONLY);
+	char buf[20];
+	int n;
+
+	if (fd == -1) {
+		int err = errno;
+		log_message(LOG_ERR, "cannot open %s (errno = %d = '%s')", name, err, strerror(err));
+		return (err);
+	}
+
+	/* position pointer at start of file */
+	if (lseek(fd, 0, SEEK_SET) < 0) {
+		int err = errno;
+		log_message(LOG_ERR, "lseek %s gave errno = %d = '%s'", name, err, strerror(err));
+		close(fd);
+		return (err);
+	}
+
+	/* read the line (there is only one) */
+	if ((n = read(fd, buf, sizeof(buf)-1)) < 0) {
+		int err = errno;
+		log_message(LOG_ERR, "read %s gave errno = %d = '%s'", name, err, strerror(err));
+		close(fd);
+		return (err);
+	}
+	/* Force string to be nul-terminated. */
+	buf[n] = 0;
+
+	/* we only care about integer values */
+	*pid = atoi(buf);
+
+	if (close(fd) == -1) {
+		int err = errno;
+		log_message(LOG_ERR, "could not close %s, errno = %d = '%s'", name, err, strerror(err));
+		return (err);
+	}
+
+	return (ENOERR);
+}
+
+static int ping_process(pid_t pid, const char *name)
+{
+	if (kill(pid, 0) == -1) {
+		int err = errno;
+		log_message(LOG_ERR, "pinging process %d (%s) gave errno = %d = '%s'", pid, name, err, strerror(err));
+		return (err);
+	}
+
+	return (ENOERR);
+}
+
+int check_pidfile(struct list *file)
+{
+	pid_t pid;
+	int err;
+
+	if (file->parameter.pid.lost)
+		watch_again(file);
+
+	if (file->parameter.pid.watched) {
+		pid = file->parameter.pid.pid;
+		err = file->parameter.pid.err;
+
+		if (err != ENOERR) {
+			if (pid > 0)
+				log_message(LOG_ERR, "process %d (%s) is not running (errno = %d = '%s')", pid, file->name, err, strerror(err));
+			else
+				log_message(LOG_ERR, "cannot read %s (errno = %d = '%s')", file->name, err, strerror(err));
+			return (err);
+		}
+
+		/* Without a pidfd it is one kill(), but no pidfile read. */
+		if (file->parameter.pid.pidfd == -1 && (err = ping_process(pid, file->name)) != ENOERR)
+			return (err);
+	} else {
+		if ((err = read_pidfile(file->name, &pid)) != ENOERR)
+			return (err);
+		if ((err = ping_process(pid, file->name)) != ENOERR)
+			return (err);
+	}
+
+	/* do verbose logging */
+	if (verbose && logtick && ticker == 1)
+		log_message(LOG_DEBUG, "was able to ping process %d (%s)", pid, file->name);
+
+	return (ENOERR);
+}
+
+/* ================================================================= */
+
+static void drop_pidfd(struct list *act)
+{
+	if (act->parameter.pid.pidfd != -1) {
+		sched_del_fd(act->parameter.pid.pidfd);
+		close(act->parameter.pid.pidfd);
+		act->parameter.pid.pidfd = -1;
+	}
+}
+
+/*
+ * Called by the scheduler when the process has exited.
+ */
+
+static void process_exited(int fd, void *ptr)
+{
+	struct pid_watch *w = (struct pid_watch *)ptr;
+	struct list *act = w->act;
+
+	drop_pidfd(act);
+	act->parameter.pid.err = ESRCH;
+
+	if (verbose)
+		log_message(LOG_DEBUG, "process %d (%s) has exited", act->parameter.pid.pid, act->name);
+
+	if (exit_func != NULL)
+		exit_func(act);
+}
+
+/*
+ * Read the pidfile again and follow the process now in it. A daemon that
+ * keeps its pidfile open truncates and writes it, so when 'partial' an
+ * empty file is taken as one still being written and left alone.
+ */
+
+static void update_pid(struct pid_watch *w, int partial)
+{
+	struct list *act = w->act;
+	pid_t pid = 0;
+	int err, fd;
+
+	err = read_pidfile(act->name, &pid);
+
+	if (partial && err == ENOERR && pid <= 0)
+		return;
+
+	if (err == ENOERR && pid == act->parameter.pid.pid && act->parameter.pid.pidfd != -1) {
+		/* Rewritten with the same process, still held. */
+		act->parameter.pid.err = ENOERR;
+		return;
+	}
+
+	drop_pidfd(act);
+	act->parameter.pid.pid = (err == ENOERR) ? pid : 0;
+	act->parameter.pid.err = err;
+
+	/* Not a single process, leave it to kill() as before. */
+	if (err != ENOERR || pid <= 0)
+		return;
+
+	fd = syscall(__NR_pidfd_open, pid, 0);
+	if (fd < 0) {
+		err = errno;
+		if (err == ESRCH) {
+			act->parameter.pid.err = err;
+		} else if (verbose && err != ENOSYS) {
+			log_message(LOG_DEBUG, "cannot open pidfd for process %d (%s) (errno = %d = '%s')", pid, act->name, err, strerror(err));
+		}
+		return;
+	}
+
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	if (sched_add_fd(fd, process_exited, w) != ENOERR) {
+		close(fd);
+		return;
+	}
+
+	act->parameter.pid.pidfd = fd;
+}
+
+/* ================================================================= */
+
+static size_t hash_watch(int wd, const char *base)
+{
+	size_t h = 2166136261u ^ (size_t)wd;
+
+	while (*base) {
+		h ^= (unsigned char)*base++;
+		h *= 16777619u;
+	}
+
+	return h & (num_slots - 1);
+}
+
+static const char *base_name(const struct list *act)
+{
+	return strrchr(act->name, '/') + 1;
+}
+
+/*
+ * Index the watches by directory and name, again after any are added or removed.
+ */
+
+static void rehash(void)
+{
+	struct pid_watch *w;
+	size_t total = 0;
+
+	for (w = watch_head; w != NULL; w = w->next)
+		total++;
+
+	free(table);
+	for (num_slots = 16; num_slots < 2 * total; num_slots *= 2)
+		;
+	table = (struct pid_watch **)xcalloc(num_slots, sizeof(struct pid_watch *));
+
+	for (w = watch_head; w != NULL; w = w->next) {
+		size_t ii;
+
+		for (ii = hash_watch(w->wd, base_name(w->act)); table[ii] != NULL; ii = (ii + 1) & (num_slots - 1))
+			;
+		table[ii] = w;
+	}
+}
+
+static void pidfile_event(struct pid_watch *w, uint32_t mask)
+{
+	struct list *act = w->act;
+
+	if (mask & (IN_DELETE | IN_MOVED_FROM)) {
+		drop_pidfd(act);
+		act->parameter.pid.pid = 0;
+		act->parameter.pid.err = ENOENT;
+	} else {
+		/* Written to but not closed, such as by a daemon that keeps it open. */
+		update_pid(w, (mask & (IN_MODIFY | IN_CREATE)) && !(mask & IN_CLOSE_WRITE));
+	}
+}
+
+/*
+ * The directory of the watch 'wd' has gone, read its pidfiles every time
+ * until it is back, see watch_again().
+ */
+
+static void drop_watches(int wd, uint32_t mask)
+{
+	struct pid_watch *w, *next, **last = &watch_head;
+	int dropped = FALSE;
+
+	for (w = watch_head; w != NULL; w = next) {
+		next = w->next;
+		if (w->wd == wd) {
+			drop_pidfd(w->act);
+			w->act->parameter.pid.watched = FALSE;
+			w->act->parameter.pid.lost = TRUE;
+			*last = next;
+			free(w);
+			dropped = TRUE;
+		} else {
+			last = &w->next;
+		}
+	}
+
+	if (!dropped)
+		return;
+
+	/* A moved directory is still watched under its new name. */
+	if (mask & IN_MOVE_SELF)
+		inotify_rm_watch(inotify_fd, wd);
+
+	rehash();
+}
+
+/*
+ * Called by the scheduler when there are pidfile events to read.
+ */
+
+static void pidwatch_input(int fd, void *unused)
+{
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	struct pid_watch *w;
+
+	while (1) {
+		ssize_t len = read(fd, buf, sizeof(buf));
+		char *ptr;
+
+		if (len < 0) {
+			int err = errno;
+			if (err != EAGAIN && err != EINTR) {
+				log_message(LOG_ERR, "read of pidfile events gave errno = %d = '%s'", err, strerror(err));
+			}
+			break;
+		}
+
+		for (ptr = buf; ptr < buf + len; ) {
+			const struct inotify_event *ev = (const struct inotify_event *)ptr;
+
+			ptr += sizeof(struct inotify_event) + ev->len;
+
+			if (ev->mask & IN_Q_OVERFLOW) {
+				log_message(LOG_WARNING, "pidfile events lost, reading all pidfiles");
+				for (w = watch_head; w != NULL; w = w->next) {
+					if (w->act->parameter.pid.watched)
+						update_pid(w, FALSE);
+				}
+			} else if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+				drop_watches(ev->wd, ev->mask);
+			} else if (ev->len > 0) {
+				size_t ii;
+
+				for (ii = hash_watch(ev->wd, ev->name); table[ii] != NULL; ii = (ii + 1) & (num_slots - 1)) {
+					w = table[ii];
+					if (w->wd == ev->wd && w->act->parameter.pid.watched && strcmp(base_name(w->act), ev->name) == 0)
+						pidfile_event(w, ev->mask);
+				}
+			}
+		}
+	}
+}
+
+/*
+ * Start following the pidfile 'act', reading it now.
+ */
+
+static void add_watch(struct list *act)
+{
+	char dir[PATH_MAX];
+	const char *slash = strrchr(act->name, '/');
+	struct pid_watch *w;
+	int wd;
+
+	act->parameter.pid.watched = FALSE;
+	act->parameter.pid.pidfd = -1;
+
+	/* Only absolute paths, the daemon changes directory. */
+	if (act->name[0] != '/')
+		return;
+
+	snprintf(dir, sizeof(dir), "%.*s", (slash == act->name) ? 1 : (int)(slash - act->name), act->name);
+
+	wd = inotify_add_watch(inotify_fd, dir, PIDFILE_EVENTS | IN_ONLYDIR);
+	if (wd < 0) {
+		/* Tried on every check while the directory is gone. */
+		if (verbose && !act->parameter.pid.lost) {
+			int err = errno;
+			log_message(LOG_DEBUG, "cannot watch %s (errno = %d = '%s'), reading %s each time",
+				dir, err, strerror(err), act->name);
+		}
+		return;
+	}
+
+	w = (struct pid_watch *)xcalloc(1, sizeof(struct pid_watch));
+	w->act = act;
+	w->wd = wd;
+	w->next = watch_head;
+	watch_head = w;
+
+	act->parameter.pid.watched = TRUE;
+	act->parameter.pid.pid = 0;
+	update_pid(w, FALSE);
+}
+
+/*
+ * Watch the pidfile 'act' again if its directory is back.
+ */
+
+static void watch_again(struct list *act)
+{
+	if (inotify_fd == -1)
+		return;
+
+	add_watch(act);
+	if (!act->parameter.pid.watched)
+		return;
+
+	act->parameter.pid.lost = FALSE;
+	rehash();
+
+	if (verbose)
+		log_message(LOG_DEBUG, "following %s with inotify again", act->name);
+}
+
+/* ================================================================= */
+
+/*
+ * Follow the pidfiles of 'plist', call after open_sched(). The function
+ * 'exited' is called when a process is seen to exit.
+ */
+
+int open_pidwatch(struct list *plist, void (*exited)(struct list *act))
+{
+	struct list *act;
+	int total = 0, watched = 0;
+
+	close_pidwatch();
+
+	/* Kept even with no pidfiles, for those a reload may add. */
+	exit_func = exited;
+
+	if (plist == NULL)
+		return ENOERR;
+
+	inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (inotify_fd < 0) {
+		int err = errno;
+		log_message(LOG_ERR, "cannot create inotify instance (errno = %d = '%s')", err, strerror(err));
+		return err;
+	}
+
+	if (sched_add_fd(inotify_fd, pidwatch_input, NULL) != ENOERR) {
+		close(inotify_fd);
+		inotify_fd = -1;
+		return ENOERR;
+	}
+
+	for (act = plist; act != NULL; act = act->next) {
+		add_watch(act);
+		total++;
+		if (act->parameter.pid.watched)
+			watched++;
+	}
+
+	rehash();
+
+	if (verbose)
+		log_message(LOG_DEBUG, "following %d of %d pidfile(s) with inotify", watched, total);
+
+	return ENOERR;
+}
+
+/*
+ * After reload_match(), move the watches over to the new entries of
+ * 'pidfile_list', whose state has been carried over from the old ones, so
+ * only pidfiles added or removed are read or let go.
+ */
+
+void reload_pidwatch(void)
+{
+	struct pid_watch *w, *next, **last = &watch_head;
+	struct list *act;
+
+	if (inotify_fd == -1) {
+		open_pidwatch(pidfile_list, exit_func);
+		return;
+	}
+
+	for (w = watch_head; w != NULL; w = next) {
+		struct list *nact = reload_entry(&pidfile_list, w->act);
+
+		next = w->next;
+		if (nact == NULL) {
+			/* The directory watch is left, it may be shared and costs nothing. */
+			drop_pidfd(w->act);
+			*last = next;
+			free(w);
+		} else {
+			w->act = nact;
+			last = &w->next;
+		}
+	}
+
+	for (act = pidfile_list; act != NULL; act = act->next) {
+		if (reload_is_new(&pidfile_list, act))
+			add_watch(act);
+	}
+
+	rehash();
+}
+
+int close_pidwatch(void)
+{
+	struct pid_watch *w;
+
+	while ((w = watch_head) != NULL) {
+		drop_pidfd(w->act);
+		w->act->parameter.pid.watched = FALSE;
+		watch_head = w->next;
+		free(w);
+	}
+
+	free(table);
+	table = NULL;
+	num_slots = 0;
+
+	if (inotify_fd != -1) {
+		sched_del_fd(inotify_fd);
+		close(inotify_fd);
+		inotify_fd = -1;
+	}
+
+	return 0;
+}
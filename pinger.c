@@ -0,0 +1,520 @@
+/* > pinger.c
+ *
+ * Multiplexed ICMP echo engine for the ping targets. A single raw socket is
+ * used for all targets: each round sends to every target at once, the
+ * replies are read from the scheduler's epoll set as they arrive and matched
+ * to their target by the index and round number carried in the echo payload.
+ *
+ * A round lasts the ping interval and has 'ping-count' slots. In each slot
+ * a probe is sent to any target that has not yet answered in this round, so
+ * as before a target gets 'ping-count' chances of 'interval / ping-count'
+ * seconds each, but the time to detect a failure no longer depends on the
+ * number of targets.
+ *
+ * Each target also keeps round-trip time statistics (smoothed RTT and
+ * variance, min/max and a fixed log2 histogram) and loss counts.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#define _GNU_SOURCE	/* For sendmmsg() */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netinet/ip.h>
+#include <linux/icmp.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "extern.h"
+#include "watch_err.h"
+#include "gettime.h"
+
+#define PING_DATALEN	(DATALEN + 8)
+#define PING_RCVLEN	(DATALEN + MAXIPLEN + MAXICMPLEN)
+#define RTT_BUCKETS	16	/* 2^7 us (128us) up to 2^22 us (~4s) and above. */
+#define RTT_MIN_SHIFT	7
+
+/* What we put in the echo request, and get back in the reply. */
+struct ping_payload {
+	uint32_t index;
+	uint32_t round;
+	struct timespec sent;
+};
+
+struct ping_target {
+	struct list *act;
+	struct sockaddr_in to;
+	int answered;		/* Reply seen in the current round. */
+	int result;		/* Verdict of the last completed round. */
+	/* Statistics, times in microseconds. */
+	unsigned long sent;
+	unsigned long received;
+	unsigned long rounds_lost;
+	long rtt_min;
+	long rtt_max;
+	long rtt_last;
+	long srtt;		/* Smoothed RTT, x8 fixed point as for TCP. */
+	long rttvar;		/* Smoothed mean deviation, x4 fixed point. */
+	unsigned long rtt_hist[RTT_BUCKETS];
+};
+
+static int ping_fd = -1;
+static struct ping_target *targets = NULL;
+static int num_targets = 0;
+static uint32_t round_num = 0;
+static int slot = 0;
+
+/*
+ * in_cksum --
+ *      Checksum routine for Internet Protocol family headers (C Version)
+ */
+static unsigned short in_cksum(unsigned short *addr, int len)
+{
+	int nleft = len, sum = 0;
+	unsigned short *w = addr, answer = 0;
+
+	while (nleft > 1) {
+		sum += *w++;
+		nleft -= 2;
+	}
+	if (nleft == 1) {
+		sum += htons(*(unsigned char *) w << 8);
+	}
+	sum = (sum >> 16) + (sum & 0xffff);
+	sum += (sum >> 16);
+	answer = ~sum;
+	return (answer);
+}
+
+/* ================================================================= */
+
+/*
+ * Room in the socket for a reply from every target at once.
+ */
+
+static void set_rcvbuf(void)
+{
+	int hold = num_targets * 2 * (PING_RCVLEN + 256);
+
+	if (hold < 48 * 1024)
+		hold = 48 * 1024;
+	if (setsockopt(ping_fd, SOL_SOCKET, SO_RCVBUF, (char *)&hold, sizeof(hold)) < 0) {
+		int err = errno;
+		log_message(LOG_ERR, "set revbuf error err = %d = '%s'", err, strerror(err));
+	}
+}
+
+static int open_socket(void)
+{
+	struct icmp_filter filt;
+	int hold;
+
+	ping_fd = socket(AF_INET, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_ICMP);
+	if (ping_fd < 0) {
+		return errno;
+	}
+
+	/* set filter for only ECHOREPLY packets */
+	memset(&filt, 0, sizeof(filt));
+	filt.data = ~(1 << ICMP_ECHOREPLY);
+	if (setsockopt(ping_fd, SOL_RAW, ICMP_FILTER, (char *)&filt, sizeof(filt)) < 0) {
+		int err = errno;
+		log_message(LOG_ERR, "set ICMP filter error err = %d = '%s'", err, strerror(err));
+	}
+
+	/* this is necessary for broadcast pings to work */
+	hold = 1;
+	if (setsockopt(ping_fd, SOL_SOCKET, SO_BROADCAST, (char *)&hold, sizeof(hold)) < 0) {
+		int err = errno;
+		log_message(LOG_ERR, "set broadcast error err = %d = '%s'", err, strerror(err));
+	}
+
+	set_rcvbuf();
+
+	return ENOERR;
+}
+
+/*
+ * Fill in the address of a target, FALSE if 'act' is not an IPv4 address.
+ */
+
+static int set_target(struct ping_target *pt, struct list *act, int ii)
+{
+	pt->act = act;
+	pt->to.sin_family = AF_INET;
+	pt->to.sin_addr.s_addr = inet_addr(act->name);
+	act->parameter.net.index = ii;
+
+	return (pt->to.sin_addr.s_addr != INADDR_NONE);
+}
+
+/*
+ * Set up the shared socket and the per-target state. This is done before
+ * we daemonize so a bad address is reported to the terminal.
+ *
+ * Returns the socket descriptor for the caller to poll, or -1 if there
+ * is nothing to ping.
+ */
+
+int open_pinger(struct list *tlist)
+{
+	struct list *act;
+	int err, ii;
+
+	close_pinger();
+
+	for (act = tlist; act != NULL; act = act->next)
+		num_targets++;
+
+	if (num_targets == 0)
+		return -1;
+
+	targets = (struct ping_target *)xcalloc(num_targets, sizeof(struct ping_target));
+
+	for (act = tlist, ii = 0; act != NULL; act = act->next, ii++) {
+		if (!set_target(&targets[ii], act, ii)) {
+			fatal_error(EX_USAGE, "unknown host %s", act->name);
+		}
+	}
+
+	err = open_socket();
+	if (err != ENOERR) {
+		fatal_error(EX_SYSERR, "error opening socket (%s)", strerror(err));
+	}
+
+	return ping_fd;
+}
+
+/*
+ * Take over a new list of targets after a configuration reload, while the
+ * old entries are still there to compare with. A target whose entry was
+ * carried over keeps its 'index', and so its statistics and the verdict of
+ * the last round, and the socket is kept open. New targets join at the next
+ * round. Unlike at start-up, a bad address is reported and the target fails
+ * every round rather than stopping the daemon.
+ *
+ * Returns the socket descriptor as for open_pinger(), which may be a new one.
+ */
+
+int reload_pinger(struct list *tlist)
+{
+	struct ping_target *old = targets;
+	int old_num = num_targets;
+	unsigned char *taken;
+	struct list *act;
+	int ii;
+
+	num_targets = 0;
+	for (act = tlist; act != NULL; act = act->next)
+		num_targets++;
+
+	if (num_targets == 0) {
+		num_targets = old_num;
+		close_pinger();
+		return -1;
+	}
+
+	targets = (struct ping_target *)xcalloc(num_targets, sizeof(struct ping_target));
+	taken = (unsigned char *)xcalloc(old_num + 1, 1);
+
+	for (act = tlist, ii = 0; act != NULL; act = act->next, ii++) {
+		struct ping_target *pt = &targets[ii];
+		int idx = act->parameter.net.index;
+
+		if (idx >= 0 && idx < old_num && !taken[idx] && strcmp(old[idx].act->name, act->name) == 0) {
+			*pt = old[idx];
+			taken[idx] = TRUE;
+		} else {
+			/* Sit out the rest of this round, it is too late for all its slots. */
+			pt->answered = TRUE;
+		}
+
+		if (!set_target(pt, act, ii)) {
+			log_message(LOG_ERR, "unknown host %s", act->name);
+			pt->to.sin_family = AF_UNSPEC;
+		}
+	}
+
+	free(taken);
+	free(old);
+
+	if (ping_fd == -1) {
+		int err = open_socket();
+
+		if (err != ENOERR) {
+			log_message(LOG_ERR, "error opening socket (err = %d = '%s')", err, strerror(err));
+			ping_fd = -1;
+		}
+	} else if (num_targets > old_num) {
+		set_rcvbuf();
+	}
+
+	return ping_fd;
+}
+
+/*
+ * Send one probe to every target not yet heard from this round, using as
+ * few system calls as the kernel allows.
+ */
+
+static void send_probes(void)
+{
+	const int BATCH = 64;
+	unsigned char packets[BATCH][PING_DATALEN];
+	struct mmsghdr msgs[BATCH];
+	struct iovec iov[BATCH];
+	int idx[BATCH];
+	int ii = 0;
+
+	while (ii < num_targets) {
+		int n = 0, sent = 0;
+
+		for (; ii < num_targets && n < BATCH; ii++) {
+			struct ping_target *pt = &targets[ii];
+			struct icmphdr *icp = (struct icmphdr *)packets[n];
+			struct ping_payload *pl = (struct ping_payload *)(packets[n] + sizeof(struct icmphdr));
+
+			if (pt->answered || pt->to.sin_family != AF_INET)
+				continue;
+
+			memset(packets[n], 0, PING_DATALEN);
+			icp->type = ICMP_ECHO;
+			icp->un.echo.id = htons(daemon_pid);
+			icp->un.echo.sequence = htons((round_num * pingcount + slot) & 0xffff);
+			pl->index = ii;
+			pl->round = round_num;
+			clock_gettime(CLOCK_MONOTONIC, &pl->sent);
+			icp->checksum = in_cksum((unsigned short *)icp, PING_DATALEN);
+
+			iov[n].iov_base = packets[n];
+			iov[n].iov_len = PING_DATALEN;
+			memset(&msgs[n], 0, sizeof(msgs[n]));
+			msgs[n].msg_hdr.msg_name = &pt->to;
+			msgs[n].msg_hdr.msg_namelen = sizeof(pt->to);
+			msgs[n].msg_hdr.msg_iov = &iov[n];
+			msgs[n].msg_hdr.msg_iovlen = 1;
+			idx[n] = ii;
+			n++;
+		}
+
+		while (sent < n) {
+			int rv = sendmmsg(ping_fd, msgs + sent, n - sent, 0);
+
+			if (rv < 0) {
+				/* Report the failing target and carry on with the others. */
+				int err = errno;
+				struct ping_target *pt = &targets[idx[sent]];
+
+				if (err == ENETUNREACH) {
+					log_message(LOG_ERR, "network is unreachable (target: %s)", pt->act->name);
+				} else {
+					log_message(LOG_ERR, "sendto gave error for target %s = %d = '%s'", pt->act->name, err, strerror(err));
+				}
+				rv = 1;
+			} else {
+				int jj;
+				for (jj = 0; jj < rv; jj++)
+					targets[idx[sent + jj]].sent++;
+			}
+			sent += rv;
+		}
+	}
+}
+
+static void update_rtt(struct ping_target *pt, long rtt)
+{
+	int bucket = 0;
+	long delta;
+
+	pt->received++;
+	pt->rtt_last = rtt;
+	if (pt->received == 1 || rtt < pt->rtt_min)
+		pt->rtt_min = rtt;
+	if (rtt > pt->rtt_max)
+		pt->rtt_max = rtt;
+
+	/* Jacobson/Karels smoothing, as used for the TCP retransmit timer. */
+	if (pt->received == 1) {
+		pt->srtt = rtt << 3;
+		pt->rttvar = rtt << 1;
+	} else {
+		delta = rtt - (pt->srtt >> 3);
+		pt->srtt += delta;
+		if (delta < 0)
+			delta = -delta;
+		pt->rttvar += delta - (pt->rttvar >> 2);
+	}
+
+	while (bucket < RTT_BUCKETS - 1 && rtt >= (1L << (RTT_MIN_SHIFT + bucket)))
+		bucket++;
+	pt->rtt_hist[bucket]++;
+}
+
+/*
+ * Called by the scheduler when the socket is readable: read every waiting
+ * reply and credit it to its target.
+ */
+
+void ping_input(int fd, void *unused)
+{
+	unsigned char packet[PING_RCVLEN];
+
+	while (1) {
+		struct sockaddr_in from;
+		socklen_t fromlen = sizeof(from);
+		struct timespec now;
+		struct icmphdr *icp;
+		struct ping_payload pl;
+		struct ping_target *pt;
+		int hlen;
+		ssize_t len = recvfrom(fd, packet, sizeof(packet), 0, (struct sockaddr *)&from, &fromlen);
+
+		if (len < 0) {
+			int err = errno;
+			if (err != EAGAIN && err != EWOULDBLOCK && err != EINTR) {
+				log_message(LOG_ERR, "recvfrom gave errno = %d = '%s'", err, strerror(err));
+			}
+			break;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		hlen = ((struct ip *)packet)->ip_hl << 2;
+		if (len < hlen + (ssize_t)(sizeof(struct icmphdr) + sizeof(pl)))
+			continue;
+
+		icp = (struct icmphdr *)(packet + hlen);
+		if (icp->type != ICMP_ECHOREPLY || ntohs(icp->un.echo.id) != (daemon_pid & 0xffff))
+			continue;
+
+		memcpy(&pl, packet + hlen + sizeof(struct icmphdr), sizeof(pl));
+		if (pl.index >= (uint32_t)num_targets || pl.round != round_num)
+			continue;
+
+		pt = &targets[pl.index];
+		if (pt->answered || from.sin_addr.s_addr != pt->to.sin_addr.s_addr)
+			continue;
+
+		pt->answered = TRUE;
+		timespecsub(&now, &pl.sent, &now);
+		update_rtt(pt, now.tv_sec * 1000000L + now.tv_nsec / 1000);
+
+		if (verbose && logtick && ticker == 1) {
+			log_message(LOG_DEBUG, "got answer on ping=%d from target %-15s time=%.3fms",
+				slot, pt->act->name, 1.0e-3 * pt->rtt_last);
+		}
+	}
+}
+
+/*
+ * Run one slot of the ping round, called every 'interval / ping-count'
+ * by the scheduler. Returns TRUE when a round has just finished, and then
+ * ping_result() gives the verdict for each target.
+ */
+
+int ping_slot(void)
+{
+	int done = FALSE;
+	int ii;
+
+	if (ping_fd == -1)
+		return FALSE;
+
+	if (slot >= pingcount) {
+		/* End of a round, any target not answered has failed. */
+		for (ii = 0; ii < num_targets; ii++) {
+			struct ping_target *pt = &targets[ii];
+
+			if (pt->answered) {
+				pt->result = ENOERR;
+			} else {
+				log_message(LOG_ERR, "no response from ping (target: %s)", pt->act->name);
+				pt->rounds_lost++;
+				pt->result = ENETUNREACH;
+			}
+		}
+
+		done = TRUE;
+		slot = 0;
+		round_num++;
+	}
+
+	if (slot == 0) {
+		for (ii = 0; ii < num_targets; ii++)
+			targets[ii].answered = FALSE;
+	}
+
+	send_probes();
+	slot++;
+
+	return done;
+}
+
+/*
+ * Verdict of the last completed round for one target.
+ */
+
+int ping_result(struct list *act)
+{
+	int idx = act->parameter.net.index;
+
+	if (idx < 0 || idx >= num_targets || targets[idx].act != act)
+		return (ENOERR);
+
+	return targets[idx].result;
+}
+
+/*
+ * Log the round-trip statistics of every target.
+ */
+
+void ping_log_stats(void)
+{
+	int ii;
+
+	for (ii = 0; ii < num_targets; ii++) {
+		struct ping_target *pt = &targets[ii];
+		char hist[RTT_BUCKETS * 12];
+		int jj, len = 0;
+
+		for (jj = 0; jj < RTT_BUCKETS; jj++)
+			len += snprintf(hist + len, sizeof(hist) - len, "%s%lu", jj ? "," : "", pt->rtt_hist[jj]);
+
+		log_message(LOG_INFO, "ping %s: sent %lu received %lu lost rounds %lu, "
+			"rtt min/avg/max/mdev = %.3f/%.3f/%.3f/%.3f ms, histogram [%s]",
+			pt->act->name, pt->sent, pt->received, pt->rounds_lost,
+			1.0e-3 * pt->rtt_min, 1.0e-3 * (pt->srtt >> 3), 1.0e-3 * pt->rtt_max,
+			1.0e-3 * (pt->rttvar >> 2), hist);
+	}
+}
+
+/*
+ * Close the socket and release the target state.
+ */
+
+int close_pinger(void)
+{
+	int err = ENOERR;
+
+	if (ping_fd != -1 && close(ping_fd) < 0) {
+		err = errno;
+		log_message(LOG_ERR, "error closing socket (err = %d = '%s')", err, strerror(err));
+	}
+	ping_fd = -1;
+
+	free(targets);
+	targets = NULL;
+	num_targets = 0;
+	slot = 0;
+
+	return err;
+}
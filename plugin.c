@@ -0,0 +1,565 @@
+/* > plugin.c
+ *
+ * Test plugins, the "V2" test/repair programs of "test-plugin" lines. A
+ * V0/V1 test binary is started afresh for every test and a V1 one again
+ * for every repair, so a script pays for starting its interpreter each
+ * time. A plugin is started once, with one end of a SOCK_SEQPACKET
+ * socketpair as fd 3 and "plugin" as its argument, and then kept running
+ * to answer requests over it.
+ *
+ * Every packet is one line of text. We send "<seq> test" when the check is
+ * due, or "<seq> repair <error>" to repair what a test found, and the plugin
+ * answers "<seq> <code>" with the code a V1 binary would have exited with.
+ * A test must be answered within "test-timeout" seconds and a repair within
+ * "repair-timeout", or the plugin is killed. One that has been killed or
+ * has exited is started again at its next check.
+ *
+ * Without the repair queue a repair is waited for, as a repair binary
+ * would be. With it (see repair.c) the answer comes through the scheduler
+ * like that of a test and is handed to repair_finished().
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <spawn.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/timerfd.h>
+#include <time.h>
+
+#include "extern.h"
+#include "watch_err.h"
+
+#define PLUGIN_FD	3	/* Where the plugin finds its end of the socketpair. */
+#define PLUGIN_MSG_MAX	128
+
+struct plugin {
+	char *name;
+	struct list *act;	/* Entry it answers for, passed to answer_func(). */
+	pid_t pid;		/* Zero when not running. */
+	int sock;		/* Our end of the socketpair, -1 when not running. */
+	int timer;		/* timerfd for the deadline of a test. */
+	unsigned int seq;	/* Of the last request sent. */
+	int busy;		/* Waiting for the answer to a test. */
+	int repairing;		/* Waiting for the answer to a repair from the queue. */
+	int result;		/* Answer not yet reported, EDONTKNOW if none. */
+	struct plugin *next;
+};
+
+static struct plugin *plugin_head = NULL;
+static void (*answer_func)(struct list *act) = NULL;
+
+/* ================================================================= */
+
+static struct plugin *find_plugin(const char *name)
+{
+	struct plugin *pg;
+
+	for (pg = plugin_head; pg != NULL; pg = pg->next) {
+		if (strcmp(pg->name, name) == 0)
+			return pg;
+	}
+
+	return NULL;
+}
+
+static void set_timer(struct plugin *pg, int timeout)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = timeout;
+	timerfd_settime(pg->timer, 0, &its, NULL);
+}
+
+/*
+ * Stop the plugin 'pg', if running. A killed one is reaped at once, one
+ * sent SIGTERM is left to exit as it sees fit.
+ */
+
+static void stop_plugin(struct plugin *pg, int sig)
+{
+	if (pg->pid == 0)
+		return;
+
+	sched_del_fd(pg->sock);
+	close(pg->sock);
+	pg->sock = -1;
+	set_timer(pg, 0);
+
+	if (sig == SIGKILL) {
+		kill_process_tree(pg->pid, SIGKILL);
+		waitpid(pg->pid, NULL, 0);
+	} else {
+		kill(pg->pid, sig);
+	}
+
+	/* All it has used while it ran, as that has been one run. */
+	cgroup_collect(pg->name);
+
+	pg->pid = 0;
+	pg->busy = FALSE;
+	pg->repairing = FALSE;
+}
+
+/*
+ * The test or repair in progress has ended with 'code' without an answer,
+ * tell the watchdog so it need not wait for the next check to act on it.
+ */
+
+static void request_failed(struct plugin *pg, int code)
+{
+	int busy = pg->busy;
+	int repairing = pg->repairing;
+
+	stop_plugin(pg, SIGKILL);
+
+	if (repairing && pg->act != NULL)
+		repair_finished(pg->act, code);
+
+	if (busy) {
+		pg->result = code;
+		if (answer_func != NULL && pg->act != NULL)
+			answer_func(pg->act);
+	}
+}
+
+/*
+ * Read one answer. Gives EAGAIN if there is none yet, EPIPE if the plugin
+ * has closed its end and EPROTO if the packet makes no sense.
+ */
+
+static int read_answer(struct plugin *pg, unsigned int *seq, int *code)
+{
+	char buf[PLUGIN_MSG_MAX + 1];
+	ssize_t len;
+
+	len = recv(pg->sock, buf, PLUGIN_MSG_MAX, MSG_DONTWAIT);
+	if (len < 0)
+		return errno;
+	if (len == 0)
+		return EPIPE;
+
+	buf[len] = '\0';
+	if (sscanf(buf, "%u %d", seq, code) != 2) {
+		log_message(LOG_ERR, "test plugin %s sent a bad answer '%.*s'", pg->name, (int)strcspn(buf, "\n"), buf);
+		return EPROTO;
+	}
+
+	return ENOERR;
+}
+
+/*
+ * Called by the scheduler when the plugin 'ptr' has something for us.
+ */
+
+static void plugin_input(int fd, void *ptr)
+{
+	struct plugin *pg = (struct plugin *)ptr;
+	unsigned int seq;
+	int code, err;
+
+	while ((err = read_answer(pg, &seq, &code)) != EAGAIN) {
+		if (err == EPROTO)
+			continue;
+
+		if (err != ENOERR) {
+			log_message(LOG_ERR, "test plugin %s has gone", pg->name);
+			request_failed(pg, ECHKILL);
+			return;
+		}
+
+		if (pg->repairing && seq == pg->seq) {
+			if (code != 0)
+				log_message(LOG_ERR, "test plugin %s repair returned %d = '%s'", pg->name, code, wd_strerror(code));
+			set_timer(pg, 0);
+			pg->repairing = FALSE;
+			if (pg->act != NULL)
+				repair_finished(pg->act, code);
+			continue;
+		}
+
+		/* Answers to requests given up on are of no interest. */
+		if (!pg->busy || seq != pg->seq)
+			continue;
+
+		if (code || verbose)
+			log_message(LOG_DEBUG, "test plugin %s returned %d = '%s'", pg->name, code, wd_strerror(code));
+
+		set_timer(pg, 0);
+		pg->busy = FALSE;
+		pg->result = code;
+		if (answer_func != NULL && pg->act != NULL)
+			answer_func(pg->act);
+	}
+}
+
+/*
+ * Called by the scheduler when a test or repair has not been answered in time.
+ */
+
+static void plugin_timeout(int fd, void *ptr)
+{
+	struct plugin *pg = (struct plugin *)ptr;
+	uint64_t expired;
+
+	if (read(fd, &expired, sizeof(expired)) < 0)
+		return;
+
+	if (pg->repairing) {
+		log_message(LOG_ERR, "test plugin %s exceeded repair time limit %d", pg->name, repair_timeout);
+		request_failed(pg, ETOOLONG);
+	} else if (pg->busy) {
+		log_message(LOG_ERR, "test plugin %s exceeded time limit %d", pg->name, test_timeout);
+		request_failed(pg, ETOOLONG);
+	}
+}
+
+static struct plugin *new_plugin(struct list *act)
+{
+	struct plugin *pg = (struct plugin *)xcalloc(1, sizeof(struct plugin));
+
+	pg->timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (pg->timer < 0 || sched_add_fd(pg->timer, plugin_timeout, pg) != ENOERR) {
+		int err = errno;
+		log_message(LOG_ERR, "cannot create timer for test plugin %s (errno = %d = '%s')", act->name, err, strerror(err));
+		if (pg->timer >= 0)
+			close(pg->timer);
+		free(pg);
+		return NULL;
+	}
+
+	pg->name = xstrdup(act->name);
+	pg->sock = -1;
+	pg->result = EDONTKNOW;
+	pg->next = plugin_head;
+	plugin_head = pg;
+
+	return pg;
+}
+
+static void free_plugin(struct plugin *pg)
+{
+	struct plugin **pp;
+
+	for (pp = &plugin_head; *pp != NULL; pp = &(*pp)->next) {
+		if (*pp == pg) {
+			*pp = pg->next;
+			break;
+		}
+	}
+
+	sched_del_fd(pg->timer);
+	close(pg->timer);
+	free(pg->name);
+	free(pg);
+}
+
+/*
+ * Start the plugin, its output going to the log files like that of a test
+ * binary.
+ */
+
+static int start_plugin(struct plugin *pg)
+{
+	posix_spawn_file_actions_t fa;
+	char *argv[3];
+	int sv[2];
+	int err;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+		err = errno;
+		log_message(LOG_ERR, "cannot create socket for test plugin %s (errno = %d = '%s')", pg->name, err, strerror(err));
+		return err;
+	}
+
+	/* A dup2() onto itself would leave it close-on-exec. */
+	if (sv[1] == PLUGIN_FD) {
+		int fd = fcntl(sv[1], F_DUPFD_CLOEXEC, PLUGIN_FD + 1);
+
+		close(sv[1]);
+		sv[1] = fd;
+	}
+
+	argv[0] = pg->name;
+	argv[1] = "plugin";
+	argv[2] = NULL;
+
+	posix_spawn_file_actions_init(&fa);
+
+	err = reopen_std_actions(&fa, FLAG_REOPEN_STD_TEST);
+	if (err == 0)
+		err = posix_spawn_file_actions_adddup2(&fa, sv[1], PLUGIN_FD);
+	if (err == 0)
+		err = cgroup_spawn(&pg->pid, pg->name, &fa, argv);
+
+	posix_spawn_file_actions_destroy(&fa);
+	close(sv[1]);
+
+	if (err != 0) {
+		log_message(LOG_ERR, "cannot run test plugin %s (errno = %d = '%s')", pg->name, err, strerror(err));
+		close(sv[0]);
+		pg->pid = 0;
+		return err;
+	}
+
+	pg->sock = sv[0];
+	err = sched_add_fd(pg->sock, plugin_input, pg);
+	if (err != ENOERR) {
+		stop_plugin(pg, SIGKILL);
+		return err;
+	}
+
+	if (verbose)
+		log_message(LOG_DEBUG, "started test plugin %s, pid %d", pg->name, (int)pg->pid);
+
+	return ENOERR;
+}
+
+/*
+ * The plugin for 'act', started if need be.
+ */
+
+static int get_plugin(struct list *act, struct plugin **ppg)
+{
+	struct plugin *pg = find_plugin(act->name);
+	int err;
+
+	if (pg == NULL)
+		pg = new_plugin(act);
+	if (pg == NULL)
+		return ENOMEM;
+
+	pg->act = act;
+
+	if (pg->pid == 0) {
+		err = start_plugin(pg);
+		if (err == EAGAIN || err == ENOMEM)
+			return EREBOOT;	/* As for a failed fork(), things are bad. */
+		if (err != ENOERR)
+			return err;
+	}
+
+	*ppg = pg;
+	return ENOERR;
+}
+
+static int send_request(struct plugin *pg, const char *request)
+{
+	char buf[PLUGIN_MSG_MAX];
+	int len;
+
+	len = snprintf(buf, sizeof(buf), "%u %s\n", ++pg->seq, request);
+	if (send(pg->sock, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+		int err = errno;
+		log_message(LOG_ERR, "cannot send to test plugin %s (errno = %d = '%s')", pg->name, err, strerror(err));
+		stop_plugin(pg, SIGKILL);
+		return err;
+	}
+
+	return ENOERR;
+}
+
+/* ================================================================= */
+
+/*
+ * The check of a test plugin: report the answer to the last test, if it
+ * has come since we last looked, or else ask for another. The answer comes
+ * through the scheduler, so until then this gives EDONTKNOW.
+ */
+
+int check_plugin(struct list *act)
+{
+	struct plugin *pg;
+	int err;
+
+	pg = find_plugin(act->name);
+	if (pg != NULL && pg->result != EDONTKNOW) {
+		int result = pg->result;
+
+		pg->result = EDONTKNOW;
+		return result;
+	}
+
+	if (pg != NULL && (pg->busy || pg->repairing))
+		return EDONTKNOW;
+
+	err = get_plugin(act, &pg);
+	if (err != ENOERR)
+		return err;
+
+	err = send_request(pg, "test");
+	if (err != ENOERR)
+		return err;
+
+	pg->busy = TRUE;
+	if (test_timeout > 0)
+		set_timer(pg, test_timeout);
+
+	return EDONTKNOW;
+}
+
+/*
+ * Send the plugin of 'act' a request to repair the error 'result'.
+ */
+
+static int ask_repair(struct list *act, int result, struct plugin **ppg)
+{
+	struct plugin *pg;
+	char request[32];
+	int err;
+
+	err = get_plugin(act, &pg);
+	if (err != ENOERR)
+		return err;
+
+	/* A test still running is given up on, the next check asks again. */
+	pg->busy = FALSE;
+	set_timer(pg, 0);
+
+	snprintf(request, sizeof(request), "repair %d", result);
+	err = send_request(pg, request);
+	if (err != ENOERR)
+		return err;
+
+	*ppg = pg;
+	return ENOERR;
+}
+
+/*
+ * Ask the plugin of 'act' to repair the error 'result' and wait for it to
+ * answer, as we wait for a repair binary.
+ */
+
+int repair_plugin(struct list *act, int result)
+{
+	struct plugin *pg;
+	struct timespec deadline, now;
+	unsigned int seq;
+	int code, err;
+
+	err = ask_repair(act, result, &pg);
+	if (err != ENOERR)
+		return err;
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += repair_timeout;
+
+	while (1) {
+		struct pollfd pfd;
+		int msec = -1;
+
+		if (repair_timeout > 0) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			msec = (deadline.tv_sec - now.tv_sec) * 1000 + (deadline.tv_nsec - now.tv_nsec) / 1000000;
+			if (msec <= 0) {
+				log_message(LOG_ERR, "test plugin %s exceeded repair time limit %d", pg->name, repair_timeout);
+				stop_plugin(pg, SIGKILL);
+				return ETOOLONG;
+			}
+		}
+
+		pfd.fd = pg->sock;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, msec) < 0 && errno != EINTR) {
+			err = errno;
+			log_message(LOG_ERR, "poll of test plugin %s gave errno = %d = '%s'", pg->name, err, strerror(err));
+			return err;
+		}
+
+		err = read_answer(pg, &seq, &code);
+		if (err == EAGAIN || err == EPROTO)
+			continue;
+		if (err != ENOERR) {
+			log_message(LOG_ERR, "test plugin %s has gone", pg->name);
+			stop_plugin(pg, SIGKILL);
+			return ECHKILL;
+		}
+		if (seq == pg->seq)
+			break;
+	}
+
+	if (code != 0)
+		log_message(LOG_ERR, "test plugin %s repair returned %d = '%s'", pg->name, code, wd_strerror(code));
+
+	return code;
+}
+
+/*
+ * For the repair queue: ask the plugin of 'act' to repair the error
+ * 'result' without waiting. Its answer, or failure to give one in time, is
+ * passed to repair_finished(). Gives an error if it could not be asked.
+ */
+
+int start_repair_plugin(struct list *act, int result)
+{
+	struct plugin *pg;
+	int err;
+
+	err = ask_repair(act, result, &pg);
+	if (err != ENOERR)
+		return err;
+
+	pg->repairing = TRUE;
+	if (repair_timeout > 0)
+		set_timer(pg, repair_timeout);
+
+	return ENOERR;
+}
+
+/*
+ * Say what to call when a plugin has answered a test, or failed to, so its
+ * check can be run again to report it. Plugins are started by their first
+ * check. Call after open_sched().
+ */
+
+void open_plugins(void (*answered)(struct list *act))
+{
+	answer_func = answered;
+}
+
+/*
+ * After a reload, move the plugins over to their new entries and stop
+ * those no longer configured. Call before reload_end().
+ */
+
+void reload_plugins(void)
+{
+	struct plugin *pg, *next;
+
+	for (pg = plugin_head; pg != NULL; pg = next) {
+		struct list *act = reload_entry(&tr_bin_list, pg->act);
+
+		next = pg->next;
+		if (act != NULL && act->version == 2) {
+			pg->act = act;
+			continue;
+		}
+
+		if (verbose)
+			log_message(LOG_DEBUG, "stopping test plugin %s", pg->name);
+		stop_plugin(pg, SIGKILL);
+		free_plugin(pg);
+	}
+}
+
+/*
+ * Ask every plugin to end, we do not wait for them.
+ */
+
+void close_plugins(void)
+{
+	while (plugin_head != NULL) {
+		stop_plugin(plugin_head, SIGTERM);
+		free_plugin(plugin_head);
+	}
+}
@@ -0,0 +1,275 @@
+/* > pool.c
+ *
+ * A small, fixed-size pool of worker threads to run independent checks of
+ * one scheduler batch at the same time. The results are collected in an
+ * array indexed like the batch, so the caller can still act on them one at
+ * a time in the usual order.
+ *
+ * Only checks marked as 'parallel' go to the workers, anything that forks
+ * or shares state between entries (test binaries, stat() as a child, the
+ * keep-alive tick) is run in the calling thread as before.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "extern.h"
+#include "watch_err.h"
+#include "gettime.h"
+
+#define MAX_WORKERS	64
+
+static pthread_t workers[MAX_WORKERS];
+static int num_workers = 0;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cv = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done_cv = PTHREAD_COND_INITIALIZER;
+static int pool_stop = FALSE;
+
+/* Current batch, all protected by 'pool_lock'. */
+static struct sched_item **batch = NULL;
+static int *batch_res = NULL;
+static int *todo = NULL;		/* Indices in to 'batch' for the workers. */
+static int todo_size = 0;
+static int todo_len = 0;
+static int todo_next = 0;
+static int todo_left = 0;
+static long long batch_busy = 0;	/* Sum of check run times (ns) in this batch. */
+
+/* Per-cycle wall time statistics. */
+static unsigned long num_cycles = 0;
+static long long wall_sum = 0;
+static long long wall_max = 0;
+static long long busy_sum = 0;
+
+/* ================================================================= */
+
+static long long ts_nsec(const struct timespec *ts)
+{
+	return (long long)ts->tv_sec * NSEC + ts->tv_nsec;
+}
+
+/*
+ * Run one check, returning how long it took in nanoseconds. An item is
+ * only ever run by one thread at a time, so its own histogram needs no
+ * lock, the per-type one is updated by the caller under 'pool_lock'.
+ */
+
+static long long run_item(struct sched_item *item, int *result)
+{
+	struct timespec t0, t1;
+	long long dt;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	*result = item->func(item->act);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	dt = ts_nsec(&t1) - ts_nsec(&t0);
+	hist_add(&item->hist, dt);
+	item->last_result = *result;
+	item->last_run = time(NULL);
+
+	return dt;
+}
+
+static void *worker_main(void *unused)
+{
+	pthread_mutex_lock(&pool_lock);
+
+	while (1) {
+		int idx;
+		long long dt;
+
+		while (!pool_stop && todo_next >= todo_len)
+			pthread_cond_wait(&work_cv, &pool_lock);
+
+		if (pool_stop)
+			break;
+
+		idx = todo[todo_next++];
+		pthread_mutex_unlock(&pool_lock);
+
+		dt = run_item(batch[idx], &batch_res[idx]);
+
+		pthread_mutex_lock(&pool_lock);
+		batch_busy += dt;
+		hist_add(batch[idx]->type_hist, dt);
+		if (--todo_left == 0)
+			pthread_cond_signal(&done_cv);
+	}
+
+	pthread_mutex_unlock(&pool_lock);
+	return NULL;
+}
+
+/* ================================================================= */
+
+/*
+ * Start 'nthreads' workers, zero (or one) means run everything serially.
+ */
+
+int open_pool(int nthreads)
+{
+	int ii;
+
+	close_pool();
+
+	if (nthreads > MAX_WORKERS) {
+		log_message(LOG_WARNING, "limiting check threads to %d (not %d)", MAX_WORKERS, nthreads);
+		nthreads = MAX_WORKERS;
+	}
+
+	if (nthreads < 2)
+		return 0;
+
+	pool_stop = FALSE;
+
+	for (ii = 0; ii < nthreads; ii++) {
+		int err = pthread_create(&workers[ii], NULL, worker_main, NULL);
+
+		if (err) {
+			log_message(LOG_ERR, "cannot start check thread (errno = %d = '%s')", err, strerror(err));
+			break;
+		}
+		num_workers++;
+	}
+
+	if (verbose)
+		log_message(LOG_DEBUG, "started %d check threads", num_workers);
+
+	return (num_workers == nthreads) ? 0 : -1;
+}
+
+/*
+ * Run all of the checks in 'items', putting each result in the same index
+ * of 'results'. Returns when every check of the batch has finished.
+ */
+
+void pool_run(struct sched_item **items, int *results, int n)
+{
+	struct timespec t0, t1;
+	long long wall;
+	int ii, npar = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	pthread_mutex_lock(&pool_lock);
+
+	if (todo_size < n) {
+		int *tmp = realloc(todo, n * sizeof(*todo));
+
+		if (tmp == NULL) {
+			fatal_error(EX_SYSERR, "out of memory for %d checks", n);
+		}
+		todo = tmp;
+		todo_size = n;
+	}
+
+	batch = items;
+	batch_res = results;
+	batch_busy = 0;
+	todo_len = 0;
+	todo_next = 0;
+	todo_left = 0;
+
+	if (num_workers > 0) {
+		for (ii = 0; ii < n; ii++) {
+			if (items[ii]->parallel)
+				todo[npar++] = ii;
+		}
+	}
+
+	pthread_mutex_unlock(&pool_lock);
+
+	/*
+	 * Everything the workers are not doing, in order. This is done before the
+	 * workers start so any fork() here happens with no other thread busy.
+	 */
+	for (ii = 0; ii < n; ii++) {
+		if (num_workers == 0 || !items[ii]->parallel) {
+			long long dt = run_item(items[ii], &results[ii]);
+
+			pthread_mutex_lock(&pool_lock);
+			batch_busy += dt;
+			hist_add(items[ii]->type_hist, dt);
+			pthread_mutex_unlock(&pool_lock);
+		}
+	}
+
+	pthread_mutex_lock(&pool_lock);
+	todo_len = todo_left = npar;
+	if (npar > 0)
+		pthread_cond_broadcast(&work_cv);
+
+	while (todo_left > 0)
+		pthread_cond_wait(&done_cv, &pool_lock);
+
+	batch = NULL;
+	batch_res = NULL;
+	todo_len = todo_next = 0;
+	busy_sum += batch_busy;
+	pthread_mutex_unlock(&pool_lock);
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	wall = ts_nsec(&t1) - ts_nsec(&t0);
+
+	num_cycles++;
+	timing_cycle(wall);
+	wall_sum += wall;
+	if (wall > wall_max)
+		wall_max = wall;
+
+	if (verbose > 1) {
+		log_message(LOG_DEBUG, "ran %d checks in %.3f ms (%.3f ms of checking)",
+			n, 1.0e-6 * wall, 1.0e-6 * batch_busy);
+	}
+}
+
+/*
+ * Report the accumulated cycle wall times, and the speed-up over running
+ * the same checks one after another.
+ */
+
+void pool_log_stats(void)
+{
+	if (num_cycles == 0)
+		return;
+
+	log_message(LOG_INFO, "check cycles: %lu, wall time avg %.3f ms max %.3f ms, check time avg %.3f ms, "
+		"speed-up %.2f with %d threads",
+		num_cycles,
+		1.0e-6 * wall_sum / num_cycles,
+		1.0e-6 * wall_max,
+		1.0e-6 * busy_sum / num_cycles,
+		(wall_sum > 0) ? (double)busy_sum / wall_sum : 1.0,
+		num_workers);
+}
+
+/*
+ * Stop and join all the workers.
+ */
+
+int close_pool(void)
+{
+	int ii;
+
+	pthread_mutex_lock(&pool_lock);
+	pool_stop = TRUE;
+	pthread_cond_broadcast(&work_cv);
+	pthread_mutex_unlock(&pool_lock);
+
+	for (ii = 0; ii < num_workers; ii++) {
+		pthread_join(workers[ii], NULL);
+	}
+
+	num_workers = 0;
+	return 0;
+}
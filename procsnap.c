@@ -0,0 +1,209 @@
+/* > procsnap.c
+ *
+ * Snapshots of small procfs and sysfs files for the checks that read them.
+ * Each file is opened once and read with pread() into a buffer that is
+ * kept, and grown if the file does not fit. A file is read at most once
+ * per batch of checks (see snap_next_cycle()), so checks that share it
+ * share the read, and snap_scan() picks the "Key: value" fields the caller
+ * wants out of it in one pass, without copying.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "extern.h"
+#include "watch_err.h"
+
+#define SNAP_BUFSIZE	1024
+
+struct snap_file {
+	char *name;
+	int fd;
+	char *buf;
+	size_t size;		/* Allocated, the file may be up to one less. */
+	size_t len;		/* Of the last read, the text is nul-terminated. */
+	unsigned int cycle;	/* Batch of the last read. */
+	int users;
+	pthread_mutex_t lock;
+	struct snap_file *next;
+};
+
+static struct snap_file *snap_head = NULL;
+static unsigned int snap_cycle = 1;
+
+/* ================================================================= */
+
+/*
+ * Start a new batch of checks, so the next snap_read() of each file reads
+ * it again. Called by the main loop only, between batches.
+ */
+
+void snap_next_cycle(void)
+{
+	if (++snap_cycle == 0)
+		snap_cycle = 1;
+}
+
+/*
+ * Open the file 'name' for snapshots, or take another reference to it if
+ * already open. Returns NULL, with the error logged, if it cannot be.
+ */
+
+struct snap_file *snap_open(const char *name)
+{
+	struct snap_file *sf;
+	int fd;
+
+	for (sf = snap_head; sf != NULL; sf = sf->next) {
+		if (strcmp(sf->name, name) == 0) {
+			sf->users++;
+			return sf;
+		}
+	}
+
+	fd = open(name, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		int err = errno;
+		log_message(LOG_ERR, "cannot open %s (errno = %d = '%s')", name, err, strerror(err));
+		return NULL;
+	}
+
+	sf = (struct snap_file *)xcalloc(1, sizeof(struct snap_file));
+	sf->name = xstrdup(name);
+	sf->fd = fd;
+	sf->size = SNAP_BUFSIZE;
+	sf->buf = (char *)xcalloc(1, sf->size);
+	sf->users = 1;
+	pthread_mutex_init(&sf->lock, NULL);
+
+	sf->next = snap_head;
+	snap_head = sf;
+
+	return sf;
+}
+
+void snap_close(struct snap_file *sf)
+{
+	struct snap_file **last;
+
+	if (sf == NULL || --sf->users > 0)
+		return;
+
+	for (last = &snap_head; *last != NULL; last = &(*last)->next) {
+		if (*last == sf) {
+			*last = sf->next;
+			break;
+		}
+	}
+
+	if (close(sf->fd) == -1) {
+		log_message(LOG_ALERT, "cannot close %s (errno = %d)", sf->name, errno);
+	}
+
+	pthread_mutex_destroy(&sf->lock);
+	free(sf->buf);
+	free(sf->name);
+	free(sf);
+}
+
+/*
+ * Make sure the buffer holds the file as of this batch, reading it if not.
+ * On success '*text' is set to the nul-terminated text, which is good until
+ * the next batch.
+ */
+
+int snap_read(struct snap_file *sf, const char **text)
+{
+	int err = ENOERR;
+
+	pthread_mutex_lock(&sf->lock);
+
+	while (sf->cycle != snap_cycle) {
+		ssize_t n = pread(sf->fd, sf->buf, sf->size - 1, 0);
+
+		if (n < 0) {
+			err = errno;
+			log_message(LOG_ERR, "read %s gave errno = %d = '%s'", sf->name, err, strerror(err));
+			break;
+		}
+
+		if ((size_t)n == sf->size - 1) {
+			/* May not be all of it, try again with more room. */
+			char *tmp = realloc(sf->buf, 2 * sf->size);
+
+			if (tmp == NULL) {
+				fatal_error(EX_SYSERR, "out of memory reading %s", sf->name);
+			}
+			sf->buf = tmp;
+			sf->size *= 2;
+			continue;
+		}
+
+		sf->buf[n] = 0;
+		sf->len = n;
+		sf->cycle = snap_cycle;
+	}
+
+	pthread_mutex_unlock(&sf->lock);
+
+	if (text != NULL)
+		*text = sf->buf;
+
+	return err;
+}
+
+/*
+ * Read the integer values of "Key: value" lines for the keys in 'keys', which
+ * must be sorted by strcmp(), into 'vals' of the same order. Keys not found
+ * are left alone. Returns the number of keys found.
+ */
+
+int snap_scan(const struct snap_file *sf, const char *const *keys, int nkeys, long *vals)
+{
+	const char *ptr = sf->buf, *end = sf->buf + sf->len;
+	int found = 0;
+
+	while (ptr < end && found < nkeys) {
+		const char *colon = memchr(ptr, ':', end - ptr);
+		const char *eol = memchr(ptr, '\n', end - ptr);
+		int lo = 0, hi = nkeys - 1;
+
+		if (eol == NULL)
+			eol = end;
+
+		if (colon != NULL && colon < eol) {
+			size_t klen = colon - ptr;
+
+			while (lo <= hi) {
+				int mid = (lo + hi) / 2;
+				int cmp = strncmp(ptr, keys[mid], klen);
+
+				if (cmp == 0 && keys[mid][klen] != '\0')
+					cmp = -1;
+
+				if (cmp == 0) {
+					vals[mid] = strtol(colon + 1, NULL, 10);
+					found++;
+					break;
+				} else if (cmp < 0) {
+					hi = mid - 1;
+				} else {
+					lo = mid + 1;
+				}
+			}
+		}
+
+		ptr = eol + 1;
+	}
+
+	return found;
+}
@@ -0,0 +1,350 @@
+/* > reload.c
+ *
+ * Reload of the configuration file on SIGHUP, without a restart. Everything
+ * already open, the watchdog device above all, stays open: the running lists
+ * of checks are moved aside, the file is read again into new lists, and each
+ * new entry is paired by list and name with a running one. The pair carries
+ * over the retry timer, the repair count and the check's own state, so an
+ * unchanged check goes on as if nothing happened and only the entries added
+ * or removed start or stop anything. The main loop then moves its scheduled
+ * checks over to the new entries (see reload_entry() and reload_is_new())
+ * before the old lists are freed.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+
+#include "extern.h"
+#include "watch_err.h"
+#include "read-conf.h"
+
+/* The lists read from the file, and where the running ones are kept meanwhile. */
+static struct list **const heads[] = {
+	&tr_bin_list,
+	&file_list,
+	&target_list,
+	&pidfile_list,
+	&iface_list,
+	&temp_list,
+};
+
+#define NUM_LISTS	ARRAY_SIZE(heads)
+
+static struct list *old_heads[NUM_LISTS];
+
+/* Hash table of the new entries by name, open addressing with linear probing. */
+struct pair {
+	struct list *act;	/* Entry of the new configuration, NULL for an empty slot. */
+	struct list *old;	/* Running entry it takes over from, NULL if none. */
+	int kind;		/* Index in heads[] of its list. */
+};
+
+static struct pair *pairs = NULL;
+static size_t num_slots = 0;
+
+static int num_kept = 0;
+static int num_added = 0;
+static int num_removed = 0;
+static unsigned char list_changed[NUM_LISTS];
+
+static volatile sig_atomic_t reload_wanted = FALSE;
+
+/* ================================================================= */
+
+static int list_kind(struct list **head)
+{
+	int ii;
+
+	for (ii = 0; ii < (int)NUM_LISTS; ii++) {
+		if (heads[ii] == head)
+			return ii;
+	}
+
+	return -1;
+}
+
+/* FNV-1a of the name, with the list mixed in. */
+static size_t hash_name(const char *name, int kind)
+{
+	size_t h = 2166136261u ^ (size_t)kind;
+
+	while (*name) {
+		h ^= (unsigned char)*name++;
+		h *= 16777619u;
+	}
+
+	return h & (num_slots - 1);
+}
+
+/*
+ * Hand over what a check has learnt so far from the running entry 'old' to
+ * its replacement 'act'. Settings such as the file 'change' time come from
+ * the file just read.
+ */
+
+static void carry_state(struct list *old, struct list *act, int kind)
+{
+	*act->state = *old->state;
+
+	if (heads[kind] == &file_list) {
+		/* The watch is moved over, see reload_filewatch(). */
+		int mtime = act->parameter.file.mtime;
+
+		act->parameter.file = old->parameter.file;
+		act->parameter.file.mtime = mtime;
+	} else if (heads[kind] == &pidfile_list) {
+		/* The pidfd stays open, see reload_pidwatch(). */
+		act->parameter.pid = old->parameter.pid;
+	} else if (heads[kind] == &iface_list) {
+		act->parameter.iface = old->parameter.iface;
+	} else if (heads[kind] == &temp_list) {
+		int max = act->parameter.temp.max;
+
+		act->parameter.temp = old->parameter.temp;
+		act->parameter.temp.max = max;
+	} else if (heads[kind] == &target_list) {
+		/* The pinger.c target, see reload_pinger(). */
+		act->parameter.net.index = old->parameter.net.index;
+	}
+}
+
+/* ================================================================= */
+
+static void sighup_handler(int arg)
+{
+	reload_wanted = TRUE;
+}
+
+void reload_init(void)
+{
+	struct sigaction sa;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sighup_handler;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGHUP, &sa, NULL);
+}
+
+/*
+ * Has SIGHUP asked for a reload since last time? The main loop looks
+ * between batches, when no check is using the lists.
+ */
+
+int reload_pending(void)
+{
+	if (!reload_wanted)
+		return FALSE;
+
+	reload_wanted = FALSE;
+	return TRUE;
+}
+
+/*
+ * Start a reload: make sure the file can be read and move the running lists
+ * aside so read_config() builds new ones.
+ */
+
+int reload_begin(const char *configfile)
+{
+	int ii;
+
+	if (access(configfile, R_OK) < 0) {
+		int err = errno;
+		log_message(LOG_ERR, "cannot reload %s (errno = %d = '%s'), keeping the running configuration",
+			configfile, err, strerror(err));
+		return err;
+	}
+
+	for (ii = 0; ii < (int)NUM_LISTS; ii++) {
+		move_list(heads[ii], &old_heads[ii]);
+	}
+
+	return ENOERR;
+}
+
+/*
+ * Give up a reload that read_config() refused, before reload_match(): drop
+ * the lists it built and put the running ones back, state and all.
+ */
+
+void reload_abort(void)
+{
+	int ii;
+
+	for (ii = 0; ii < (int)NUM_LISTS; ii++) {
+		move_list(&old_heads[ii], heads[ii]);
+	}
+}
+
+/*
+ * With the new lists read, pair every running entry with a new one of the
+ * same list and name (duplicates are paired in list order) and carry its
+ * state over. Costs one hash insert and one look-up per entry.
+ */
+
+void reload_match(void)
+{
+	struct list *act;
+	size_t total = 0;
+	int kind;
+
+	num_kept = num_added = num_removed = 0;
+	memset(list_changed, 0, sizeof(list_changed));
+
+	for (kind = 0; kind < (int)NUM_LISTS; kind++) {
+		for (act = *heads[kind]; act != NULL; act = act->next)
+			total++;
+	}
+
+	for (num_slots = 16; num_slots < 2 * total; num_slots *= 2)
+		;
+	pairs = (struct pair *)xcalloc(num_slots, sizeof(struct pair));
+
+	for (kind = 0; kind < (int)NUM_LISTS; kind++) {
+		for (act = *heads[kind]; act != NULL; act = act->next) {
+			size_t ii = hash_name(act->name, kind);
+
+			while (pairs[ii].act != NULL)
+				ii = (ii + 1) & (num_slots - 1);
+
+			pairs[ii].act = act;
+			pairs[ii].kind = kind;
+
+			/* Not a target of the pinger until shown otherwise. */
+			if (heads[kind] == &target_list)
+				act->parameter.net.index = -1;
+		}
+	}
+
+	for (kind = 0; kind < (int)NUM_LISTS; kind++) {
+		struct list *old;
+		int kept = 0, removed = 0, count = 0;
+
+		for (old = old_heads[kind]; old != NULL; old = old->next) {
+			size_t ii = hash_name(old->name, kind);
+
+			for (; pairs[ii].act != NULL; ii = (ii + 1) & (num_slots - 1)) {
+				struct pair *pp = &pairs[ii];
+
+				if (pp->old == NULL && pp->kind == kind && strcmp(pp->act->name, old->name) == 0) {
+					pp->old = old;
+					carry_state(old, pp->act, kind);
+					break;
+				}
+			}
+
+			if (pairs[ii].act != NULL)
+				kept++;
+			else
+				removed++;
+		}
+
+		for (act = *heads[kind]; act != NULL; act = act->next)
+			count++;
+
+		num_kept += kept;
+		num_added += count - kept;
+		num_removed += removed;
+		list_changed[kind] = (count != kept || removed != 0);
+	}
+}
+
+/*
+ * The new entry that has taken over from the running entry 'old' of the
+ * list '*head', or NULL if it has been removed.
+ */
+
+struct list *reload_entry(struct list **head, struct list *old)
+{
+	int kind = list_kind(head);
+	size_t ii;
+
+	if (kind < 0 || old == NULL || pairs == NULL)
+		return NULL;
+
+	for (ii = hash_name(old->name, kind); pairs[ii].act != NULL; ii = (ii + 1) & (num_slots - 1)) {
+		if (pairs[ii].old == old)
+			return pairs[ii].act;
+	}
+
+	return NULL;
+}
+
+/*
+ * The same for an entry of any list. One of no list read from the file,
+ * such as the load average timer, is kept by a reload and so returned.
+ */
+
+struct list *reload_any_entry(struct list *old)
+{
+	struct list *act;
+	int kind;
+
+	for (kind = 0; kind < (int)NUM_LISTS; kind++) {
+		for (act = old_heads[kind]; act != NULL; act = act->next) {
+			if (act == old)
+				return reload_entry(heads[kind], old);
+		}
+	}
+
+	return old;
+}
+
+/*
+ * Is 'act' of the list '*head' new with this reload, so not yet scheduled?
+ */
+
+int reload_is_new(struct list **head, struct list *act)
+{
+	int kind = list_kind(head);
+	size_t ii;
+
+	if (kind < 0 || pairs == NULL)
+		return FALSE;
+
+	for (ii = hash_name(act->name, kind); pairs[ii].act != NULL; ii = (ii + 1) & (num_slots - 1)) {
+		if (pairs[ii].act == act)
+			return (pairs[ii].old == NULL);
+	}
+
+	return FALSE;
+}
+
+/*
+ * Has anything been added to or removed from the list '*head'?
+ */
+
+int reload_changed(struct list **head)
+{
+	int kind = list_kind(head);
+
+	return (kind >= 0) ? list_changed[kind] : FALSE;
+}
+
+/*
+ * Finish a reload by freeing the old lists, nothing may point to them now.
+ */
+
+void reload_end(void)
+{
+	int ii;
+
+	for (ii = 0; ii < (int)NUM_LISTS; ii++) {
+		free_list(&old_heads[ii]);
+	}
+
+	free(pairs);
+	pairs = NULL;
+	num_slots = 0;
+
+	log_message(LOG_INFO, "reloaded configuration: %d lines read in %.3f ms (%d of %d files unchanged), %d checks kept, %d added, %d removed",
+		config_lines, config_msec, config_cached, config_files, num_kept, num_added, num_removed);
+}
@@ -0,0 +1,697 @@
+/* > repair.c
+ *
+ * The queue of repairs run alongside the checks, used when
+ * "repair-concurrency" is set. Without it a repair binary is run by
+ * attempt_repair() and the main loop waits for it, for up to
+ * "repair-timeout" seconds, with every other check and the refresh of the
+ * watchdog device held up meanwhile.
+ *
+ * Here a repair is put in a queue and at most "repair-concurrency" of them
+ * run at a time, each started with posix_spawn() and followed with a pidfd
+ * in the scheduler's epoll set, and killed by one timerfd at its deadline.
+ * The outcome goes back to its list entry: success clears the repair count,
+ * a failure counts as one attempt and holds off the next repair of the
+ * entry for "repair-backoff" seconds, doubled for each failure in a row.
+ * When "repair-maximum" repairs in a row have failed we give up on the
+ * entry, and the watchdog acts on its error as it would without the queue.
+ *
+ * Repairs by test plugins and check modules have no process of ours to
+ * follow. They are started at once by plugin.c and module.c, which report
+ * back through repair_finished(), with the same accounting but not counted
+ * against "repair-concurrency".
+ *
+ * With "repair-batch" the repairs by the repair binary are kept until the
+ * end of the cycle and then run as one, as "repair-binary batch" with a
+ * line for each failed check on its stdin:
+ *
+ *	<error> <type> <name>
+ *
+ * where <type> is that of the check ("file", "pidfile", "interface", ...)
+ * and <name> the rest of the line. Its exit code is the outcome for every
+ * one of them. A batch goes through the queue if there is one, or else is
+ * run by flush_repairs() as repair() would.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#define _GNU_SOURCE	/* For memfd_create() */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <spawn.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <time.h>
+
+#include "extern.h"
+#include "watch_err.h"
+#include "gettime.h"
+
+#ifndef __NR_pidfd_open
+#define __NR_pidfd_open	434
+#endif
+
+#define MAX_BACKOFF_SHIFT	6	/* At most 64 times "repair-backoff". */
+
+struct repair_item {
+	struct list *act;	/* NULL if taken out by a reload meanwhile. */
+	const char *type;	/* Of the check, as the scheduler has it. */
+	int error;		/* That it has been asked to repair. */
+};
+
+struct repair_job {
+	struct repair_item *items;
+	int num_items;		/* One, or any number for a batch. */
+	char *path;		/* Program to run. */
+	char *name;		/* Of the entry, as an argument. */
+	char *argv[5];
+	char parm[22];
+	int stdin_fd;		/* List of a batch, -1 for none. */
+	pid_t pid;		/* Zero while queued. */
+	int pidfd;
+	int timed_out;
+	struct timespec deadline;
+	struct repair_job *next;
+};
+
+static struct repair_job *queue_head = NULL;	/* Waiting, in order. */
+static struct repair_job *running = NULL;
+static int num_running = 0;
+static int timer_fd = -1;
+static int available = FALSE;
+static void (*giveup_func)(struct list *act, int error, int result) = NULL;
+
+/* Repairs of this cycle kept for one batch. */
+static struct repair_item *batch = NULL;
+static int batch_len = 0;
+static int batch_size = 0;
+
+/* ================================================================= */
+
+static void free_job(struct repair_job *job)
+{
+	if (job->pidfd != -1) {
+		sched_del_fd(job->pidfd);
+		close(job->pidfd);
+	}
+	if (job->stdin_fd != -1)
+		close(job->stdin_fd);
+	free(job->items);
+	free(job->path);
+	free(job->name);
+	free(job);
+}
+
+static void unlink_job(struct repair_job **head, struct repair_job *job)
+{
+	struct repair_job **jp;
+
+	for (jp = head; *jp != NULL; jp = &(*jp)->next) {
+		if (*jp == job) {
+			*jp = job->next;
+			return;
+		}
+	}
+}
+
+/*
+ * Arm the timer for the earliest deadline of a running repair, if any.
+ */
+
+static void arm_timer(void)
+{
+	struct itimerspec its;
+	struct repair_job *job;
+
+	memset(&its, 0, sizeof(its));
+
+	for (job = running; job != NULL; job = job->next) {
+		if (job->timed_out || repair_timeout <= 0)
+			continue;
+		if (its.it_value.tv_sec == 0 || timespeccmp(&job->deadline, &its.it_value, <))
+			its.it_value = job->deadline;
+	}
+
+	if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+		int err = errno;
+		log_message(LOG_ERR, "cannot arm repair timer (errno = %d = '%s')", err, strerror(err));
+	}
+}
+
+/*
+ * Record the outcome 'result' of a repair from the queue in the entry 'act'.
+ */
+
+static void entry_done(struct list *act, int result)
+{
+	int shift;
+
+	if (act == NULL)
+		return;
+
+	act->state->repairing = FALSE;
+
+	/* Also if the check has passed meanwhile, see wd_action(). */
+	if (result == ENOERR || act->state->repair_count == 0) {
+		act->state->repair_count = 0;
+		act->state->repair_after = 0;
+		return;
+	}
+
+	if (repair_max > 0 && act->state->repair_count >= repair_max) {
+		log_message(LOG_WARNING, "Repair count exceeded (%d for %s)", act->state->repair_count, act->name);
+		if (giveup_func != NULL)
+			giveup_func(act, act->state->repair_error, result);
+		return;
+	}
+
+	shift = act->state->repair_count - 1;
+	if (shift < 0)
+		shift = 0;
+	if (shift > MAX_BACKOFF_SHIFT)
+		shift = MAX_BACKOFF_SHIFT;
+	act->state->repair_after = gettime() + ((time_t)repair_backoff << shift);
+}
+
+static void repair_done(struct repair_job *job, int result)
+{
+	int ii;
+
+	if (result != ENOERR)
+		log_message(LOG_ERR, "repair binary %s returned %d = '%s'", job->path, result, wd_strerror(result));
+	else if (verbose)
+		log_message(LOG_DEBUG, "repair binary %s succeeded", job->path);
+
+	for (ii = 0; ii < job->num_items; ii++)
+		entry_done(job->items[ii].act, result);
+}
+
+static int start_job(struct repair_job *job);
+
+/*
+ * Start as many of the waiting repairs as the limit allows.
+ */
+
+static void start_waiting(void)
+{
+	while (queue_head != NULL && num_running < repair_concurrency) {
+		struct repair_job *job = queue_head;
+		int err;
+
+		queue_head = job->next;
+		err = start_job(job);
+		if (err != ENOERR) {
+			repair_done(job, err);
+			free_job(job);
+		}
+	}
+
+	arm_timer();
+}
+
+/*
+ * Called by the scheduler when a repair has ended.
+ */
+
+static void repair_exited(int fd, void *ptr)
+{
+	struct repair_job *job = (struct repair_job *)ptr;
+	int status = 0, result;
+	pid_t ret = waitpid(job->pid, &status, WNOHANG);
+
+	if (ret == 0)
+		return;
+
+	cgroup_collect(job->path);
+
+	if (job->timed_out)
+		result = ETOOLONG;
+	else if (ret < 0)
+		result = EDONTKNOW;	/* Reaped by someone else, we cannot tell. */
+	else if (WIFEXITED(status))
+		result = WEXITSTATUS(status);
+	else
+		result = ECHKILL;
+
+	unlink_job(&running, job);
+	num_running--;
+
+	repair_done(job, result);
+	free_job(job);
+
+	start_waiting();
+}
+
+/*
+ * Called by the scheduler when a repair has run out of time.
+ */
+
+static void timer_expired(int fd, void *unused)
+{
+	struct repair_job *job;
+	struct timespec now;
+	uint64_t expired;
+
+	if (read(fd, &expired, sizeof(expired)) < 0 && errno != EAGAIN)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	for (job = running; job != NULL; job = job->next) {
+		if (!job->timed_out && timespeccmp(&job->deadline, &now, <=)) {
+			log_message(LOG_ERR, "repair binary %s exceeded time limit %d", job->path, repair_timeout);
+			kill_process_tree(job->pid, SIGKILL);
+			job->timed_out = TRUE;
+		}
+	}
+
+	arm_timer();
+}
+
+static int start_job(struct repair_job *job)
+{
+	posix_spawn_file_actions_t fa;
+	int err;
+
+	if (verbose) {
+		if (job->stdin_fd != -1)
+			log_message(LOG_DEBUG, "running repair binary %s for %d checks", job->path, job->num_items);
+		else
+			log_message(LOG_DEBUG, "running repair binary %s for error %d", job->path, job->items[0].error);
+	}
+
+	posix_spawn_file_actions_init(&fa);
+
+	err = reopen_std_actions(&fa, FLAG_REOPEN_STD_REPAIR);
+	if (err == 0 && job->stdin_fd != -1)
+		err = posix_spawn_file_actions_adddup2(&fa, job->stdin_fd, STDIN_FILENO);
+	if (err == 0)
+		err = cgroup_spawn(&job->pid, job->path, &fa, job->argv);
+
+	posix_spawn_file_actions_destroy(&fa);
+
+	if (err != 0) {
+		log_message(LOG_ERR, "cannot run repair binary %s (errno = %d = '%s')", job->path, err, strerror(err));
+		return err;
+	}
+
+	job->pidfd = syscall(__NR_pidfd_open, job->pid, 0);
+	if (job->pidfd < 0 || sched_add_fd(job->pidfd, repair_exited, job) != ENOERR) {
+		err = errno;
+		log_message(LOG_ERR, "cannot follow repair binary %s (errno = %d = '%s')", job->path, err, strerror(err));
+		if (job->pidfd >= 0)
+			close(job->pidfd);
+		job->pidfd = -1;
+		kill_process_tree(job->pid, SIGKILL);
+		waitpid(job->pid, NULL, 0);
+		return err;
+	}
+
+	fcntl(job->pidfd, F_SETFD, FD_CLOEXEC);
+
+	clock_gettime(CLOCK_MONOTONIC, &job->deadline);
+	job->deadline.tv_sec += repair_timeout;
+
+	job->next = running;
+	running = job;
+	num_running++;
+
+	return ENOERR;
+}
+
+static struct repair_job *new_job(const char *path, int num_items)
+{
+	struct repair_job *job = (struct repair_job *)xcalloc(1, sizeof(struct repair_job));
+
+	job->items = (struct repair_item *)xcalloc(num_items, sizeof(struct repair_item));
+	job->num_items = num_items;
+	job->path = xstrdup(path);
+	job->argv[0] = job->path;
+	job->stdin_fd = -1;
+	job->pidfd = -1;
+
+	return job;
+}
+
+static void add_job(struct repair_job *job)
+{
+	struct repair_job **jp;
+
+	for (jp = &queue_head; *jp != NULL; jp = &(*jp)->next)
+		;
+	*jp = job;
+
+	start_waiting();
+}
+
+/* ================================================================= */
+
+/*
+ * Write the list of the batch to a file in memory, to be its stdin.
+ */
+
+static int write_batch(int *pfd)
+{
+	FILE *fp;
+	int ii, fd, err;
+
+	fd = memfd_create("repair-batch", MFD_CLOEXEC);
+	if (fd < 0 || (fp = fdopen(fd, "w")) == NULL) {
+		err = errno;
+		log_message(LOG_ERR, "cannot create list of repairs (errno = %d = '%s')", err, strerror(err));
+		if (fd >= 0)
+			close(fd);
+		return err;
+	}
+
+	for (ii = 0; ii < batch_len; ii++) {
+		struct list *act = batch[ii].act;
+
+		if (act != NULL)
+			fprintf(fp, "%d %s %s\n", batch[ii].error, batch[ii].type ? batch[ii].type : "unknown", act->name);
+	}
+
+	/* Our own descriptor, for once the stream is closed. */
+	*pfd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	if (fflush(fp) != 0 || *pfd < 0 || lseek(*pfd, 0, SEEK_SET) < 0) {
+		err = errno;
+		log_message(LOG_ERR, "cannot write list of repairs (errno = %d = '%s')", err, strerror(err));
+		fclose(fp);
+		if (*pfd >= 0)
+			close(*pfd);
+		return err;
+	}
+
+	fclose(fp);
+	return ENOERR;
+}
+
+struct batch_exec {
+	int fd;
+	char **arg;
+};
+
+/*
+ * In the child of run_func_as_child(): run the repair binary with the list
+ * as its stdin.
+ */
+
+static int exec_batch(int flags, void *ptr)
+{
+	struct batch_exec *be = (struct batch_exec *)ptr;
+
+	if (dup2(be->fd, STDIN_FILENO) < 0)
+		return errno;
+
+	return exec_in_cgroup(flags, be->arg);
+}
+
+static void add_batch(struct list *act, const char *type, int error)
+{
+	if (batch_len == batch_size) {
+		int nsize = (batch_size > 0) ? 2 * batch_size : 16;
+		struct repair_item *tmp = realloc(batch, nsize * sizeof(*batch));
+
+		if (tmp == NULL) {
+			fatal_error(EX_SYSERR, "out of memory for %d repairs", nsize);
+		}
+		batch = tmp;
+		batch_size = nsize;
+	}
+
+	batch[batch_len].act = act;
+	batch[batch_len].type = type;
+	batch[batch_len].error = error;
+	batch_len++;
+}
+
+/* ================================================================= */
+
+/*
+ * Queue a repair of '*result' for 'act', a check of 'type', run as
+ * repair() would with 'rbinary' and 'version', or by its test plugin or
+ * check module as attempt_repair() would. Returns FALSE if the caller has
+ * to do the repair itself, else TRUE with '*result' set to ENOERR, or left
+ * as it is if the repairs of 'act' have been given up on.
+ */
+
+int queue_repair(struct list *act, const char *type, char *rbinary, int *result, int version)
+{
+	struct repair_job *job;
+
+	if (!available || repair_concurrency <= 0)
+		return FALSE;
+
+	if (version == 1)
+		rbinary = act->name;	/* With V1 the test binary is also the repair binary. */
+	if (rbinary == NULL && version <= 1)
+		return FALSE;
+
+	if (act->state->repairing || gettime() < act->state->repair_after) {
+		*result = ENOERR;
+		return TRUE;
+	}
+
+	/* Until the check passes again, see wd_action(). */
+	if (repair_max > 0 && act->state->repair_count >= repair_max) {
+		log_message(LOG_WARNING, "Repair count exceeded (%d for %s)", act->state->repair_count, act->name);
+		return TRUE;
+	}
+
+	act->state->repair_count++;
+	act->state->repairing = TRUE;
+	act->state->repair_error = *result;
+	if (verbose)
+		log_message(LOG_DEBUG, "Repair attempt %d for %s", act->state->repair_count, act->name);
+
+	if (version == 2 || version == 3) {
+		int err = (version == 2) ? start_repair_plugin(act, *result) : start_repair_module(act, *result);
+
+		if (err != ENOERR)
+			entry_done(act, err);
+		*result = ENOERR;
+		return TRUE;
+	}
+
+	if (version == 0 && repair_batch) {
+		add_batch(act, type, *result);
+		*result = ENOERR;
+		return TRUE;
+	}
+
+	job = new_job(rbinary, 1);
+	job->items[0].act = act;
+	job->items[0].error = *result;
+	job->items[0].type = type;
+	snprintf(job->parm, sizeof(job->parm), "%d", *result);
+
+	/* The arguments as given by repair(). */
+	job->name = xstrdup(act->name);
+	if (version == 0) {
+		job->argv[1] = job->parm;
+		job->argv[2] = job->name;
+		job->argv[3] = NULL;
+	} else {
+		job->argv[1] = "repair";
+		job->argv[2] = job->parm;
+		job->argv[3] = job->name;
+		job->argv[4] = NULL;
+	}
+
+	add_job(job);
+
+	*result = ENOERR;
+	return TRUE;
+}
+
+/*
+ * The outcome of a repair by a test plugin or check module started by
+ * queue_repair().
+ */
+
+void repair_finished(struct list *act, int result)
+{
+	entry_done(act, result);
+}
+
+/*
+ * Keep the repair of 'result' for 'act', a check of 'type', by the repair
+ * binary for the batch of this cycle, if that is wanted. For attempt_repair() when there is no
+ * queue, the repair count has been seen to already.
+ */
+
+int batch_repair(struct list *act, const char *type, int result)
+{
+	if (!repair_batch || act == NULL)
+		return FALSE;
+
+	add_batch(act, type, result);
+	return TRUE;
+}
+
+/*
+ * At the end of a cycle run the batch, if any, with 'rbinary'.
+ */
+
+void flush_repairs(char *rbinary)
+{
+	struct batch_exec be;
+	char *arg[4];
+	int ii, fd = -1, ret;
+
+	if (batch_len == 0)
+		return;
+
+	ret = (rbinary != NULL) ? write_batch(&fd) : EINVAL;
+
+	if (ret == ENOERR && available && repair_concurrency > 0) {
+		struct repair_job *job = new_job(rbinary, batch_len);
+
+		memcpy(job->items, batch, batch_len * sizeof(struct repair_item));
+		job->stdin_fd = fd;
+		job->argv[1] = "batch";
+		job->argv[2] = NULL;
+		batch_len = 0;
+
+		add_job(job);
+		return;
+	}
+
+	if (ret == ENOERR) {
+		if (verbose)
+			log_message(LOG_DEBUG, "running repair binary %s for %d checks", rbinary, batch_len);
+
+		arg[0] = rbinary;
+		arg[1] = rbinary;
+		arg[2] = "batch";
+		arg[3] = NULL;
+		be.fd = fd;
+		be.arg = arg;
+
+		cgroup_prepare(rbinary);
+		ret = run_func_as_child(repair_timeout, exec_batch, FLAG_REOPEN_STD_REPAIR, &be);
+		cgroup_collect(rbinary);
+		close(fd);
+
+		if (ret != ENOERR)
+			log_message(LOG_ERR, "repair binary %s returned %d = '%s'", rbinary, ret, wd_strerror(ret));
+	}
+
+	/* Taken off first, as giving up may not return. */
+	ii = batch_len;
+	batch_len = 0;
+
+	if (available && repair_concurrency > 0) {
+		while (ii-- > 0)
+			entry_done(batch[ii].act, ret);
+	} else if (ret != ENOERR && giveup_func != NULL) {
+		while (ii-- > 0)
+			giveup_func(batch[ii].act, batch[ii].error, ret);
+	}
+}
+
+/*
+ * Start the queue, if the kernel can give us pidfds (Linux 5.3 and later).
+ * 'gaveup' is called for an entry whose repairs have all failed, with the
+ * error they were for and the outcome of the last. Call after open_sched().
+ */
+
+int open_repairs(void (*gaveup)(struct list *act, int error, int result))
+{
+	int fd;
+
+	giveup_func = gaveup;
+
+	if (repair_concurrency <= 0 || available)
+		return ENOERR;
+
+	fd = syscall(__NR_pidfd_open, getpid(), 0);
+	if (fd < 0) {
+		int err = errno;
+		log_message(LOG_WARNING, "cannot open pidfd (errno = %d = '%s'), repairs are run one at a time", err, strerror(err));
+		return err;
+	}
+	close(fd);
+
+	timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (timer_fd < 0 || sched_add_fd(timer_fd, timer_expired, NULL) != ENOERR) {
+		int err = errno;
+		log_message(LOG_ERR, "cannot create repair timer (errno = %d = '%s')", err, strerror(err));
+		if (timer_fd >= 0)
+			close(timer_fd);
+		timer_fd = -1;
+		return err;
+	}
+
+	available = TRUE;
+	return ENOERR;
+}
+
+/*
+ * After a reload, point the repairs at the new entries. Their outcome is
+ * only logged if the entry has been taken out. Call before reload_end().
+ */
+
+void reload_repairs(void)
+{
+	struct repair_job *job, **heads[] = {&queue_head, &running};
+	int ii, jj;
+
+	for (ii = 0; ii < ARRAY_SIZE(heads); ii++) {
+		for (job = *heads[ii]; job != NULL; job = job->next) {
+			for (jj = 0; jj < job->num_items; jj++) {
+				if (job->items[jj].act != NULL)
+					job->items[jj].act = reload_any_entry(job->items[jj].act);
+			}
+		}
+	}
+
+	for (jj = 0; jj < batch_len; jj++) {
+		if (batch[jj].act != NULL)
+			batch[jj].act = reload_any_entry(batch[jj].act);
+	}
+
+	/* Set going by a reload that has just turned the queue on. */
+	open_repairs(giveup_func);
+}
+
+/*
+ * Forget the waiting repairs, those running are left to finish.
+ */
+
+void close_repairs(void)
+{
+	struct repair_job *job;
+
+	while ((job = queue_head) != NULL) {
+		queue_head = job->next;
+		free_job(job);
+	}
+
+	while ((job = running) != NULL) {
+		running = job->next;
+		free_job(job);
+	}
+	num_running = 0;
+
+	if (timer_fd != -1) {
+		sched_del_fd(timer_fd);
+		close(timer_fd);
+		timer_fd = -1;
+	}
+
+	free(batch);
+	batch = NULL;
+	batch_len = batch_size = 0;
+
+	available = FALSE;
+}
@@ -0,0 +1,643 @@
+/* > sched.c
+ *
+ * Event-driven scheduler for the checks. Each check is an item with its own
+ * interval and next-due time, kept in a min-heap ordered by deadline. The
+ * main loop waits on an epoll set holding a timerfd armed for the earliest
+ * deadline (plus any other descriptors registered by the check code) and
+ * then runs the checks that have become due.
+ *
+ * Deadlines stay on each item's own grid (first run + N * interval), so the
+ * time spent checking does not add to the period. A check that is dispatched
+ * after its following deadline has passed skips those runs, and both the
+ * skipped deadlines and the lateness are counted.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include "extern.h"
+#include "watch_err.h"
+#include "gettime.h"
+
+#define MAX_EVENTS	16
+
+struct sched_fd {
+	int fd;
+	void (*func)(int fd, void *ptr);
+	void *ptr;
+	struct sched_fd *next;
+};
+
+static int epoll_fd = -1;
+static int timer_fd = -1;
+
+static struct sched_item **heap = NULL;
+static int heap_len = 0;
+static int heap_size = 0;
+static int num_added = 0;
+
+static struct sched_fd *fd_head = NULL;
+static struct sched_fd *fd_dead = NULL;	/* Removed, but may still be in the event array. */
+
+/* Totals over all items. */
+static unsigned long total_runs = 0;
+static unsigned long total_missed = 0;
+static long long total_late = 0;
+static long long total_late_max = 0;
+
+/* ================================================================= */
+
+/*
+ * Heap ordering: earliest deadline first, and for identical deadlines the
+ * order of registration so a batch runs in the same order as the old loop.
+ */
+
+static int item_before(const struct sched_item *a, const struct sched_item *b)
+{
+	int cmp = ts_cmp(&a->due, &b->due);
+
+	if (cmp != 0)
+		return (cmp < 0);
+
+	return (a->order < b->order);
+}
+
+static void heap_swap(int a, int b)
+{
+	struct sched_item *tmp = heap[a];
+
+	heap[a] = heap[b];
+	heap[b] = tmp;
+	heap[a]->heap_idx = a;
+	heap[b]->heap_idx = b;
+}
+
+static void sift_up(int ii)
+{
+	while (ii > 0) {
+		int parent = (ii - 1) / 2;
+
+		if (!item_before(heap[ii], heap[parent]))
+			break;
+
+		heap_swap(ii, parent);
+		ii = parent;
+	}
+}
+
+static void sift_down(int ii)
+{
+	while (1) {
+		int left = 2 * ii + 1;
+		int right = left + 1;
+		int best = ii;
+
+		if (left < heap_len && item_before(heap[left], heap[best]))
+			best = left;
+		if (right < heap_len && item_before(heap[right], heap[best]))
+			best = right;
+		if (best == ii)
+			break;
+
+		heap_swap(ii, best);
+		ii = best;
+	}
+}
+
+static void heap_push(struct sched_item *item)
+{
+	if (heap_len >= heap_size) {
+		int nsize = (heap_size > 0) ? 2 * heap_size : 64;
+		struct sched_item **tmp = realloc(heap, nsize * sizeof(*heap));
+
+		if (tmp == NULL) {
+			fatal_error(EX_SYSERR, "out of memory growing scheduler to %d items", nsize);
+		}
+		heap = tmp;
+		heap_size = nsize;
+	}
+
+	item->heap_idx = heap_len;
+	heap[heap_len++] = item;
+	sift_up(item->heap_idx);
+}
+
+static struct sched_item *heap_pop(void)
+{
+	struct sched_item *top = heap[0];
+
+	heap_len--;
+	if (heap_len > 0) {
+		heap[0] = heap[heap_len];
+		heap[0]->heap_idx = 0;
+		sift_down(0);
+	}
+
+	top->heap_idx = -1;
+	return top;
+}
+
+/*
+ * Take the item at 'ii' out of the heap, from anywhere in it.
+ */
+
+static void heap_remove(int ii)
+{
+	struct sched_item *item = heap[ii];
+
+	heap_len--;
+	if (ii < heap_len) {
+		struct sched_item *moved = heap[heap_len];
+
+		heap[ii] = moved;
+		moved->heap_idx = ii;
+		sift_up(ii);
+		sift_down(moved->heap_idx);
+	}
+
+	item->heap_idx = -1;
+}
+
+/* ================================================================= */
+
+static void add_msec(struct timespec *ts, long msec)
+{
+	struct timespec delta;
+
+	delta.tv_sec = msec / 1000;
+	delta.tv_nsec = (msec % 1000) * 1000000L;
+	timespecadd(ts, &delta, ts);
+}
+
+/*
+ * Account for how late 'item' is being run and move its deadline on to the
+ * next point of its grid that is still in the future.
+ */
+
+static void next_deadline(struct sched_item *item, const struct timespec *now)
+{
+	struct timespec diff;
+	long long late;
+
+	timespecsub(now, &item->due, &diff);
+	late = (long long)diff.tv_sec * NSEC + diff.tv_nsec;
+
+	item->runs++;
+	item->late_sum += late;
+	if (late > item->late_max)
+		item->late_max = late;
+
+	total_runs++;
+	total_late += late;
+	if (late > total_late_max)
+		total_late_max = late;
+
+	add_msec(&item->due, item->interval);
+
+	if (timespeccmp(&item->due, now, <=)) {
+		long long period = item->interval * 1000000LL;
+		long missed = (long)((late - period) / period) + 1;
+
+		item->missed += missed;
+		total_missed += missed;
+		add_msec(&item->due, missed * item->interval);
+
+		if (verbose) {
+			log_message(LOG_WARNING, "%s is %.3f ms late, skipping %ld run(s)",
+				item->name, 1.0e-6 * late, missed);
+		}
+	}
+}
+
+/*
+ * Program the timerfd for the earliest deadline in the heap. The time is
+ * absolute so a late wake-up does not push the following deadlines back.
+ */
+
+static int arm_timer(void)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+
+	if (heap_len > 0) {
+		its.it_value = heap[0]->due;
+		/* A zero it_value disarms the timer, so make sure we never pass that. */
+		if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0)
+			its.it_value.tv_nsec = 1;
+	}
+
+	if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+		int err = errno;
+		log_message(LOG_ERR, "cannot arm scheduler timer (errno = %d = '%s')", err, strerror(err));
+		return err;
+	}
+
+	return ENOERR;
+}
+
+static int cmp_order(const void *a, const void *b)
+{
+	const struct sched_item *ia = *(struct sched_item * const *)a;
+	const struct sched_item *ib = *(struct sched_item * const *)b;
+
+	return (ia->order > ib->order) - (ia->order < ib->order);
+}
+
+/* ================================================================= */
+
+/*
+ * Create the epoll set and the deadline timer.
+ */
+
+int open_sched(void)
+{
+	struct epoll_event ev;
+
+	close_sched();
+
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0) {
+		fatal_error(EX_SYSERR, "cannot create epoll set (%s)", strerror(errno));
+	}
+
+	timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (timer_fd < 0) {
+		fatal_error(EX_SYSERR, "cannot create scheduler timer (%s)", strerror(errno));
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;	/* NULL marks the deadline timer. */
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &ev) < 0) {
+		fatal_error(EX_SYSERR, "cannot add scheduler timer to epoll set (%s)", strerror(errno));
+	}
+
+	return 0;
+}
+
+/*
+ * Add a check to be run every 'interval' milliseconds, first run is as
+ * soon as the main loop starts waiting. The 'act' entry is passed to the
+ * check function and on to wd_action() by the caller, 'type' groups the
+ * run times with those of similar checks.
+ */
+
+struct sched_item *sched_add(const char *name, const char *type, int (*func)(struct list *), struct list *act, long interval)
+{
+	struct sched_item *item = (struct sched_item *)xcalloc(1, sizeof(struct sched_item));
+
+	if (interval <= 0)
+		interval = 1000L * tint;
+
+	item->name = name;
+	item->type = type;
+	item->type_hist = timing_type(type);
+	item->func = func;
+	item->act = act;
+	item->interval = interval;
+	item->order = num_added++;
+	clock_gettime(CLOCK_MONOTONIC, &item->due);
+
+	heap_push(item);
+
+	if (verbose > 1)
+		log_message(LOG_DEBUG, "scheduled %s every %ld ms", name, interval);
+
+	return item;
+}
+
+/*
+ * Remove a check and free it. Not to be called while the item is in the
+ * batch returned by sched_wait() and not yet acted on.
+ */
+
+void sched_del(struct sched_item *item)
+{
+	if (item == NULL)
+		return;
+
+	if (item->heap_idx >= 0 && item->heap_idx < heap_len && heap[item->heap_idx] == item)
+		heap_remove(item->heap_idx);
+
+	if (verbose > 1)
+		log_message(LOG_DEBUG, "unscheduled %s", item->name);
+
+	free(item);
+}
+
+/*
+ * Change how often a check is run. The next deadline is kept unless the
+ * new interval is shorter than the time left until it, then it is brought
+ * forward to one new interval from now.
+ */
+
+void sched_set_interval(struct sched_item *item, long interval)
+{
+	struct timespec limit;
+
+	if (interval <= 0)
+		interval = 1000L * tint;
+
+	if (interval == item->interval)
+		return;
+
+	item->interval = interval;
+
+	clock_gettime(CLOCK_MONOTONIC, &limit);
+	add_msec(&limit, interval);
+	if (timespeccmp(&item->due, &limit, >)) {
+		item->due = limit;
+		sift_up(item->heap_idx);
+	}
+}
+
+/*
+ * Make a check due now, for when an event tells us its result has changed.
+ * Its following deadlines are counted on from this run.
+ */
+
+void sched_run_now(struct sched_item *item)
+{
+	if (item == NULL || item->heap_idx < 0 || item->heap_idx >= heap_len || heap[item->heap_idx] != item)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &item->due);
+	sift_up(item->heap_idx);
+}
+
+static int add_fd(int fd, uint32_t events, void (*func)(int fd, void *ptr), void *ptr)
+{
+	struct epoll_event ev;
+	struct sched_fd *sfd;
+
+	if (epoll_fd == -1 || fd < 0 || func == NULL)
+		return EINVAL;
+
+	sfd = (struct sched_fd *)xcalloc(1, sizeof(struct sched_fd));
+	sfd->fd = fd;
+	sfd->func = func;
+	sfd->ptr = ptr;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = sfd;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		int err = errno;
+		log_message(LOG_ERR, "cannot add fd %d to epoll set (errno = %d = '%s')", fd, err, strerror(err));
+		free(sfd);
+		return err;
+	}
+
+	sfd->next = fd_head;
+	fd_head = sfd;
+
+	return ENOERR;
+}
+
+/*
+ * Add a file descriptor to the epoll set, 'func' is called from sched_wait()
+ * whenever it becomes readable.
+ */
+
+int sched_add_fd(int fd, void (*func)(int fd, void *ptr), void *ptr)
+{
+	return add_fd(fd, EPOLLIN, func, ptr);
+}
+
+/*
+ * As sched_add_fd(), but 'func' is called when 'fd' can be written to (or
+ * has an error), for finishing a reply the peer could not take at once.
+ */
+
+int sched_add_fd_out(int fd, void (*func)(int fd, void *ptr), void *ptr)
+{
+	return add_fd(fd, EPOLLOUT, func, ptr);
+}
+
+/*
+ * Remove a descriptor added by sched_add_fd(), call this before closing it.
+ */
+
+int sched_del_fd(int fd)
+{
+	struct sched_fd *sfd, *last = NULL;
+
+	for (sfd = fd_head; sfd != NULL; last = sfd, sfd = sfd->next) {
+		if (sfd->fd == fd)
+			break;
+	}
+
+	if (sfd == NULL)
+		return ENOENT;
+
+	if (last == NULL)
+		fd_head = sfd->next;
+	else
+		last->next = sfd->next;
+
+	if (epoll_fd != -1)
+		epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+
+	/* Callbacks can remove descriptors, so only free once the events are done with. */
+	sfd->fd = -1;
+	sfd->next = fd_dead;
+	fd_dead = sfd;
+
+	return ENOERR;
+}
+
+static void free_dead_fds(void)
+{
+	while (fd_dead != NULL) {
+		struct sched_fd *sfd = fd_dead;
+		fd_dead = sfd->next;
+		free(sfd);
+	}
+}
+
+/*
+ * Wait until at least one check is due, dispatching any other descriptor
+ * events as they arrive. Up to 'max' due items are returned in 'due' in
+ * registration order, each already given its next deadline.
+ *
+ * Ready descriptors are handled on every call, not only when nothing is
+ * due, so ping replies, child exits and the like are not starved while the
+ * checks are running late. That is done before the due items are taken, so
+ * a callback that deletes an item cannot leave it in 'due'.
+ *
+ * Returns the number of items, or zero if interrupted by a signal so the
+ * caller can look at the _running flag.
+ */
+
+int sched_wait(struct sched_item **due, int max)
+{
+	struct epoll_event events[MAX_EVENTS];
+	struct timespec now;
+	int timeout = 0;	/* Only block once we know nothing is due. */
+	int n = 0;
+
+	if (epoll_fd == -1 || max < 1)
+		return 0;
+
+	while (n == 0) {
+		int ii, nev;
+
+		free_dead_fds();
+
+		nev = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+		if (nev < 0) {
+			int err = errno;
+			if (err != EINTR) {
+				log_message(LOG_ERR, "epoll_wait gave errno = %d = '%s'", err, strerror(err));
+			}
+			return 0;
+		}
+
+		for (ii = 0; ii < nev; ii++) {
+			struct sched_fd *sfd = (struct sched_fd *)events[ii].data.ptr;
+
+			if (sfd == NULL) {
+				uint64_t expired;
+				/* Just clear the timer, the heap is checked below. */
+				if (read(timer_fd, &expired, sizeof(expired)) < 0 && errno != EAGAIN) {
+					log_message(LOG_ERR, "read of scheduler timer gave errno = %d = '%s'", errno, strerror(errno));
+				}
+			} else if (sfd->fd != -1) {
+				sfd->func(sfd->fd, sfd->ptr);
+			}
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		while (heap_len > 0 && n < max && timespeccmp(&heap[0]->due, &now, <=)) {
+			struct sched_item *item = heap_pop();
+
+			next_deadline(item, &now);
+			heap_push(item);
+
+			due[n++] = item;
+		}
+
+		if (n == 0) {
+			if (arm_timer() != ENOERR)
+				return 0;
+			timeout = -1;
+		}
+	}
+
+	qsort(due, n, sizeof(*due), cmp_order);
+
+	return n;
+}
+
+/*
+ * Report how far behind their deadlines the checks have been run, overall
+ * and for each check that has missed one.
+ */
+
+void sched_log_stats(void)
+{
+	int ii;
+
+	if (total_runs == 0)
+		return;
+
+	log_message(LOG_INFO, "scheduler: %lu runs, %lu missed deadlines, lateness avg %.3f ms max %.3f ms",
+		total_runs, total_missed, 1.0e-6 * total_late / total_runs, 1.0e-6 * total_late_max);
+
+	for (ii = 0; ii < heap_len; ii++) {
+		struct sched_item *item = heap[ii];
+
+		if (item->missed == 0 || item->runs == 0)
+			continue;
+
+		log_message(LOG_INFO, "scheduler: %s every %ld ms, %lu runs, %lu missed, lateness avg %.3f ms max %.3f ms",
+			item->name, item->interval, item->runs, item->missed,
+			1.0e-6 * item->late_sum / item->runs, 1.0e-6 * item->late_max);
+	}
+}
+
+/*
+ * Log the run time histogram of every check.
+ */
+
+void sched_log_timing(void)
+{
+	int ii;
+
+	for (ii = 0; ii < heap_len; ii++) {
+		char what[256];
+
+		snprintf(what, sizeof(what), "%s %s", heap[ii]->type, heap[ii]->name);
+		hist_log(what, &heap[ii]->hist);
+	}
+}
+
+/*
+ * Call 'func' for every scheduled check, in no particular order.
+ */
+
+void sched_foreach(void (*func)(struct sched_item *item, void *ptr), void *ptr)
+{
+	int ii;
+
+	for (ii = 0; ii < heap_len; ii++) {
+		func(heap[ii], ptr);
+	}
+}
+
+void sched_get_totals(unsigned long *runs, unsigned long *missed, long long *late_max)
+{
+	*runs = total_runs;
+	*missed = total_missed;
+	*late_max = total_late_max;
+}
+
+/*
+ * Release everything set up by open_sched() and sched_add().
+ */
+
+int close_sched(void)
+{
+	int rv = 0;
+
+	while (fd_head != NULL) {
+		sched_del_fd(fd_head->fd);
+	}
+	free_dead_fds();
+
+	while (heap_len > 0) {
+		free(heap_pop());
+	}
+
+	free(heap);
+	heap = NULL;
+	heap_size = 0;
+	num_added = 0;
+
+	total_runs = total_missed = 0;
+	total_late = total_late_max = 0;
+
+	if (timer_fd != -1 && close(timer_fd) < 0) {
+		rv = -1;
+	}
+	timer_fd = -1;
+
+	if (epoll_fd != -1 && close(epoll_fd) < 0) {
+		rv = -1;
+	}
+	epoll_fd = -1;
+
+	return rv;
+}
@@ -0,0 +1,310 @@
+/* > temp.c
+ *
+ * The temperature checks. Each sensor has its own limit: the one given
+ * by "sensor-max-temperature" after it or else "max-temperature", lowered
+ * to the critical level of a hwmon sensor (its temp*_crit file) if that is
+ * below. With "max-temperature-rise" the rate of rise of each sensor is
+ * followed as an exponentially weighted average, and a sensor heating
+ * faster than that gives the repairable ETEMPRISE, so a repair binary can
+ * shed load well before the limit and the ETOOHOT shut-down are reached.
+ * With no repair binary there is nothing to run, and as an unrepaired error
+ * means a reboot the rise is only logged as a warning.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "extern.h"
+#include "watch_err.h"
+
+/* Time constant in seconds of the averaged rate of rise. */
+#define RISE_TAU	30.0
+
+static int temp_fd = -1;
+
+/* Sensor files opened, to be closed by close_tempcheck(). */
+static struct snap_file **temp_snaps = NULL;
+static int num_snaps = 0;
+
+static int read_temp_sensor(struct list *act, int *val, float *exact);
+
+/*
+ * The critical level of the hwmon sensor 'name', from the temp*_crit file
+ * next to its temp*_input one, or 0 if none.
+ */
+
+static int read_crit(const char *name)
+{
+	char fname[PATH_MAX];
+	size_t len = strlen(name);
+	const char suffix[] = "_input";
+	int crit = 0;
+	FILE *fp;
+
+	if (len < sizeof(suffix) || strcmp(name + len - (sizeof(suffix) - 1), suffix) != 0)
+		return 0;
+
+	if (snprintf(fname, sizeof(fname), "%.*s_crit", (int)(len - (sizeof(suffix) - 1)), name) >= (int)sizeof(fname))
+		return 0;
+
+	fp = fopen(fname, "r");
+	if (fp != NULL) {
+		if (fscanf(fp, "%d", &crit) != 1)
+			crit = 0;
+		fclose(fp);
+	}
+
+	/* In milli-Celsius, as for the input. */
+	return (crit > 0) ? crit / 1000 : 0;
+}
+
+/*
+ * The limit for a sensor, and the warning levels below it. Make sure that
+ * each level is distinct and properly ordered so that we have
+ * level1 < level2 < level3 < limit.
+ */
+
+static int temp_limit(const struct list *act, int *level1, int *level2, int *level3)
+{
+	int limit = maxtemp;
+
+	if (act->parameter.temp.max > 0)
+		limit = act->parameter.temp.max;
+	else if (act->parameter.temp.crit > 0 && act->parameter.temp.crit < limit)
+		limit = act->parameter.temp.crit;
+
+	*level3 = (limit * 98) / 100;
+	if (*level3 >= limit) {
+		*level3 = limit - 1;
+	}
+
+	*level2 = (limit * 95) / 100;
+	if (*level2 >= *level3) {
+		*level2 = *level3 - 1;
+	}
+
+	*level1 = (limit * 90) / 100;
+	if (*level1 >= *level2) {
+		*level1 = *level2 - 1;
+	}
+
+	return limit;
+}
+
+/* ================================================================= */
+
+int open_tempcheck(struct list *tlist)
+{
+	int rv = -1;
+	struct list *act;
+
+	close_tempcheck();
+
+	if (tlist != NULL) {
+		/* Use temp_fd as in-use flag. */
+		temp_fd = 0;
+
+		for (act = tlist; act != NULL; act = act->next)
+			num_snaps++;
+		temp_snaps = (struct snap_file **)xcalloc(num_snaps, sizeof(struct snap_file *));
+		num_snaps = 0;
+
+		/*
+		 * Clear flags and open the sensors. The rate of rise is kept,
+		 * carried over from a reload.
+		 */
+		for (act = tlist; act != NULL; act = act->next) {
+			int itmp = 0;
+			float ftmp;
+			act->parameter.temp.have1 = FALSE;
+			act->parameter.temp.have2 = FALSE;
+			act->parameter.temp.have3 = FALSE;
+			act->parameter.temp.crit = read_crit(act->name);
+			/* Check the sensors is usable when initialising. */
+			act->parameter.temp.snap = snap_open(act->name);
+			if (act->parameter.temp.snap != NULL)
+				temp_snaps[num_snaps++] = act->parameter.temp.snap;
+			if (act->parameter.temp.snap != NULL && read_temp_sensor(act, &itmp, &ftmp) == ENOERR) {
+				act->parameter.temp.in_use = TRUE;
+			} else {
+				act->parameter.temp.in_use = FALSE;
+				log_message(LOG_WARNING, "Disabling temperature check for %s", act->name);
+			}
+		}
+	}
+
+	return rv;
+}
+
+/*
+ * Code to read the ASCII "files" presented by the lm-sensors package with paths such as:
+ *
+ * -r--r--r-- 1 root root 4096 2013-03-09 09:27 /sys/class/hwmon/hwmon0/device/temp1_input
+ * -r--r--r-- 1 root root 4096 2013-03-09 09:01 /sys/class/hwmon/hwmon0/device/temp2_input
+ * -r--r--r-- 1 root root 4096 2013-03-09 09:27 /sys/class/hwmon/hwmon0/device/temp3_input
+ *
+ * Location varies with hardware devices, and you may find two sensors as hwmon0 & hwmon1, etcv
+ * but in my case the above paths are really sym-links to the hardware driver, such as:
+ *
+ * -r--r--r-- 1 root root 4096 2013-03-09 09:27 /sys/devices/platform/w83627ehf.656/temp1_input
+ * -r--r--r-- 1 root root 4096 2013-03-09 09:01 /sys/devices/platform/w83627ehf.656/temp2_input
+ * -r--r--r-- 1 root root 4096 2013-03-09 09:27 /sys/devices/platform/w83627ehf.656/temp3_input
+ *
+ * They have the temperature in C x 1000 but resolution may only be 0.5C or 1C. Typical result is:
+ *
+ * > cat /sys/class/hwmon/hwmon0/device/temp1_input
+ * 36000
+ *
+ * For 36.0C so we read and print as fraction, but truncate so only the whole deg C is used
+ * for the watchdog tests below.
+ *
+ * The file is kept open from open_tempcheck() and read as a snapshot.
+ */
+
+static int read_temp_sensor(struct list *act, int *val, float *exact)
+{
+	const char *name = act->name;
+	const char *buf;
+	float temp;
+	int err;
+
+	err = snap_read(act->parameter.temp.snap, &buf);
+	if (err != ENOERR) {
+		return err;
+	}
+
+	/* New style sensors read in milli-Celsius, convert to deg C as float. */
+	temp = 1.0e-3F * atof(buf);
+
+	if (verbose && logtick && ticker == 1)
+		log_message(LOG_DEBUG, "current temperature is %.3f for %s", temp, name);
+
+	/* convert to integer of whole deg C, small addition to make sure matches integer version. */
+	*val = (int)(1.0e-5F + temp);
+	*exact = temp;
+
+	return ENOERR;
+}
+
+/* ================================================================= */
+
+/*
+ * Fold the reading 'temp' into the averaged rate of rise of the sensor.
+ */
+
+static void update_slope(struct tempmode *tm, float temp)
+{
+	struct timespec ts;
+	double now;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	now = ts.tv_sec + 1.0e-9 * ts.tv_nsec;
+
+	if (tm->last_time > 0.0 && now > tm->last_time) {
+		double dt = now - tm->last_time;
+		double rate = 60.0 * (temp - tm->last) / dt;
+
+		/* Weight by the time since the last reading, for any check interval. */
+		tm->slope += (float)(dt / (RISE_TAU + dt) * (rate - tm->slope));
+	}
+
+	tm->last = temp;
+	tm->last_time = now;
+}
+
+int check_temp(struct list *act)
+{
+	int temperature = 0;
+	int limit, templevel1, templevel2, templevel3;
+	float exact;
+	int err;
+
+	/* is the temperature device open? */
+	if (temp_fd == -1 || act == NULL || act->parameter.temp.in_use == FALSE)
+		return (ENOERR);
+
+	err = read_temp_sensor(act, &temperature, &exact);
+	if (err != ENOERR) {
+		return (err);
+	}
+
+	update_slope(&act->parameter.temp, exact);
+	limit = temp_limit(act, &templevel1, &templevel2, &templevel3);
+
+	/* Print out warnings as we cross the 90/95/98 percent thresholds. */
+	if (temperature > templevel3) {
+		if (!act->parameter.temp.have3) {
+			/* once we reach level3, issue a warning once. */
+			log_message(LOG_WARNING, "temperature increases above %d (%s)", templevel3, act->name);
+			act->parameter.temp.have1 = act->parameter.temp.have2 = act->parameter.temp.have3 = TRUE;
+		}
+	} else if (temperature > templevel2) {
+		if (!act->parameter.temp.have2) {
+			log_message(LOG_WARNING, "temperature increases above %d (%s)", templevel2, act->name);
+			act->parameter.temp.have1 = act->parameter.temp.have2 = TRUE;
+		}
+		act->parameter.temp.have3 = FALSE;
+	} else if (temperature > templevel1) {
+		if (!act->parameter.temp.have1) {
+			log_message(LOG_WARNING, "temperature increases above %d (%s)", templevel1, act->name);
+			act->parameter.temp.have1 = TRUE;
+		}
+		act->parameter.temp.have2 = act->parameter.temp.have3 = FALSE;
+	} else {
+		/* Below all thresholds, report clear only if previously set. */
+		if (act->parameter.temp.have1 || act->parameter.temp.have2 || act->parameter.temp.have3) {
+			log_message(LOG_INFO, "temperature now OK again for %s", act->name);
+		}
+		act->parameter.temp.have1 = act->parameter.temp.have2 = act->parameter.temp.have3 = FALSE;
+	}
+
+	if (temperature >= limit) {
+		log_message(LOG_ERR, "it is too hot inside (temperature = %d >= %d for %s)", temperature, limit, act->name);
+		return (ETOOHOT);
+	}
+
+	if (maxtemp_rise > 0 && act->parameter.temp.slope > maxtemp_rise) {
+		float slope = act->parameter.temp.slope;
+
+		log_message(repair_bin != NULL ? LOG_ERR : LOG_WARNING,
+			"temperature rising at %.1f C/min (more than %d) for %s, limit %d in about %.0f seconds",
+			slope, maxtemp_rise, act->name, limit, 60.0 * (limit - exact) / slope);
+		if (repair_bin != NULL)
+			return (ETEMPRISE);
+	}
+
+	if (verbose > 1 && logtick && ticker == 1)
+		log_message(LOG_DEBUG, "temperature of %s rising at %.2f C/min", act->name, act->parameter.temp.slope);
+
+	return (ENOERR);
+}
+
+/* ================================================================= */
+
+int close_tempcheck(void)
+{
+	int rv = -1;
+	int ii;
+
+	if (temp_fd != -1) {
+		rv = 0;
+	}
+
+	for (ii = 0; ii < num_snaps; ii++)
+		snap_close(temp_snaps[ii]);
+	free(temp_snaps);
+	temp_snaps = NULL;
+	num_snaps = 0;
+
+	temp_fd = -1;
+	return rv;
+}
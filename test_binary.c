@@ -0,0 +1,455 @@
+/* > test_binary.c
+ *
+ * Running the test binaries. Each is started with posix_spawn(), which
+ * glibc does with vfork() semantics, so no copy of the daemon's address
+ * space (locked in memory, perhaps large) is made for a child that only
+ * calls execve(). Its exit is followed with a pidfd in the scheduler's
+ * epoll set and its time limit with one timerfd armed for the earliest
+ * deadline, so a child is reaped as soon as it ends and killed as soon as
+ * its time is up, with nothing polled. Without pidfd support (before
+ * Linux 5.3) we poll with waitpid() and check the time as before.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <linux/limits.h>
+
+#include "extern.h"
+#include "watch_err.h"
+#include "gettime.h"
+
+#ifndef __NR_pidfd_open
+#define __NR_pidfd_open	434
+#endif
+
+#define TEST_RUNNING	0
+#define TEST_COMPLETED	1
+#define TEST_BLANK		2
+
+struct process {
+	char proc_name[PATH_MAX];
+	pid_t pid;
+	struct timespec deadline;	/* CLOCK_MONOTONIC time to kill it, zero for none. */
+	int ecode;
+	int is_done;
+	struct process *next;
+};
+
+static struct process *process_head = NULL;
+
+static int use_pidfd = TRUE;	/* Until the kernel or scheduler says otherwise. */
+static int timer_fd = -1;
+
+/*
+ * Add a process to the list. We index by PID primarily to act on child exit
+ * values, but check the process name when attempting to start a new child.
+ */
+
+static int add_process(const char *name, pid_t pid, int timeout)
+{
+	struct process *node = (struct process *)malloc(sizeof(struct process));
+
+	if (node == NULL) {
+		log_message(LOG_ALERT, "out of memory adding test binary");
+		free_process();
+		return (ENOMEM);
+	}
+
+	snprintf(node->proc_name, sizeof(node->proc_name), "%s", name);
+	node->pid = pid;
+	node->deadline.tv_sec = node->deadline.tv_nsec = 0;
+	if (timeout > 0) {
+		clock_gettime(CLOCK_MONOTONIC, &node->deadline);
+		node->deadline.tv_sec += timeout;
+	}
+	node->ecode = 0;
+	node->is_done = FALSE;
+	node->next = process_head;
+	process_head = node;
+
+	return (ENOERR);
+}
+
+/*
+ * Free the whole chain. Used on out-of-memory case to hopefully to have enough
+ * heap left to create the process kill-list for an orderly shut-down.
+ */
+
+void free_process(void)
+{
+	struct process *last, *current;
+	current = process_head;
+
+	while (current != NULL) {
+		last = current;
+		current = current->next;
+		free(last);
+	}
+
+	process_head = NULL;
+}
+
+/*
+ * Remove a finished process from the list, indexed by PID.
+ */
+
+static void remove_process(pid_t pid)
+{
+	struct process *last, *current;
+	last = NULL;
+	current = process_head;
+	while (current != NULL && current->pid != pid) {
+		last = current;
+		current = current->next;
+	}
+	if (current != NULL) {
+		if (last == NULL)
+			process_head = current->next;
+		else
+			last->next = current->next;
+		free(current);
+	}
+}
+
+/*
+ * When a child process has changed state, update the list to record
+ * the exit status (or kill signal event).
+ */
+
+static void update_process(pid_t pid, int result)
+{
+	struct process *current;
+	current = process_head;
+	while (current != NULL && current->pid != pid) {
+		current = current->next;
+	}
+
+	if (current != NULL) {
+		cgroup_collect(current->proc_name);
+
+		/* Found a PID match in while() loop, but has something already reported? */
+		if (current->is_done == FALSE) {
+			if (WIFEXITED(result)) {
+				/* Child exited normally, report the exit code.
+				 * Log this if non-zero (i.e. error) or always when verbose.
+				 */
+				int ecode = WEXITSTATUS(result);
+				if (ecode || verbose) {
+					log_message(LOG_DEBUG, "test binary %s returned %d = '%s'", current->proc_name, ecode, wd_strerror(ecode));
+				}
+				current->ecode = ecode;
+				current->is_done = TRUE;
+			} else if (WIFSIGNALED(result)) {
+				/* Child was terminated by a signal. We don't care what signal did
+				 * it, so always report it simple as "process killed". When we kill
+				 * on time-out, we have already set the 'is_done' flag so don't see this.
+				 */
+				int sig = WTERMSIG(result);
+				log_message(LOG_ERR, "test binary %s was killed by uncaught signal %d", current->proc_name, sig);
+				current->ecode = ECHKILL;
+				current->is_done = TRUE;
+			}
+		}
+	}
+}
+
+/*
+ * Look for any child process having changed state. This call also removes
+ * them, so it stops programs such as 'top' reporting zombie processes. Only
+ * needed without pidfds, which reap each child as it ends.
+ */
+
+static void gather_children(void)
+{
+	int ret, err;
+	int result = 0;
+
+	do {
+		ret = waitpid(-1, &result, WNOHANG);
+		err = errno;
+
+		/* check result: */
+		/* ret < 0                      => error */
+		/* ret == 0                     => no more child returned, however we may already have caught the actual child */
+		/* WIFEXITED(result) == 0       => child did not exit normally but was killed by signal which was not caught */
+		/* WEXITSTATUS(result) != 0     => child returned an error code */
+
+		if (ret > 0) {
+			update_process(ret, result);
+		} else if (ret < 0 && err != ECHILD) {
+			log_message(LOG_ERR, "error getting child process %d = '%s'", err, strerror(err));
+		}
+	} while (ret > 0);
+}
+
+/*
+ * Arm the timer for the earliest time limit of a running test, if any.
+ */
+
+static void arm_timer(void)
+{
+	struct itimerspec its;
+	struct process *current;
+
+	if (timer_fd == -1)
+		return;
+
+	memset(&its, 0, sizeof(its));
+
+	for (current = process_head; current != NULL; current = current->next) {
+		if (current->is_done || current->deadline.tv_sec == 0)
+			continue;
+		if (its.it_value.tv_sec == 0 || timespeccmp(&current->deadline, &its.it_value, <))
+			its.it_value = current->deadline;
+	}
+
+	if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+		int err = errno;
+		log_message(LOG_ERR, "cannot arm test-binary timer (errno = %d = '%s')", err, strerror(err));
+	}
+}
+
+/* See if any test processes have exceeded the timeout */
+static int check_timeouts(int timeout)
+{
+	struct process *current;
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	current = process_head;
+	while (current != NULL) {
+		if (current->is_done == FALSE && current->deadline.tv_sec != 0 && timespeccmp(&current->deadline, &now, <=)) {
+			/* Process has timed-out, kill it and report this. */
+			kill_process_tree(current->pid, SIGKILL);
+			current->is_done = TRUE;
+			current->ecode = ETOOLONG;
+			log_message(LOG_ERR, "test-binary %s exceeded time limit %d", current->proc_name, timeout);
+		}
+		current = current->next;
+	}
+	return (ENOERR);
+}
+
+/*
+ * Called by the scheduler when a test's time is up.
+ */
+
+static void timer_expired(int fd, void *unused)
+{
+	uint64_t expired;
+
+	if (read(fd, &expired, sizeof(expired)) < 0 && errno != EAGAIN) {
+		log_message(LOG_ERR, "read of test-binary timer gave errno = %d = '%s'", errno, strerror(errno));
+	}
+
+	check_timeouts(test_timeout);
+	arm_timer();
+}
+
+/*
+ * Called by the scheduler when the test child 'ptr' has ended. The pid is
+ * ours until reaped, so waitpid() on it is safe even if its entry is gone.
+ */
+
+static void child_exited(int fd, void *ptr)
+{
+	pid_t pid = (pid_t)(intptr_t)ptr;
+	int result = 0;
+	pid_t ret = waitpid(pid, &result, WNOHANG);
+
+	if (ret == 0)
+		return;
+
+	sched_del_fd(fd);
+	close(fd);
+
+	/* Already reaped by gather_children() if we had to fall back to it. */
+	if (ret > 0)
+		update_process(pid, result);
+	arm_timer();
+}
+
+/*
+ * Follow the child 'pid' with a pidfd. If we cannot, go back to polling
+ * for all children and return FALSE.
+ */
+
+static int follow_child(pid_t pid)
+{
+	int fd;
+
+	if (!use_pidfd)
+		return FALSE;
+
+	if (timer_fd == -1) {
+		timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (timer_fd < 0) {
+			use_pidfd = FALSE;
+			return FALSE;
+		}
+		if (sched_add_fd(timer_fd, timer_expired, NULL) != ENOERR) {
+			close(timer_fd);
+			timer_fd = -1;
+			use_pidfd = FALSE;
+			return FALSE;
+		}
+	}
+
+	fd = syscall(__NR_pidfd_open, pid, 0);
+	if (fd < 0) {
+		int err = errno;
+		log_message((err == ENOSYS) ? LOG_DEBUG : LOG_ERR, "cannot open pidfd (errno = %d = '%s'), polling for test binaries", err, strerror(err));
+		use_pidfd = FALSE;
+		return FALSE;
+	}
+
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	if (sched_add_fd(fd, child_exited, (void *)(intptr_t)pid) != ENOERR) {
+		close(fd);
+		use_pidfd = FALSE;
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/*
+ * Start 'tbinary' with its output going to the log files.
+ */
+
+static int spawn_test(char *tbinary, int version, pid_t *pid)
+{
+	posix_spawn_file_actions_t fa;
+	char *argv[3];
+	int err;
+
+	argv[0] = tbinary;
+	argv[1] = (version == 0) ? NULL : "test";
+	argv[2] = NULL;
+
+	posix_spawn_file_actions_init(&fa);
+
+	/* Don't want the stdout and stderr of our test program
+	 * to cause trouble, so make them go to their respective files */
+	err = reopen_std_actions(&fa, FLAG_REOPEN_STD_TEST);
+	if (err == 0)
+		err = cgroup_spawn(pid, tbinary, &fa, argv);
+
+	posix_spawn_file_actions_destroy(&fa);
+
+	return err;
+}
+
+
+/*
+ * Report on any past child processes. Return values are:
+ *
+ * 0 = TEST_RUNNING   = child of this name still running.
+ * 1 = TEST_COMPLETED = child has stopped, can use result.
+ * 2 = TEST_BLANK     = nothing in list, safe to run test program.
+ *
+ * So if zero returned, then don't try another child instance but
+ * return ENOERR until we get an answer.
+ *
+ * In both other cases (1 or 2) you can start another child but maybe
+ * not such a wise thing to do if there is an error condition.
+ */
+
+static int check_processes(const char *name, int *ecode)
+{
+	struct process *current;
+
+	current = process_head;
+	while (current != NULL) {
+		if (!strcmp(current->proc_name, name)) {
+			/* Process still in list, but is it finished or not? */
+			if (current->is_done == FALSE) {
+				/* Still running. */
+				return (TEST_RUNNING);
+			} else {
+				/* Process has terminated (or we killed it on time-out), so return
+				 * any error code and remove from list. We must return at this point,
+				 * or the loop will access freed memory for 'current->next' below.
+				 */
+				*ecode = current->ecode;
+				remove_process(current->pid);
+				return (TEST_COMPLETED);
+			}
+		}
+		current = current->next;
+	}
+	/* No match. */
+	return (TEST_BLANK);
+}
+
+/*
+ * execute test binary
+ *
+ * This has no intentional delay, so basically starts the child process asynchronously and
+ * the next call with the same 'tbinary' name will return any error results, or start
+ * another (if last one finished normally). While waiting (or no new run) the return
+ * value is EDONTKNOW to make the job of the retry-timer workable.
+ *
+ * A time-out of zero will disable the time-out checking, but in that case a blocked child
+ * will simply persist indefinitely and no error will be found.
+ */
+int check_bin(char *tbinary, int timeout, int version)
+{
+	pid_t child_pid;
+	int ecode = EDONTKNOW;
+	int err;
+
+	/* Call this before test on 'tbinary' so ANY early returns can be
+	 * gathered (less zombie process reported that way).
+	 */
+	if (!use_pidfd)
+		gather_children();
+
+	if (timeout > 0 && timer_fd == -1)
+		check_timeouts(timeout);
+
+	if (tbinary == NULL)
+		return ENOERR;
+
+	if (check_processes(tbinary, &ecode) == TEST_RUNNING) {
+		/* The process 'tbinary' is still running. */
+		return EDONTKNOW;
+	}
+
+	err = spawn_test(tbinary, version, &child_pid);
+	if (err == EAGAIN || err == ENOMEM) {
+		/* As for a failed fork(), things are bad so reboot. */
+		log_message(LOG_ERR, "process spawn failed with error = %d = '%s'", err, strerror(err));
+		return (EREBOOT);
+	} else if (err != 0) {
+		/* Could not be run, as the child's exit code would have said. */
+		log_message(LOG_ERR, "cannot run test binary %s (errno = %d = '%s')", tbinary, err, strerror(err));
+		return (err);
+	} else {
+		/* spawn was okay, add child to process list */
+		err = add_process(tbinary, child_pid, timeout);
+		/* if that failed, report it instead of exit code. */
+		if (err) {
+			ecode = err;
+		} else {
+			follow_child(child_pid);
+			arm_timer();
+		}
+	}
+
+	return ecode;
+}
@@ -0,0 +1,290 @@
+/* > testdir.c
+ *
+ * Follow the test directory with inotify, so test/repair binaries put there
+ * while running are picked up and those taken away are no longer run. Each
+ * event only looks at the one file it is about, with the same rules as the
+ * scan made when reading the configuration. If the kernel's event queue
+ * overflows we fall back to scanning the directory once. The parent is
+ * watched as well, so a directory that is not there yet, or is deleted or
+ * moved away, is followed again once it is created or moved back.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/inotify.h>
+
+#include "extern.h"
+#include "watch_err.h"
+#include "read-conf.h"
+
+#define WATCH_EVENTS	(IN_CLOSE_WRITE | IN_MOVED_TO | IN_ATTRIB | IN_DELETE | IN_MOVED_FROM \
+			| IN_DELETE_SELF | IN_MOVE_SELF)
+#define PARENT_EVENTS	(IN_CREATE | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+
+static int inotify_fd = -1;
+static int dir_wd = -1;			/* -1 while the directory is not there. */
+static int parent_wd = -1;
+static char *watch_dir = NULL;
+static const char *dir_base = NULL;	/* Points into watch_dir. */
+static void (*on_add)(struct list *act) = NULL;
+static void (*on_remove)(struct list *act) = NULL;
+
+/* ================================================================= */
+
+/*
+ * Entries from the test directory are those of version 1, "test-binary"
+ * lines of the configuration file give version 0.
+ */
+
+static struct list *find_binary(const char *fname)
+{
+	struct list *act;
+
+	for (act = tr_bin_list; act != NULL; act = act->next) {
+		if (act->version == 1 && strcmp(act->name, fname) == 0)
+			return act;
+	}
+
+	return NULL;
+}
+
+/*
+ * Bring the list up to date for the file 'name' of the directory.
+ */
+
+static void update_binary(const char *name)
+{
+	char fname[PATH_MAX];
+	struct list *act;
+	int usable;
+
+	if (snprintf(fname, sizeof(fname), "%s/%s", watch_dir, name) >= (int)sizeof(fname))
+		return;
+
+	usable = test_binary_usable(fname, name);
+	act = find_binary(fname);
+
+	if (usable && act == NULL) {
+		log_message(LOG_INFO, "adding %s to list of auto-repair binaries", fname);
+		add_list(&tr_bin_list, fname, 1);
+		act = list_tail(&tr_bin_list);
+		if (act != NULL && on_add != NULL)
+			on_add(act);
+	} else if (!usable && act != NULL) {
+		log_message(LOG_INFO, "removing %s from list of auto-repair binaries", fname);
+		if (on_remove != NULL)
+			on_remove(act);
+		remove_list(&tr_bin_list, act);
+	}
+}
+
+/*
+ * Look at every file, for when events may have been lost.
+ */
+
+static void rescan(void)
+{
+	struct list *act, *next;
+	struct dirent *de;
+	DIR *d;
+
+	d = opendir(watch_dir);
+	if (d != NULL) {
+		while ((de = readdir(d)) != NULL) {
+			if (strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0)
+				update_binary(de->d_name);
+		}
+		closedir(d);
+	}
+
+	/* And those that have gone without trace. */
+	for (act = tr_bin_list; act != NULL; act = next) {
+		const char *slash = strrchr(act->name, '/');
+
+		next = act->next;
+		if (act->version == 1 && slash != NULL && !test_binary_usable(act->name, slash + 1)) {
+			log_message(LOG_INFO, "removing %s from list of auto-repair binaries", act->name);
+			if (on_remove != NULL)
+				on_remove(act);
+			remove_list(&tr_bin_list, act);
+		}
+	}
+}
+
+/*
+ * Watch the directory itself, for when it comes (back).
+ */
+
+static int watch_testdir(void)
+{
+	dir_wd = inotify_add_watch(inotify_fd, watch_dir, WATCH_EVENTS | IN_ONLYDIR);
+	if (dir_wd < 0) {
+		int err = errno;
+		dir_wd = -1;
+		return err;
+	}
+
+	return ENOERR;
+}
+
+/*
+ * The directory has been deleted or moved away, drop its binaries and wait
+ * for it on the parent's watch. It may already be back.
+ */
+
+static void lost_testdir(uint32_t mask)
+{
+	/* A moved directory is still watched under its new name. */
+	if (mask & IN_MOVE_SELF)
+		inotify_rm_watch(inotify_fd, dir_wd);
+	dir_wd = -1;
+
+	log_message(LOG_WARNING, "test directory %s has gone, following it again when it is back", watch_dir);
+	rescan();
+
+	if (watch_testdir() == ENOERR)
+		rescan();
+}
+
+/*
+ * Called by the scheduler when there are events to read.
+ */
+
+static void testdir_input(int fd, void *unused)
+{
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+	while (1) {
+		ssize_t len = read(fd, buf, sizeof(buf));
+		char *ptr;
+
+		if (len < 0) {
+			int err = errno;
+			if (err != EAGAIN && err != EINTR) {
+				log_message(LOG_ERR, "read of test directory events gave errno = %d = '%s'", err, strerror(err));
+			}
+			break;
+		}
+
+		for (ptr = buf; ptr < buf + len; ) {
+			const struct inotify_event *ev = (const struct inotify_event *)ptr;
+
+			ptr += sizeof(struct inotify_event) + ev->len;
+
+			if (ev->mask & IN_Q_OVERFLOW) {
+				log_message(LOG_WARNING, "test directory events lost, scanning %s", watch_dir);
+				if (dir_wd == -1)
+					watch_testdir();
+				rescan();
+			} else if (dir_wd != -1 && ev->wd == dir_wd) {
+				if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED))
+					lost_testdir(ev->mask);
+				else if (ev->len > 0)
+					update_binary(ev->name);
+			} else if (ev->wd == parent_wd) {
+				if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+					log_message(LOG_WARNING, "parent of test directory %s has gone, no longer following it", watch_dir);
+					rescan();
+					close_testdir();
+					return;
+				}
+				if (dir_wd == -1 && ev->len > 0 && strcmp(ev->name, dir_base) == 0 && watch_testdir() == ENOERR) {
+					log_message(LOG_INFO, "test directory %s is back, following it again", watch_dir);
+					rescan();
+				}
+			}
+		}
+	}
+}
+
+/* ================================================================= */
+
+/*
+ * Start following the directory 'path', which need not be there yet, if
+ * it has an absolute name. The functions are called for a binary added to
+ * 'tr_bin_list' and for one just before it is taken out. Call after
+ * open_sched().
+ */
+
+int open_testdir(const char *path, void (*added)(struct list *act), void (*removed)(struct list *act))
+{
+	char parent[PATH_MAX];
+	const char *slash;
+	int err;
+
+	close_testdir();
+
+	if (path == NULL)
+		return ENOERR;
+
+	/* Only absolute paths, the daemon changes directory. */
+	slash = strrchr(path, '/');
+	if (path[0] != '/' || slash[1] == '\0')
+		return EINVAL;
+
+	inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (inotify_fd < 0) {
+		err = errno;
+		log_message(LOG_ERR, "cannot create inotify instance (errno = %d = '%s')", err, strerror(err));
+		return err;
+	}
+
+	watch_dir = xstrdup(path);
+	dir_base = watch_dir + (slash + 1 - path);
+
+	snprintf(parent, sizeof(parent), "%.*s", (slash == path) ? 1 : (int)(slash - path), path);
+	parent_wd = inotify_add_watch(inotify_fd, parent, PARENT_EVENTS | IN_ONLYDIR);
+	err = watch_testdir();
+
+	if (parent_wd < 0 && err != ENOERR) {
+		/* No directory, no test binaries. */
+		if (err != ENOENT && err != ENOTDIR) {
+			log_message(LOG_ERR, "cannot follow test directory %s (errno = %d = '%s')", path, err, strerror(err));
+		}
+		close_testdir();
+		return err;
+	}
+
+	err = sched_add_fd(inotify_fd, testdir_input, NULL);
+	if (err != ENOERR) {
+		close_testdir();
+		return err;
+	}
+
+	on_add = added;
+	on_remove = removed;
+
+	/* Anything that came or went since the configuration was read. */
+	rescan();
+
+	if (verbose)
+		log_message(LOG_DEBUG, "following test directory %s", path);
+
+	return ENOERR;
+}
+
+int close_testdir(void)
+{
+	if (inotify_fd == -1)
+		return 0;
+
+	sched_del_fd(inotify_fd);
+	close(inotify_fd);
+	inotify_fd = -1;
+	dir_wd = parent_wd = -1;
+
+	free(watch_dir);
+	watch_dir = NULL;
+	dir_base = NULL;
+
+	return 0;
+}
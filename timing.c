@@ -0,0 +1,158 @@
+/* > timing.c
+ *
+ * Timing histograms for the checks: one per type of check (each scheduled
+ * item also has its own), plus the whole cycle and the interval between
+ * refreshes of the watchdog device. Dumped to the log on SIGUSR1 and at
+ * exit, to find out what is using up the loop's time budget.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include <signal.h>
+
+#include "extern.h"
+#include "watch_err.h"
+
+#define MAX_TYPES	32
+
+struct check_type {
+	const char *name;
+	struct hist hist;
+};
+
+static struct check_type types[MAX_TYPES];
+static int num_types = 0;
+static struct hist cycle_hist;
+
+static volatile sig_atomic_t dump_wanted = FALSE;
+
+/* ================================================================= */
+
+/*
+ * Return the histogram for the type of check 'name', adding it if need be.
+ * Types beyond the table size share the last entry.
+ */
+
+struct hist *timing_type(const char *name)
+{
+	int ii;
+
+	for (ii = 0; ii < num_types; ii++) {
+		if (strcmp(types[ii].name, name) == 0)
+			return &types[ii].hist;
+	}
+
+	if (num_types < MAX_TYPES) {
+		types[num_types].name = name;
+		return &types[num_types++].hist;
+	}
+
+	types[MAX_TYPES - 1].name = "<other>";
+	return &types[MAX_TYPES - 1].hist;
+}
+
+/*
+ * Record the wall time of one batch of checks.
+ */
+
+void timing_cycle(long long nsec)
+{
+	hist_add(&cycle_hist, nsec);
+}
+
+/*
+ * Log one histogram: count, average, maximum, approximate percentiles
+ * (bucket upper bounds) and the non-empty buckets as "<=bound:count".
+ */
+
+void hist_log(const char *what, const struct hist *h)
+{
+	char buf[HIST_BUCKETS * 24];
+	unsigned long pct[3], cum = 0;
+	long long pval[3] = {0, 0, 0};
+	int ii, jj, len = 0;
+
+	if (h->count == 0)
+		return;
+
+	pct[0] = (h->count * 50 + 99) / 100;
+	pct[1] = (h->count * 90 + 99) / 100;
+	pct[2] = (h->count * 99 + 99) / 100;
+
+	buf[0] = '\0';
+	for (ii = 0; ii < HIST_BUCKETS; ii++) {
+		if (h->bucket[ii] == 0)
+			continue;
+
+		cum += h->bucket[ii];
+		for (jj = 0; jj < 3; jj++) {
+			if (pval[jj] == 0 && cum >= pct[jj])
+				pval[jj] = (ii < HIST_BUCKETS - 1) ? hist_bound(ii) : h->max / 1000;
+		}
+
+		if (ii < HIST_BUCKETS - 1)
+			len += snprintf(buf + len, sizeof(buf) - len, " <%lldus:%lu", hist_bound(ii), h->bucket[ii]);
+		else
+			len += snprintf(buf + len, sizeof(buf) - len, " >%lldus:%lu", hist_bound(ii - 1), h->bucket[ii]);
+		if (len >= (int)sizeof(buf))
+			break;
+	}
+
+	log_message(LOG_INFO, "timing %s: n=%lu avg=%.3f ms max=%.3f ms p50/p90/p99<=%.3f/%.3f/%.3f ms%s",
+		what, h->count, 1.0e-6 * h->sum / h->count, 1.0e-6 * h->max,
+		1.0e-3 * pval[0], 1.0e-3 * pval[1], 1.0e-3 * pval[2], buf);
+}
+
+/*
+ * Log all of the histograms, the per-entry ones only when verbose.
+ */
+
+void timing_log_stats(void)
+{
+	struct hist ka;
+	int ii;
+
+	hist_log("cycle", &cycle_hist);
+
+	keep_alive_hist(&ka);
+	hist_log("keep-alive interval", &ka);
+
+	for (ii = 0; ii < num_types; ii++) {
+		hist_log(types[ii].name, &types[ii].hist);
+	}
+
+	if (verbose)
+		sched_log_timing();
+}
+
+/*
+ * SIGUSR1 asks for a dump, which the main loop does between batches so
+ * no check is updating the histograms while they are logged.
+ */
+
+static void sigusr1_handler(int arg)
+{
+	dump_wanted = TRUE;
+}
+
+void timing_init(void)
+{
+	struct sigaction sa;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sigusr1_handler;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGUSR1, &sa, NULL);
+}
+
+void timing_check_dump(void)
+{
+	if (dump_wanted) {
+		dump_wanted = FALSE;
+		timing_log_stats();
+	}
+}
@@ -0,0 +1,454 @@
+/*************************************************************/
+/* Scale benchmark for the watchdog daemon.                  */
+/*                                                           */
+/* Runs the real daemon against a FIFO standing in for the   */
+/* watchdog device, with generated configurations holding    */
+/* 10, 100, ... entries of each type of check, and reports   */
+/* start-up time, cycle time, refresh jitter and CPU use.    */
+/*                                                           */
+/*************************************************************/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#define _GNU_SOURCE	/* For wait4() */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <libgen.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define MAX_COUNTS	16
+
+/* Types of check we can generate, see write_config(). */
+#define T_PIDFILE	0x01
+#define T_FILE		0x02
+#define T_IFACE		0x04
+#define T_TEST		0x08
+#define T_PING		0x10
+
+static const struct {
+	const char *name;
+	int flag;
+} type_names[] = {
+	{"pidfile", T_PIDFILE},
+	{"file", T_FILE},
+	{"interface", T_IFACE},
+	{"test", T_TEST},
+	{"ping", T_PING},
+};
+
+/* Refresh time-stamps recorded from the FIFO, by the reader thread. */
+static struct timespec *stamps = NULL;
+static size_t num_stamps = 0;
+static size_t max_stamps = 0;
+static volatile int reader_stop = 0;
+static int fifo_fd = -1;
+
+struct result {
+	int entries;
+	double parse;		/* ms for read_config(), as reported by the daemon */
+	double startup;		/* ms from exec to first refresh */
+	double cycle_avg;	/* ms, as reported by the daemon */
+	double cycle_max;
+	double refresh_avg;	/* ms between refreshes */
+	double jitter_sd;
+	double jitter_max;	/* worst deviation from the interval, ms */
+	double cpu_cycle;	/* ms of CPU per refresh interval */
+	int status;
+};
+
+static void usage(char *progname)
+{
+	fprintf(stderr, "%s usage:\n", progname);
+	fprintf(stderr, "%s [options]\n", progname);
+	fprintf(stderr, "options:\n");
+	fprintf(stderr, "  -w <path>      watchdog binary to run (default ./watchdog)\n");
+	fprintf(stderr, "  -n <n,n,...>   entries of each type to test (default 10,100,10000)\n");
+	fprintf(stderr, "  -t <type,...>  pidfile, file, interface, test, ping (default pidfile,file)\n");
+	fprintf(stderr, "  -c <number>    refresh intervals to run for (default 10)\n");
+	fprintf(stderr, "  -i <seconds>   interval (default 1)\n");
+	fprintf(stderr, "  -j <number>    check-threads for the daemon (default 0)\n");
+	fprintf(stderr, "  -k             keep the generated files\n");
+	exit(1);
+}
+
+static double ts_msec(const struct timespec *ts)
+{
+	return 1.0e3 * ts->tv_sec + 1.0e-6 * ts->tv_nsec;
+}
+
+static double tv_msec(const struct timeval *tv)
+{
+	return 1.0e3 * tv->tv_sec + 1.0e-3 * tv->tv_usec;
+}
+
+static void fail(const char *what)
+{
+	fprintf(stderr, "watchdog-bench: %s (errno = %d = '%s')\n", what, errno, strerror(errno));
+	exit(1);
+}
+
+/*
+ * Read the FIFO, one time-stamp per byte written by the daemon. The FIFO
+ * is opened non-blocking so we do not wait for a writer that never comes.
+ */
+
+static void *reader_main(void *unused)
+{
+	char buf[256];
+
+	while (!reader_stop) {
+		struct pollfd pfd = {fifo_fd, POLLIN, 0};
+		struct timespec now;
+		ssize_t ii, len;
+
+		if (poll(&pfd, 1, 50) <= 0)
+			continue;
+
+		len = read(fifo_fd, buf, sizeof(buf));
+		if (len <= 0) {
+			/* No writer (yet, or any more). */
+			usleep(10000);
+			continue;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		for (ii = 0; ii < len; ii++) {
+			/* Only keep-alives count, not the magic-close 'V' written at exit. */
+			if (buf[ii] != '\0')
+				continue;
+			if (num_stamps >= max_stamps) {
+				max_stamps = max_stamps ? 2 * max_stamps : 1024;
+				stamps = realloc(stamps, max_stamps * sizeof(*stamps));
+				if (stamps == NULL)
+					fail("out of memory");
+			}
+			stamps[num_stamps++] = now;
+		}
+	}
+
+	return NULL;
+}
+
+static FILE *open_file(const char *dir, const char *name, char *path, size_t size)
+{
+	FILE *fp;
+
+	snprintf(path, size, "%s/%s", dir, name);
+	fp = fopen(path, "w");
+	if (fp == NULL)
+		fail(path);
+
+	return fp;
+}
+
+/*
+ * Generate the configuration with 'entries' of each type in 'types', plus
+ * the files for the pidfile, file and test-binary entries to look at.
+ */
+
+static void write_config(const char *dir, int entries, int types, int interval, int threads)
+{
+	char path[PATH_MAX];
+	FILE *cf, *fp;
+	int ii;
+
+	cf = open_file(dir, "watchdog.conf", path, sizeof(path));
+	fprintf(cf, "watchdog-device = %s/dev\n", dir);
+	fprintf(cf, "interval = %d\n", interval);
+	fprintf(cf, "log-dir = %s/log\n", dir);
+	fprintf(cf, "check-threads = %d\n", threads);
+
+	if (types & T_TEST) {
+		fp = open_file(dir, "test.sh", path, sizeof(path));
+		fprintf(fp, "#!/bin/sh\nexit 0\n");
+		fclose(fp);
+		chmod(path, 0755);
+	}
+
+	for (ii = 0; ii < entries; ii++) {
+		char name[64];
+
+		if (types & T_PIDFILE) {
+			snprintf(name, sizeof(name), "pid.%d", ii);
+			fp = open_file(dir, name, path, sizeof(path));
+			fprintf(fp, "%d\n", (int)getpid());
+			fclose(fp);
+			fprintf(cf, "pidfile = %s\n", path);
+		}
+
+		if (types & T_FILE) {
+			snprintf(name, sizeof(name), "file.%d", ii);
+			fp = open_file(dir, name, path, sizeof(path));
+			fclose(fp);
+			fprintf(cf, "file = %s\n", path);
+		}
+
+		if (types & T_IFACE)
+			fprintf(cf, "interface = lo\n");
+
+		if (types & T_PING)
+			fprintf(cf, "ping = 127.0.0.1\n");
+
+		if (types & T_TEST)
+			fprintf(cf, "test-binary = %s/test.sh\n", dir);
+	}
+
+	fclose(cf);
+}
+
+/*
+ * Pick the daemon's own config parse time and cycle statistics out of its
+ * log output.
+ */
+
+static void parse_log(const char *dir, struct result *res)
+{
+	char path[PATH_MAX], line[1024];
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "%s/stderr", dir);
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return;
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		char *ptr = strstr(line, "check cycles:");
+		unsigned long n;
+		int lines;
+
+		if (strstr(line, " config: ") != NULL)
+			sscanf(strstr(line, " config: "), " config: %d lines read in %lf ms", &lines, &res->parse);
+
+		if (ptr != NULL)
+			sscanf(ptr, "check cycles: %lu, wall time avg %lf ms max %lf ms", &n, &res->cycle_avg, &res->cycle_max);
+	}
+
+	fclose(fp);
+}
+
+static void run_one(const char *wdbin, const char *dir, int entries, int types, int cycles, int interval,
+		    int threads, struct result *res)
+{
+	char conf[PATH_MAX], path[PATH_MAX], count[32];
+	struct timespec t0;
+	struct rusage ru;
+	pthread_t reader;
+	double sum = 0.0, sum2 = 0.0, worst = 0.0;
+	size_t ii, n;
+	pid_t pid;
+	int status;
+
+	memset(res, 0, sizeof(*res));
+	res->entries = entries;
+
+	write_config(dir, entries, types, interval, threads);
+
+	snprintf(path, sizeof(path), "%s/dev", dir);
+	if (mkfifo(path, 0600) < 0 && errno != EEXIST)
+		fail(path);
+
+	fifo_fd = open(path, O_RDONLY | O_NONBLOCK);
+	if (fifo_fd < 0)
+		fail(path);
+
+	num_stamps = 0;
+	reader_stop = 0;
+	if (pthread_create(&reader, NULL, reader_main, NULL) != 0)
+		fail("pthread_create");
+
+	snprintf(conf, sizeof(conf), "%s/watchdog.conf", dir);
+	snprintf(count, sizeof(count), "%d", cycles);
+	snprintf(path, sizeof(path), "%s/stderr", dir);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	pid = fork();
+	if (pid < 0)
+		fail("fork");
+
+	if (pid == 0) {
+		int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+
+		if (fd >= 0) {
+			dup2(fd, STDOUT_FILENO);
+			dup2(fd, STDERR_FILENO);
+			close(fd);
+		}
+		close(fifo_fd);
+		/* No action, so failing checks cannot reboot the test system. */
+		execl(wdbin, wdbin, "-F", "-f", "-q", "-X", count, "-c", conf, (char *)NULL);
+		_exit(127);
+	}
+
+	if (wait4(pid, &status, 0, &ru) < 0)
+		fail("wait4");
+
+	usleep(100000);
+	reader_stop = 1;
+	pthread_join(reader, NULL);
+	close(fifo_fd);
+
+	res->status = status;
+	parse_log(dir, res);
+
+	if (num_stamps > 0) {
+		struct timespec d;
+
+		d.tv_sec = stamps[0].tv_sec - t0.tv_sec;
+		d.tv_nsec = stamps[0].tv_nsec - t0.tv_nsec;
+		res->startup = ts_msec(&d);
+	}
+
+	for (ii = 1, n = 0; ii < num_stamps; ii++, n++) {
+		double dt = ts_msec(&stamps[ii]) - ts_msec(&stamps[ii - 1]);
+		double dev = fabs(dt - 1000.0 * interval);
+
+		sum += dt;
+		sum2 += dt * dt;
+		if (dev > worst)
+			worst = dev;
+	}
+
+	if (n > 0) {
+		res->refresh_avg = sum / n;
+		res->jitter_sd = sqrt(fmax(0.0, sum2 / n - res->refresh_avg * res->refresh_avg));
+		res->jitter_max = worst;
+	}
+
+	res->cpu_cycle = (tv_msec(&ru.ru_utime) + tv_msec(&ru.ru_stime)) / cycles;
+}
+
+/*
+ * Remove what write_config() and the daemon made, leaving the directory.
+ */
+
+static void clean_dir(const char *dir)
+{
+	char cmd[PATH_MAX + 32];
+
+	snprintf(cmd, sizeof(cmd), "rm -rf '%s'/*", dir);
+	if (system(cmd) != 0)
+		fprintf(stderr, "watchdog-bench: failed to clean %s\n", dir);
+}
+
+static int parse_types(char *arg)
+{
+	char *tok, *save = NULL;
+	int types = 0;
+
+	for (tok = strtok_r(arg, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+		size_t ii;
+
+		for (ii = 0; ii < sizeof(type_names) / sizeof(type_names[0]); ii++) {
+			if (strcmp(tok, type_names[ii].name) == 0)
+				break;
+		}
+		if (ii == sizeof(type_names) / sizeof(type_names[0])) {
+			fprintf(stderr, "watchdog-bench: unknown type '%s'\n", tok);
+			exit(1);
+		}
+		types |= type_names[ii].flag;
+	}
+
+	return types;
+}
+
+int main(int argc, char *argv[])
+{
+	char *progname = basename(argv[0]);
+	char *wdbin = "./watchdog";
+	char dir[] = "/tmp/wdbench.XXXXXX";
+	int counts[MAX_COUNTS] = {10, 100, 10000};
+	int num_counts = 3;
+	int types = T_PIDFILE | T_FILE;
+	int cycles = 10, interval = 1, threads = 0, keep = 0;
+	int c, ii;
+
+	while ((c = getopt(argc, argv, "w:n:t:c:i:j:kh")) != EOF) {
+		switch (c) {
+		case 'w':
+			wdbin = optarg;
+			break;
+		case 'n': {
+			char *tok, *save = NULL;
+
+			num_counts = 0;
+			for (tok = strtok_r(optarg, ",", &save); tok != NULL && num_counts < MAX_COUNTS;
+			     tok = strtok_r(NULL, ",", &save)) {
+				counts[num_counts++] = atoi(tok);
+			}
+			break;
+		}
+		case 't':
+			types = parse_types(optarg);
+			break;
+		case 'c':
+			cycles = atoi(optarg);
+			break;
+		case 'i':
+			interval = atoi(optarg);
+			break;
+		case 'j':
+			threads = atoi(optarg);
+			break;
+		case 'k':
+			keep = 1;
+			break;
+		default:
+			usage(progname);
+		}
+	}
+
+	if (cycles < 2 || interval < 1 || num_counts == 0)
+		usage(progname);
+
+	if (access(wdbin, X_OK) != 0)
+		fail(wdbin);
+
+	if (mkdtemp(dir) == NULL)
+		fail("mkdtemp");
+
+	signal(SIGPIPE, SIG_IGN);
+
+	printf("%8s %10s %10s %10s %10s %10s %10s %10s %10s\n",
+	       "entries", "parse ms", "start ms", "cycle avg", "cycle max", "refresh", "jitter sd", "jitter max", "cpu/cycle");
+
+	for (ii = 0; ii < num_counts; ii++) {
+		struct result res;
+
+		run_one(wdbin, dir, counts[ii], types, cycles, interval, threads, &res);
+
+		printf("%8d %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f",
+		       res.entries, res.parse, res.startup, res.cycle_avg, res.cycle_max,
+		       res.refresh_avg, res.jitter_sd, res.jitter_max, res.cpu_cycle);
+		if (!WIFEXITED(res.status) || WEXITSTATUS(res.status) != 0)
+			printf("  (daemon status 0x%x, see %s/stderr)", res.status, dir);
+		printf("\n");
+		fflush(stdout);
+
+		if (!keep && WIFEXITED(res.status) && WEXITSTATUS(res.status) == 0)
+			clean_dir(dir);
+	}
+
+	if (!keep)
+		rmdir(dir);
+
+	free(stamps);
+	return 0;
+}
@@ -42,6 +42,26 @@
 #include "read-conf.h"
 
 static int no_act = FALSE;
+static int sync_it = FALSE;
+static long count = 0L;
+static long count_max = 0L;
+static int ping_fd = -1;
+
+/*
+ * A "device" that is not a character device (a FIFO or plain file used
+ * for testing) cannot reset anything, so it is safe to open even when
+ * running with --no-action.
+ */
+
+static int stand_in_device(const char *name)
+{
+	struct stat st;
+
+	if (name == NULL || stat(name, &st) < 0)
+		return FALSE;
+
+	return !S_ISCHR(st.st_mode);
+}
 
 static void usage(char *progname)
 {
@@ -98,7 +118,9 @@ static int repair(char *rbinary, int result, char *name, int version)
 	if (arg[0] == NULL)
 		return (result);
 
-	ret = run_func_as_child(repair_timeout, exec_as_func, FLAG_REOPEN_STD_REPAIR, arg);
+	cgroup_prepare(arg[0]);
+	ret = run_func_as_child(repair_timeout, exec_in_cgroup, FLAG_REOPEN_STD_REPAIR, arg);
+	cgroup_collect(arg[0]);
 
 	/* check result */
 	if (ret != 0) {
@@ -108,7 +130,7 @@ static int repair(char *rbinary, int result, char *name, int version)
 	return (ret);
 }
 
-static int attempt_repair(int result, char *rbinary, struct list *act)
+static int attempt_repair(int result, char *rbinary, struct list *act, const char *type)
 {
 	int version = 0;
 	char *name = NULL;
@@ -127,18 +149,22 @@ static int attempt_repair(int result, char *rbinary, struct list *act)
 		rbinary = name;
 	}
 
+	/* A repair can be left to the queue, if there is one. */
+	if (act != NULL && queue_repair(act, type, rbinary, &result, version))
+		return result;
+
 	/* Check for re-try options. */
 	if (act != NULL && retry_timeout > 0) {
 		/* timer possible and used to allow re-try */
 		time_t now = gettime();
 		timeout = FALSE;
 
-		if (act->last_time == 0) {
+		if (act->state->last_time == 0) {
 			/* First offence, record time. */
-			act->last_time = now;
+			act->state->last_time = now;
 		} else {
 			/* timer running */
-			int tused = (int)(now - act->last_time);
+			int tused = (int)(now - act->state->last_time);
 
 			if (tused > retry_timeout) {
 				log_message(LOG_WARNING, "Retry timed-out at %d seconds for %s", tused,
@@ -156,22 +182,29 @@ static int attempt_repair(int result, char *rbinary, struct list *act)
 		int try_repair = TRUE;
 		/* check for too many failed repair attempts */
 		if (act != NULL && repair_max > 0) {
-			if (++act->repair_count > repair_max) {
+			if (++act->state->repair_count > repair_max) {
 				try_repair = FALSE;
 				log_message(LOG_WARNING, "Repair count exceeded (%d for %s)",
-					act->repair_count, act->name);
+					act->state->repair_count, act->name);
 			} else {
 				/* going to repair, reset re-try timer so same period for next try */
-				act->last_time = 0;
+				act->state->last_time = 0;
 				if (verbose) {
 					log_message(LOG_DEBUG, "Repair attempt %d for %s",
-						act->repair_count, act->name);
+						act->state->repair_count, act->name);
 				}
 			}
 		}
 
 		if (try_repair) {
-			result = repair(rbinary, result, name, version);
+			if (version == 2)
+				result = repair_plugin(act, result);
+			else if (version == 3)
+				result = repair_module(act, result);
+			else if (version == 0 && rbinary != NULL && batch_repair(act, type, result))
+				result = ENOERR;	/* Run at the end of the cycle. */
+			else
+				result = repair(rbinary, result, name, version);
 		}
 	} else {
 		/* Not yet timed out, so treat as "no error" for now. */
@@ -181,16 +214,47 @@ static int attempt_repair(int result, char *rbinary, struct list *act)
 return result;
 }
 
-static void wd_action(int result, char *rbinary, struct list *act)
+/*
+ * An error that could not be repaired: reboot, unless told not to. 'error'
+ * is that found by the check and 'result' what is left after any repair.
+ * A rise in temperature only warns of heat to come, so it never shuts the
+ * system down; that is left to ETOOHOT once it is too hot.
+ */
+
+static void give_up(struct list *act, int error, int result)
+{
+	if (error == ETEMPRISE) {
+		log_message(LOG_WARNING, "temperature rise for %s was not repaired (error %d = '%s'), carrying on",
+			(act != NULL) ? act->name : "sensor", result, wd_strerror(result));
+		return;
+	}
+
+	/* if no-action flag set, do nothing */
+	if (no_act) {
+		if (verbose) {
+			log_message(LOG_DEBUG, "Shutdown blocked by --no-action (error %d = '%s')",
+				result, wd_strerror(result));
+		}
+	} else {
+		publish_health(result);
+		do_shutdown(result);
+	}
+}
+
+static void wd_action(int result, char *rbinary, struct list *act, const char *type)
 {
+	int error = result;
+
+	if (result != ENOERR && result != EDONTKNOW)
+		metrics_count_error(result);
 
 	/* Decide on repair or return based on error code. */
 	switch (result) {
 	case ENOERR:
 		/* No error, reset any time-out. */
 		if (act != NULL) {
-			act->last_time = 0;
-			act->repair_count = 0;
+			act->state->last_time = 0;
+			act->state->repair_count = 0;
 		}
 		return;
 
@@ -207,28 +271,370 @@ static void wd_action(int result, char *rbinary, struct list *act)
 
 	default:
 		/* Error that might be repairable */
-		result = attempt_repair(result, rbinary, act);
+		result = attempt_repair(result, rbinary, act, type);
 		break;
 	}
 
 	/* if still error, consider reboot */
-	if (result != ENOERR) {
-		/* if no-action flag set, do nothing */
-		if (no_act) {
-			if (verbose) {
-				log_message(LOG_DEBUG, "Shutdown blocked by --no-action (error %d = '%s')",
-					result, wd_strerror(result));
-			}
-		} else {
-			do_shutdown(result);
-		}
+	if (result != ENOERR)
+		give_up(act, error, result);
+}
+
+/*
+ * Every repair from the queue of 'error' for 'act' has failed.
+ */
+
+static void repairs_failed(struct list *act, int error, int result)
+{
+	give_up(act, error, result);
+}
+
+static void do_check(int res, char *rbinary, struct list *act, const char *type)
+{
+	wd_action(res, rbinary, act, type);
+	wd_action(keep_alive(), rbinary, NULL, NULL);
+}
+
+/*
+ * Adapters so every check can be run by the scheduler with the same
+ * calling convention of one 'struct list' argument.
+ */
+
+static int run_file_table(struct list *act)
+{
+	return check_file_table();
+}
+
+static int run_load(struct list *act)
+{
+	return check_load();
+}
+
+static int run_memory(struct list *act)
+{
+	return check_memory();
+}
+
+static int run_allocatable(struct list *act)
+{
+	return check_allocatable();
+}
+
+/*
+ * One slot of the ping round; when a round completes act on the verdict
+ * for every target in list order.
+ */
+
+static int run_ping(struct list *unused)
+{
+	struct list *act;
+
+	if (ping_slot()) {
+		for (act = target_list; act != NULL; act = act->next)
+			do_check(ping_result(act), repair_bin, act, "ping");
+	}
+
+	return ENOERR;
+}
+
+static int run_bin(struct list *act)
+{
+	if (act->version == 2)
+		return check_plugin(act);
+	if (act->version == 3)
+		return check_module(act);
+
+	return check_bin(act->name, test_timeout, act->version);
+}
+
+/*
+ * Once per 'tint' seconds: refresh the watchdog, sync if
+ * asked to, collect finished test binaries and do the interval counting.
+ */
+
+static int run_tick(struct list *unused)
+{
+	/* write to the watchdog device */
+	wd_action(keep_alive(), repair_bin, NULL, NULL);
+
+	/* sync system if we have to */
+	do_check(sync_system(sync_it), repair_bin, NULL, NULL);
+
+	/* pick up any test binaries that have finished */
+	check_bin(NULL, test_timeout, 0);
+
+	count++;
+
+	/* do verbose logging */
+	if (verbose && logtick && (--ticker == 0)) {
+		ticker = logtick;
+		log_message(LOG_DEBUG, "still alive after %ld interval(s)", count);
+		sched_log_stats();
+		pool_log_stats();
+		ping_log_stats();
+		diskprobe_log_stats();
 	}
+
+	if (count_max > 0 && count >= count_max) {
+		log_message(LOG_WARNING, "loop exit on interval counter reached");
+		_running = 0;
+	}
+
+	return ENOERR;
 }
 
-static void do_check(int res, char *rbinary, struct list *act)
+/*
+ * Interval for a list entry: its own if given, else that of the list type.
+ */
+
+static long entry_interval(struct list *act, int type_msec)
 {
-	wd_action(res, rbinary, act);
-	wd_action(keep_alive(), rbinary, NULL);
+	if (act->interval > 0)
+		return act->interval;
+
+	return type_msec;
+}
+
+/*
+ * The checks with one scheduled item per list entry, in the order they are
+ * registered (the ping targets go in between, see schedule_checks()).
+ */
+
+struct list_check {
+	const char *type;
+	struct list **list;
+	int (*func)(struct list *);
+	int *tint_type;		/* Interval for the type in ms, zero for 'tint'. */
+	int parallel;		/* Safe to run on a worker thread. */
+};
+
+static const struct list_check list_checks[] = {
+	/* check temperature */
+	{"temperature",	&temp_list,	check_temp,		&tint_temp,	TRUE},
+	/* in filemode stat file */
+	{"file",	&file_list,	check_file_stat_safe,	&tint_file,	FALSE},
+	/* in pidmode use "kill -0" to ping processes ID */
+	{"pidfile",	&pidfile_list,	check_pidfile,		&tint_pidfile,	TRUE},
+	/* in network mode check the given devices for input */
+	{"interface",	&iface_list,	check_iface,		&tint_iface,	TRUE},
+	/* test, or test/repair binaries in the watchdog.d directory */
+	{"test-binary",	&tr_bin_list,	run_bin,		&tint_test,	FALSE},
+};
+
+static const struct list_check *find_list_check(const char *type)
+{
+	int ii;
+
+	for (ii = 0; ii < ARRAY_SIZE(list_checks); ii++) {
+		if (strcmp(list_checks[ii].type, type) == 0)
+			return &list_checks[ii];
+	}
+
+	return NULL;
+}
+
+static void schedule_entry(const struct list_check *lc, struct list *act)
+{
+	sched_add(act->name, lc->type, lc->func, act, entry_interval(act, *lc->tint_type))->parallel = lc->parallel;
+}
+
+/*
+ * The checks that are not per list entry, except the tick and the ping round.
+ */
+
+static const struct {
+	const char *type;
+	int (*func)(struct list *);
+} fixed_checks[] = {
+	/* probe the write-file, if any */
+	{"write-file",	check_diskprobe},
+	/* check file table */
+	{"file-table",	run_file_table},
+	/* check load average */
+	{"load",	run_load},
+	/* check free memory */
+	{"memory",	run_memory},
+	/* check allocatable memory */
+	{"allocatable",	run_allocatable},
+};
+
+static int find_fixed_check(const char *type)
+{
+	int ii;
+
+	for (ii = 0; ii < ARRAY_SIZE(fixed_checks); ii++) {
+		if (strcmp(fixed_checks[ii].type, type) == 0)
+			return ii;
+	}
+
+	return -1;
+}
+
+/*
+ * Whether fixed check 'ii' is configured, and if so its name, entry and interval.
+ */
+
+static int fixed_config(int ii, const char **name, struct list **act, long *interval)
+{
+	const char *type = fixed_checks[ii].type;
+
+	if (strcmp(type, "write-file") == 0) {
+		*name = write_file;
+		*act = NULL;
+		*interval = 1000L * tint;
+		return (write_file != NULL);
+	}
+
+	if (strcmp(type, "file-table") == 0) {
+		*name = "<file-table>";
+		*act = NULL;
+		*interval = tint_ftable;
+		return TRUE;
+	}
+
+	if (strcmp(type, "load") == 0) {
+		*name = loadtimer->name;
+		*act = loadtimer;
+		*interval = tint_load;
+		return (maxload1 || maxload5 || maxload15);
+	}
+
+	if (strcmp(type, "memory") == 0) {
+		*name = memtimer->name;
+		*act = memtimer;
+		*interval = tint_memory;
+		return (minpages > 0 || maxswap > 0);
+	}
+
+	*name = alloctimer->name;
+	*act = alloctimer;
+	*interval = tint_alloc;
+	return (minalloc > 0);
+}
+
+/*
+ * Add the fixed checks that are configured, except those already scheduled
+ * (bit 'ii' of 'have' set for fixed_checks[ii]).
+ */
+
+static void schedule_fixed(unsigned int have)
+{
+	int ii;
+
+	for (ii = 0; ii < ARRAY_SIZE(fixed_checks); ii++) {
+		const char *name;
+		struct list *act;
+		long interval;
+
+		if (!(have & (1u << ii)) && fixed_config(ii, &name, &act, &interval))
+			sched_add(name, fixed_checks[ii].type, fixed_checks[ii].func, act, interval);
+	}
+}
+
+/*
+ * In ping mode ping all the ip addresses together, 'ping-count' slots per round.
+ */
+
+static long ping_interval(void)
+{
+	long round = (tint_ping > 0) ? tint_ping : 1000L * tint;
+
+	return (round + pingcount - 1) / pingcount;
+}
+
+static void schedule_ping(int have)
+{
+	struct list *act;
+	long round = (tint_ping > 0) ? tint_ping : 1000L * tint;
+
+	if (target_list == NULL)
+		return;
+
+	for (act = target_list; act != NULL; act = act->next) {
+		if (act->interval > 0)
+			log_message(LOG_WARNING, "ignoring check interval for ping target %s, all share %ld ms",
+				act->name, round);
+	}
+
+	sched_add_fd(ping_fd, ping_input, NULL);
+	if (!have)
+		sched_add("<ping>", "ping", run_ping, NULL, ping_interval());
+}
+
+static void check_pingcount(void)
+{
+	if (target_list != NULL && pingcount < 1) {
+		log_message(LOG_WARNING, "ping-count = %d is invalid, using 1", pingcount);
+		pingcount = 1;
+	}
+}
+
+/*
+ * Test binaries put in or taken out of the test directory while running.
+ */
+
+static void test_binary_added(struct list *act)
+{
+	schedule_entry(find_list_check("test-binary"), act);
+}
+
+static void find_act(struct sched_item *item, void *ptr)
+{
+	struct sched_item **found = (struct sched_item **)ptr;
+
+	if (item->act == (*found)->act)
+		*found = item;
+}
+
+static void test_binary_removed(struct list *act)
+{
+	struct sched_item key, *item = &key;
+
+	key.act = act;
+	sched_foreach(find_act, &item);
+	if (item != &key)
+		sched_del(item);
+}
+
+/*
+ * A monitored process has gone, or a test plugin has answered: run the
+ * check now rather than at the next tick.
+ */
+
+static void run_now(struct list *act)
+{
+	struct sched_item key, *item = &key;
+
+	key.act = act;
+	sched_foreach(find_act, &item);
+	if (item != &key)
+		sched_run_now(item);
+}
+
+/*
+ * Register every configured check with the scheduler. The order here is
+ * the order in which checks falling due together are run.
+ */
+
+static void schedule_checks(void)
+{
+	struct list *act;
+	int ii;
+
+	/* refresh watchdog device once per interval */
+	sched_add("<tick>", "tick", run_tick, NULL, 1000L * tint);
+
+	schedule_fixed(0);
+
+	for (ii = 0; ii < ARRAY_SIZE(list_checks); ii++) {
+		const struct list_check *lc = &list_checks[ii];
+
+		if (lc->list == &tr_bin_list)
+			schedule_ping(FALSE);
+
+		for (act = *lc->list; act != NULL; act = act->next)
+			schedule_entry(lc, act);
+	}
 }
 
 static void old_option(int c, char *configfile)
@@ -236,10 +642,15 @@ static void old_option(int c, char *configfile)
 	fprintf(stderr, "Option -%c is no longer valid, please specify it in %s.\n", c, configfile);
 }
 
-static void print_info(int sync_it, int force)
+/* What the entries of 'tr_bin_list' are, by version. */
+static const char *const bin_kind[] = {"test binary V0", "test/repair V1", "test plugin V2", "check module"};
+
+static void print_info(int force)
 {
 	struct list *act;
 
+	log_message(LOG_INFO, " config: %d lines read in %.3f ms from %d file(s)", config_lines, config_msec, config_files);
+
 	log_message(LOG_INFO, " int=%ds realtime=%s sync=%s load=%d,%d,%d soft=%s",
 		    tint,
 		    realtime ? "yes" : "no",
@@ -280,9 +691,16 @@ static void print_info(int sync_it, int force)
 	if (temp_list == NULL)
 		log_message(LOG_INFO, " temperature: no sensors to check");
 	else {
-		log_message(LOG_INFO, " temperature: maximum = %d", maxtemp);
-		for (act = temp_list; act != NULL; act = act->next)
-			log_message(LOG_INFO, " temperature: %s", act->name);
+		if (maxtemp_rise > 0)
+			log_message(LOG_INFO, " temperature: maximum = %d, rise = %d/min", maxtemp, maxtemp_rise);
+		else
+			log_message(LOG_INFO, " temperature: maximum = %d", maxtemp);
+		for (act = temp_list; act != NULL; act = act->next) {
+			if (act->parameter.temp.max > 0)
+				log_message(LOG_INFO, " temperature: %s (maximum = %d)", act->name, act->parameter.temp.max);
+			else
+				log_message(LOG_INFO, " temperature: %s", act->name);
+		}
 	}
 
 	if (tr_bin_list == NULL)
@@ -291,8 +709,7 @@ static void print_info(int sync_it, int force)
 		log_message(LOG_INFO, " test binary time-out = %d", test_timeout);
 		for (act = tr_bin_list; act != NULL; act = act->next)
 			log_message(LOG_INFO, " %s: %s",
-				act->version == 0 ? "test binary V0" : "test/repair V1",
-				act->name);
+				bin_kind[act->version], act->name);
 	}
 
 	if (repair_bin == NULL)
@@ -302,6 +719,26 @@ static void print_info(int sync_it, int force)
 		log_message(LOG_INFO, " repair binary: program = %s", repair_bin);
 	}
 
+	if (repair_batch)
+		log_message(LOG_INFO, " repair binary: run once per cycle for all failed checks");
+
+	if (repair_concurrency > 0)
+		log_message(LOG_INFO, " repair queue: %d at a time, backoff from %d seconds", repair_concurrency, repair_backoff);
+
+	log_message(LOG_INFO, " check intervals (ms, 0 = %d): file=%d pidfile=%d ping=%d interface=%d temperature=%d test=%d",
+		    1000 * tint, tint_file, tint_pidfile, tint_ping, tint_iface, tint_temp, tint_test);
+	log_message(LOG_INFO, " check intervals (ms, 0 = %d): load=%d memory=%d allocatable=%d file-table=%d",
+		    1000 * tint, tint_load, tint_memory, tint_alloc, tint_ftable);
+
+	if (check_threads > 1)
+		log_message(LOG_INFO, " check threads = %d", check_threads);
+
+	if (metrics_socket)
+		log_message(LOG_INFO, " metrics socket in %s", logdir);
+
+	if (cgroup_dir != NULL)
+		log_message(LOG_INFO, " cgroups in %s: cpu = %d%%, memory = %d MiB (0 = no limit)", cgroup_dir, cgroup_cpu_max, cgroup_memory_max);
+
 	log_message(LOG_INFO, " error retry time-out = %d seconds", retry_timeout);
 
 	if (repair_max > 0) {
@@ -310,6 +747,17 @@ static void print_info(int sync_it, int force)
 		log_message(LOG_INFO, " repair attempts = unlimited");
 	}
 
+	if (write_file == NULL)
+		log_message(LOG_INFO, " no write-file");
+	else
+		log_message(LOG_INFO, " write-file = %s: direct = %s, time-out = %d ms", write_file,
+			write_file_direct ? "yes" : "no", write_file_timeout);
+
+	if (refresh_thread) {
+		log_message(LOG_INFO, " refresh thread: interval = %d ms, stall time-out = %d seconds",
+			(refresh_interval > 0) ? refresh_interval : 1000 * tint, refresh_stall);
+	}
+
 	log_message(LOG_INFO, " alive=%s heartbeat=%s to=%s no_act=%s force=%s",
 		    (devname == NULL) ? "[none]" : devname,
 		    (heartbeat == NULL) ? "[none]" : heartbeat,
@@ -318,7 +766,7 @@ static void print_info(int sync_it, int force)
 		    (force == TRUE) ? "yes" : "no");
 }
 
-static void check_parameters(void)
+static int check_parameters(void)
 {
 	int err = 0;
 
@@ -329,22 +777,258 @@ static void check_parameters(void)
 		err = 1;
 	}
 
+	if (refresh_thread && refresh_interval >= 1000 * (dev_timeout - 1)) {
+		log_message(LOG_ERR,
+			    "This refresh interval (%d ms) might reboot the system between refreshes! Try %d or less",
+			    refresh_interval, 1000 * (dev_timeout - 1) - 1);
+		err = 1;
+	}
+
 	if (maxload1 > 0 && maxload1 < MINLOAD) {
 		log_message(LOG_ERR, "Using this maximal load average (%d) might reboot the system too often!",
 			    maxload1);
 		err = 1;
 	}
 
-	if (err) {
-		fatal_error(EX_USAGE, "To force parameter(s) use the --force command line option.");
+	return err;
+}
+
+static int str_changed(const char *a, const char *b)
+{
+	if (a == NULL || b == NULL)
+		return (a != b);
+
+	return (strcmp(a, b) != 0);
+}
+
+struct item_array {
+	struct sched_item **item;
+	int num;
+	int size;
+};
+
+static void collect_item(struct sched_item *item, void *ptr)
+{
+	struct item_array *items = (struct item_array *)ptr;
+
+	if (items->num >= items->size) {
+		int nsize = (items->size > 0) ? 2 * items->size : 64;
+		struct sched_item **tmp = realloc(items->item, nsize * sizeof(*tmp));
+
+		if (tmp == NULL) {
+			fatal_error(EX_SYSERR, "out of memory reloading %d checks", nsize);
+		}
+		items->item = tmp;
+		items->size = nsize;
+	}
+
+	items->item[items->num++] = item;
+}
+
+/*
+ * Read the configuration file again on SIGHUP. The device stays open and
+ * checks that are still configured keep their schedule, statistics and
+ * repair state (see reload.c). The cost is still that of the whole
+ * configuration: every file is read (or its cache checked) and every entry
+ * hashed and paired, and the file, pidfile and interface watches are set
+ * up again for the new entries. A few settings can only take effect on a
+ * restart, those keep their running values.
+ */
+
+static void reload(char *configfile, int force)
+{
+	char *old_devname = devname;
+	char *old_logdir = logdir;
+	char *old_write_file = write_file;
+	char *old_heartbeat = heartbeat;
+	char *old_test_dir = test_dir;
+	char *old_cgroup_dir = cgroup_dir;
+	int old_dev_timeout = dev_timeout;
+	int old_refresh_thread = refresh_thread;
+	int old_realtime = realtime;
+	int old_schedprio = schedprio;
+	int old_check_threads = check_threads;
+	int old_metrics = metrics_socket;
+	int old_direct = write_file_direct;
+	int old_hbstamps = hbstamps;
+	int old_maxtemp = maxtemp;
+	int old_cpu_max = cgroup_cpu_max;
+	int old_memory_max = cgroup_memory_max;
+	struct item_array items = {NULL, 0, 0};
+	unsigned int have_fixed = 0;
+	int have_ping = FALSE;
+	int ii;
+
+	log_message(LOG_NOTICE, "reloading %s", configfile);
+
+	if (reload_begin(configfile) != ENOERR)
+		return;
+
+	if (read_config(configfile) != ENOERR) {
+		reload_abort();
+		return;
+	}
+
+	reload_match();
+
+	if (softboot)
+		retry_timeout = 0;
+
+	if (str_changed(devname, old_devname) || refresh_thread != old_refresh_thread) {
+		log_message(LOG_WARNING, "watchdog device changes need a restart, keeping the running settings");
+		devname = old_devname;
+		refresh_thread = old_refresh_thread;
+	}
+
+	if (str_changed(logdir, old_logdir) || realtime != old_realtime || schedprio != old_schedprio) {
+		log_message(LOG_WARNING, "log-dir, realtime and priority changes need a restart, keeping the running settings");
+		logdir = old_logdir;
+		realtime = old_realtime;
+		schedprio = old_schedprio;
+	}
+
+	/* The refresh thread writes the heartbeat file, so leave it alone. */
+	if (refresh_thread && (str_changed(heartbeat, old_heartbeat) || hbstamps != old_hbstamps)) {
+		log_message(LOG_WARNING, "heartbeat changes need a restart with the refresh thread, keeping the running settings");
+		heartbeat = old_heartbeat;
+		hbstamps = old_hbstamps;
+	}
+
+	if (!force && check_parameters()) {
+		log_message(LOG_ERR, "using the reloaded configuration in spite of the above");
+	}
+
+	if (dev_timeout != old_dev_timeout)
+		set_watchdog_timeout(dev_timeout);
+
+	check_pingcount();
+
+	/* Move the scheduled checks over to their new entries, dropping those now gone. */
+	sched_foreach(collect_item, &items);
+
+	for (ii = 0; ii < items.num; ii++) {
+		struct sched_item *item = items.item[ii];
+		const struct list_check *lc = find_list_check(item->type);
+		int fc = find_fixed_check(item->type);
+		struct list *act;
+
+		if (strcmp(item->type, "tick") == 0) {
+			sched_set_interval(item, 1000L * tint);
+			continue;
+		}
+
+		if (strcmp(item->type, "ping") == 0) {
+			if (target_list == NULL) {
+				sched_del(item);
+			} else {
+				have_ping = TRUE;
+				sched_set_interval(item, ping_interval());
+			}
+			continue;
+		}
+
+		if (fc >= 0) {
+			const char *name;
+			long interval;
+
+			if (!fixed_config(fc, &name, &act, &interval)) {
+				sched_del(item);
+				continue;
+			}
+			have_fixed |= 1u << fc;
+			item->name = name;
+			item->act = act;
+			sched_set_interval(item, interval);
+			continue;
+		}
+
+		if (lc == NULL) {
+			sched_del(item);
+			continue;
+		}
+
+		act = reload_entry(lc->list, item->act);
+		if (act == NULL) {
+			sched_del(item);
+			continue;
+		}
+
+		item->act = act;
+		item->name = act->name;
+		sched_set_interval(item, entry_interval(act, *lc->tint_type));
 	}
+
+	free(items.item);
+
+	/* While the old ping targets are still there to compare with. */
+	if (ping_fd != -1)
+		sched_del_fd(ping_fd);
+	ping_fd = reload_pinger(target_list);
+
+	schedule_fixed(have_fixed);
+	schedule_ping(have_ping);
+
+	for (ii = 0; ii < ARRAY_SIZE(list_checks); ii++) {
+		const struct list_check *lc = &list_checks[ii];
+		struct list *act;
+
+		if (!reload_changed(lc->list))
+			continue;
+
+		for (act = *lc->list; act != NULL; act = act->next) {
+			if (reload_is_new(lc->list, act))
+				schedule_entry(lc, act);
+		}
+	}
+
+	/* Before the plugins, which may be started again. */
+	if (str_changed(cgroup_dir, old_cgroup_dir)) {
+		close_cgroups();
+		open_cgroups();
+	} else if (cgroup_cpu_max != old_cpu_max || cgroup_memory_max != old_memory_max) {
+		reload_cgroups();
+	}
+
+	/* The watches point to the entries, which are all new. */
+	reload_filewatch();
+	reload_pidwatch();
+	reload_plugins();
+	reload_modules();
+	reload_repairs();
+	reload_iface();
+
+	if (reload_changed(&temp_list) || maxtemp != old_maxtemp)
+		open_tempcheck(temp_list);
+
+	if (check_threads != old_check_threads)
+		open_pool(check_threads);
+
+	if (str_changed(test_dir, old_test_dir))
+		open_testdir(test_dir, test_binary_added, test_binary_removed);
+
+	if (metrics_socket != old_metrics) {
+		close_metrics();
+		open_metrics();
+	}
+
+	if (str_changed(write_file, old_write_file) || write_file_direct != old_direct)
+		reload_diskprobe();
+
+	if (str_changed(heartbeat, old_heartbeat) || hbstamps != old_hbstamps)
+		open_heartbeat();
+
+	reload_end();
+
+	if (verbose)
+		print_info(force);
 }
 
 int main(int argc, char *const argv[])
 {
-	int c, foreground = FALSE, force = FALSE, sync_it = FALSE;
+	int c, foreground = FALSE, force = FALSE;
 	char *configfile = CONFIG_FILENAME;
-	struct list *act;
+	struct sched_item *due[256];
+	int results[ARRAY_SIZE(due)];
 	char *progname;
 	char *opts = "d:i:n:Ffsvbql:p:t:c:r:m:a:X:";
 	struct option long_options[] = {
@@ -358,9 +1042,6 @@ int main(int argc, char *const argv[])
 		{"loop-exit", required_argument, NULL, 'X'},
 		{NULL, 0, NULL, 0}
 	};
-	long count = 0L;
-	long count_max = 0L;
-	unsigned long swait, twait;
 
 	progname = basename(argv[0]);
 	open_logging(progname, MSG_TO_STDERR | MSG_TO_SYSLOG);
@@ -419,8 +1100,8 @@ int main(int argc, char *const argv[])
 		retry_timeout = 0;
 	}
 
-	if (!force) {
-		check_parameters();
+	if (!force && check_parameters()) {
+		fatal_error(EX_USAGE, "To force parameter(s) use the --force command line option.");
 	}
 
 	/* make sure we get our own log directory */
@@ -430,7 +1111,8 @@ int main(int argc, char *const argv[])
 
 	/* set up pinging if in ping mode */
 	if (target_list != NULL) {
-		open_netcheck(target_list);
+		check_pingcount();
+		ping_fd = open_pinger(target_list);
 	}
 
 	if (!foreground) {
@@ -453,10 +1135,10 @@ int main(int argc, char *const argv[])
 
 	/* Log the starting message */
 	log_message(LOG_NOTICE, "starting daemon (%d.%d):", MAJOR_VERSION, MINOR_VERSION);
-	print_info(sync_it, force);
+	print_info(force);
 
-	/* open the device */
-	if (no_act == FALSE) {
+	/* open the device, with --no-action only a stand-in for testing */
+	if (no_act == FALSE || stand_in_device(devname)) {
 		open_watchdog(devname, dev_timeout);
 	}
 
@@ -474,117 +1156,79 @@ int main(int argc, char *const argv[])
 
 	lock_our_memory(realtime, schedprio, daemon_pid);
 
-	/* Short wait (50ms OK?) in case test binaries return quickly, then
-	 * remaining 'twait' should make watchdog sleep 'tint' seconds total.
-	 */
-	swait = 50000;
-	twait = (tint * 1000000) - swait;
-	
-	/*
-        ====================================
-        custom block to check disk status
-        ====================================
-        */
-
-        int wrf_fd_ret = 0;
-        if (write_file == NULL)
-                syslog(LOG_INFO, "no write_file ");
-        if(write_file != NULL)
-                syslog(LOG_INFO, "write_file is %s", write_file);
-        /* main loop: update after <tint> seconds */
-        while (_running) {
-        /* if the write file is not mentioned in the config file, this binary will only write to the watchdog device.
-        to mention the write file, update "write-file = watchdog.txt" in /etc/watchdog.conf
-        In case the filesystem becomes readonly or disk is unaccessible the write fails and the watchdog process will exit
-        without properly closing the watchdog device file.
-        */
-        if (write_file != NULL) {
-            int wrf_fd = open(write_file, O_CREAT | O_WRONLY | O_SYNC, 00600);
-            if (wrf_fd == -1) {
-                perror(write_file);
-		panic();
-                exit(EXIT_FAILURE);
-            }
-
-            // Write "w" to the file (or any other necessary content)
-            wrf_fd_ret = write(wrf_fd, "w", 1);
-            if (wrf_fd_ret == 1) {
-                // Your action here (keep_alive, repair_bin, etc.)
-                wd_action(keep_alive(), repair_bin, NULL);
-            } else {
-                fprintf(stderr, "write_file is %s write failed status %d\n", write_file, wrf_fd_ret);
-                close(wrf_fd);
-		panic();
-                exit(EXIT_FAILURE);
-            }
-            close(wrf_fd);
-          } else {
-            // If no file is specified, just perform the keep_alive action
-            wd_action(keep_alive(), repair_bin, NULL);
-          }
-		/* sync system if we have to */
-		do_check(sync_system(sync_it), repair_bin, NULL);
-
-		/* check file table */
-		do_check(check_file_table(), repair_bin, NULL);
-
-		/* check load average */
-		do_check(check_load(), repair_bin, loadtimer);
-
-		/* check free memory */
-		do_check(check_memory(), repair_bin, memtimer);
-
-		/* check allocatable memory */
-		do_check(check_allocatable(), repair_bin, alloctimer);
-
-		/* check temperature */
-		for (act = temp_list; act != NULL; act = act->next)
-			do_check(check_temp(act), repair_bin, act);
-
-		/* in filemode stat file */
-		for (act = file_list; act != NULL; act = act->next)
-			do_check(check_file_stat_safe(act), repair_bin, act);
-
-		/* in pidmode use "kill -0" to ping processes ID */
-		for (act = pidfile_list; act != NULL; act = act->next)
-			do_check(check_pidfile(act), repair_bin, act);
-
-		/* in network mode check the given devices for input */
-		for (act = iface_list; act != NULL; act = act->next)
-			do_check(check_iface(act), repair_bin, act);
-
-		/* in ping mode ping the ip address */
-		for (act = target_list; act != NULL; act = act->next)
-			do_check(check_net
-				 (act->name, act->parameter.net.sock_fp, act->parameter.net.to,
-				  act->parameter.net.packet, tint, pingcount), repair_bin, act);
+	/* hand the device refresh over to its own thread */
+	if (refresh_thread) {
+		start_refresh_thread();
+	}
 
-		/* test, or test/repair binaries in the watchdog.d directory */
-		for (act = tr_bin_list; act != NULL; act = act->next)
-			do_check(check_bin(act->name, test_timeout, act->version), repair_bin, act);
+	open_diskprobe();
+
+	timing_init();
+	reload_init();
+	open_sched();
+	open_cgroups();
+	schedule_checks();
+	open_filewatch(file_list);
+	open_pidwatch(pidfile_list, run_now);
+	open_plugins(run_now);
+	open_repairs(repairs_failed);
+	open_iface(iface_list);
+	open_testdir(test_dir, test_binary_added, test_binary_removed);
+	open_metrics();
+	open_pool(check_threads);
+
+	/* main loop: run each check as it falls due */
+	while (_running) {
+		int ii, n = sched_wait(due, ARRAY_SIZE(due));
+
+		/* procfs and sysfs files are read afresh once per batch */
+		snap_next_cycle();
+
+		/* one netlink dump gives the counters for all interface checks of the batch */
+		for (ii = 0; ii < n; ii++) {
+			if (due[ii]->func == check_iface) {
+				update_iface_stats();
+				break;
+			}
+		}
 
-		/* in case test binaries return quickly */
-		xusleep(swait);
-		check_bin(NULL, test_timeout, 0);
+		/* run the batch, concurrently if we can, then act on results in order */
+		pool_run(due, results, n);
 
-		/* finally sleep for a full cycle */
-		/* we have just triggered the device with the last check */
-		xusleep(twait);
+		for (ii = 0; ii < n && _running; ii++) {
+			do_check(results[ii], repair_bin, due[ii]->act, due[ii]->type);
+		}
 
-		count++;
+		/* one run of the repair binary for all the checks of the batch that need it */
+		flush_repairs(repair_bin);
 
-		/* do verbose logging */
-		if (verbose && logtick && (--ticker == 0)) {
-			ticker = logtick;
-			log_message(LOG_DEBUG, "still alive after %ld interval(s)", count);
-		}
+		/* dump the timing histograms if asked to by SIGUSR1 */
+		timing_check_dump();
 
-		if (count_max > 0 && count >= count_max) {
-			log_message(LOG_WARNING, "loop exit on interval counter reached");
-			_running = 0;
-		}
+		/* read the config file again if asked to by SIGHUP */
+		if (_running && reload_pending())
+			reload(configfile, force);
 	}
 
+	sched_log_stats();
+	pool_log_stats();
+	ping_log_stats();
+	diskprobe_log_stats();
+	timing_log_stats();
+	close_pool();
+	close_testdir();
+	close_plugins();
+	close_modules();
+	close_repairs();
+	close_cgroups();
+	close_filewatch();
+	close_pidwatch();
+	close_iface();
+	close_metrics();
+	close_sched();
+	close_pinger();
+	close_diskprobe();
+
 	/* The terminate() function closes all lists. */
 	terminate(EXIT_SUCCESS);
 	/* not reached */
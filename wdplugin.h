@@ -0,0 +1,49 @@
+/* > wdplugin.h
+ *
+ * Interface for check modules, the shared objects loaded by the watchdog
+ * from its "plugin-directory". A module is run in the daemon itself, so a
+ * check costs a function call rather than starting a test binary.
+ *
+ * Each module defines a 'struct wdplugin' called 'wdplugin' with its entry
+ * points. Each of them is given the module's context, allocated by the
+ * watchdog, and returns 0 for success or an error code as a test binary
+ * would exit with (see watch_err.h). A call that takes longer than the
+ * "plugin-timeout-ms" setting is reported as an error. The calls are all
+ * made one at a time from the same thread, but not from the main thread of
+ * the daemon, so a module must not block signals or fork.
+ *
+ * This file is only ever added to: a module built against one version of
+ * it will load into a watchdog built with a later one.
+ *
+ */
+
+#ifndef _WDPLUGIN_H
+#define _WDPLUGIN_H
+
+#define WDPLUGIN_ABI		1	/* Version of this interface. */
+#define WDPLUGIN_SYMBOL		"wdplugin"
+#define WDPLUGIN_SCRATCH	256	/* Size of the context's scratch space. */
+
+struct wdplugin_ctx {
+	int abi;			/* WDPLUGIN_ABI of the watchdog. */
+	const char *path;		/* File the module was loaded from. */
+	int timeout_ms;			/* Time allowed for each check. */
+	void *data;			/* For the module, NULL to start with. */
+	union {				/* For the module, zero to start with. */
+		unsigned char bytes[WDPLUGIN_SCRATCH];
+		long long align;
+		void *ptr;
+	} scratch;
+};
+
+struct wdplugin {
+	int abi;			/* WDPLUGIN_ABI the module was built for. */
+	int (*init)(struct wdplugin_ctx *ctx);			/* May be NULL. */
+	int (*check)(struct wdplugin_ctx *ctx);
+	int (*repair)(struct wdplugin_ctx *ctx, int error);	/* May be NULL, for no repair. */
+	void (*teardown)(struct wdplugin_ctx *ctx);		/* May be NULL. */
+};
+
+extern const struct wdplugin wdplugin;
+
+#endif /* _WDPLUGIN_H */